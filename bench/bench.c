@@ -0,0 +1,913 @@
+/*
+ * Benchmark harness.
+ *   Usage: ./bin/yarn-bench [-r<runs>] [-j] [-s<n,n,...>] [-t<slice>]
+ *                           [-p<n,n,...>] [-u] [-f<n,n,...>] [-m<bytes>] [-c]
+ *                           [-a<n,n,...>] [-e] [-k<n,n,...>] [-x[<dir>]]
+ *                           [-J] code.o...
+ *   Runs every object file to completion <runs> times (default 20) on a fresh
+ *   state and reports guest instructions per second, nanoseconds per
+ *   instruction and the peak RSS of the process so far, for the engine this
+ *   binary was built with, or for the JIT with -j.
+ *   With -s, runs each object file in n states at once through a scheduler
+ *   for every n listed, giving each state <slice> instructions per turn
+ *   (default 1000), and reports the aggregate throughput. Adding -p runs the
+ *   states on a thread pool instead, once for every thread count listed.
+ *   The states share one image of the code unless -u is given, which loads a
+ *   private copy into every state.
+ *   With -f, snapshots a state with 1MB of memory before it starts and forks n
+ *   states from it for every n listed. Reports the cost per fork, both copy on
+ *   write and by copying the memory, and the throughput of the forks.
+ *   With -m, the states of a plain run get a paged memory of <bytes> instead,
+ *   and the memory they touched is reported too.
+ *   With -c, measures the round trip of a syscall instead: runs code that is
+ *   nothing but syscalls, into a builtin, into host syscalls using the
+ *   argument helpers or yarn_getRegister/yarn_setRegister, and into one with a
+ *   key only the hash map holds, and reports nanoseconds per call next to a
+ *   nop.
+ *   With -a, n states on one scheduler make asynchronous syscalls for every n
+ *   listed, the host completing them in batches between runs. Reports the
+ *   cost of a suspend and resume round trip.
+ *   With -e, calls the function at address 0 of every object file from the
+ *   host with yarn_call, once per event, and reports the cost of a call.
+ *   With -k, runs every object file in a state with 64MB of memory (or paged
+ *   memory of <bytes> with -m) and checkpoints it every n instructions for
+ *   every n listed, a full checkpoint first and deltas after it. Reports the
+ *   cost and size of both and the cost of loading the stream back.
+ *   With -x, the files are assembly sources instead, assembled with
+ *   yarn_assemble over and over. Reports lines and bytes of source per second.
+ *   Given a directory, the code is also compared to <dir>/<name>.o, like
+ *   bench/build.sh has tools/assemble.py write into bin/, and a difference
+ *   fails the run.
+ *   With -J, every result is printed as a JSON object on a line of its own.
+ *   bench/run.sh runs the whole suite this way.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define BENCH_RUSAGE
+#endif
+
+#include "../src/yarn.h"
+#include "../src/yarn_asm.h"
+#include "../src/yarn_pool.h"
+#include "../src/yarn_sched.h"
+
+#if defined(YARN_COMPUTED_GOTO) && defined(__GNUC__)
+#define BENCH_ENGINE "threaded"
+#else
+#define BENCH_ENGINE "switch"
+#endif
+
+static int json = 0;
+static size_t pagedsize = 0; // Memory of a paged state for -m, 0 for flat
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Peak resident set size of the process so far in KB, 0 if unknown.
+static long peakRSS(void) {
+#ifdef BENCH_RUSAGE
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    return usage.ru_maxrss/1024; // Bytes there, KB everywhere else
+#else
+    return usage.ru_maxrss;
+#endif
+  }
+#endif
+  return 0;
+}
+
+// Starts a JSON result with the fields every benchmark has. The caller adds
+// its own and closes it with printJSONEnd.
+static void printJSONStart(const char *mode, const char *path, int jit) {
+  printf("{\"mode\": \"%s\", \"build\": \"%s\", \"engine\": \"%s\", \"program\": \"",
+         mode, BENCH_ENGINE, jit ? "jit" : BENCH_ENGINE);
+  for (; *path; path++) {
+    if (*path == '"' || *path == '\\') {
+      putchar('\\');
+    }
+    putchar(*path);
+  }
+  printf("\"");
+}
+static void printJSONEnd(void) {
+  printf(", \"peak_rss_kb\": %ld}\n", peakRSS());
+}
+
+static char *readFile(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  char *buffer;
+  if (!fp) {
+    return NULL;
+  }
+  fseek(fp, 0L, SEEK_END);
+  *size = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+  buffer = malloc(*size ? *size : 1);
+  if (buffer != NULL && fread(buffer, 1, *size, fp) != *size) {
+    free(buffer);
+    buffer = NULL;
+  }
+  fclose(fp);
+  return buffer;
+}
+
+// Creates a state running code from the shared image I, or from its own copy
+// of the code when I is NULL.
+static yarn_state *newState(char *code, size_t size, yarn_image *I, int jit) {
+  yarn_state *Y = yarn_init(256*sizeof(yarn_int));
+  if (Y == NULL) {
+    return NULL;
+  }
+  if ((I ? yarn_loadImage(Y, I) : yarn_loadCode(Y, code, size)) != 0 ||
+      yarn_setOption(Y, YARN_OPTION_JIT, jit) != 0) {
+    yarn_destroy(Y);
+    return NULL;
+  }
+  return Y;
+}
+
+static int benchFile(const char *path, int runs, int jit) {
+  size_t size, instructions = 0, used = 0;
+  double best = -1, total = 0;
+  int status = YARN_STATUS_OK;
+  char *code = readFile(path, &size);
+
+  if (code == NULL) {
+    printf("Unable to load %s\n", path);
+    return -1;
+  }
+  for (int i = 0; i < runs; i++) {
+    yarn_state *Y = pagedsize ? yarn_initPaged(pagedsize, 0) :
+                                yarn_init(256*sizeof(yarn_int));
+    double start, elapsed;
+    if (Y == NULL || yarn_loadCode(Y, code, size) != 0 ||
+        yarn_setOption(Y, YARN_OPTION_JIT, jit) != 0) {
+      printf("Unable to create Yarn state.\n");
+      free(code);
+      return -1;
+    }
+    start = now();
+    status = yarn_execute(Y, -1);
+    elapsed = now() - start;
+    instructions = yarn_getInstructionCount(Y);
+    used = yarn_getMemoryUsed(Y);
+    total += elapsed;
+    if (best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+    yarn_destroy(Y);
+  }
+  if (json) {
+    printJSONStart(pagedsize ? "paged" : "single", path, jit);
+    printf(", \"runs\": %d, \"instructions\": %zu, \"minst_per_s\": %.2f, "
+           "\"ns_per_inst\": %.3f, \"status\": \"%s\"", runs, instructions,
+           instructions/best/1e6, total/runs/instructions*1e9,
+           yarn_statusToString(status));
+    if (pagedsize) {
+      printf(", \"memsize\": %zu, \"memory_used\": %zu", pagedsize, used);
+    }
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %10zu insts  %8.2f Minst/s (best)  %6.2f ns/inst (mean)  %7ld KB peak  %s",
+           jit ? "jit" : BENCH_ENGINE, path, instructions, instructions/best/1e6,
+           total/runs/instructions*1e9, peakRSS(), yarn_statusToString(status));
+    if (pagedsize) {
+      printf("  %zu of %zu bytes used", used, pagedsize);
+    }
+    printf("\n");
+  }
+  free(code);
+  return 0;
+}
+
+static int benchScheduler(const char *path, int nstates, int slice, int jit,
+                          int shared) {
+  size_t size;
+  double start, elapsed, setup;
+  yarn_state **states;
+  yarn_scheduler *S;
+  yarn_image *I = NULL;
+  char *code = readFile(path, &size);
+
+  if (code == NULL) {
+    printf("Unable to load %s\n", path);
+    return -1;
+  }
+  states = calloc(nstates, sizeof(yarn_state *));
+  S = yarn_schedulerInit(slice);
+  if (states == NULL || S == NULL) {
+    printf("Unable to create scheduler.\n");
+    free(code);
+    return -1;
+  }
+  start = now();
+  if (shared && (I = yarn_imageInit(code, size)) == NULL) {
+    printf("Unable to create Yarn image.\n");
+    return -1;
+  }
+  for (int i = 0; i < nstates; i++) {
+    states[i] = newState(code, size, I, jit);
+    if (states[i] == NULL || yarn_schedulerAdd(S, states[i]) < 0) {
+      printf("Unable to create Yarn state.\n");
+      return -1;
+    }
+  }
+  setup = now() - start;
+  if (I != NULL) {
+    yarn_imageRelease(I);
+  }
+
+  start = now();
+  yarn_schedulerRun(S, -1);
+  elapsed = now() - start;
+  if (json) {
+    printJSONStart("scheduler", path, jit);
+    printf(", \"states\": %d, \"slice\": %d, \"shared\": %s, "
+           "\"setup_us_per_state\": %.3f, \"instructions\": %zu, "
+           "\"minst_per_s\": %.2f", nstates, slice, shared ? "true" : "false",
+           setup/nstates*1e6, yarn_schedulerInstructionCount(S),
+           yarn_schedulerInstructionCount(S)/elapsed/1e6);
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %7d states  %8.2f us/state setup  %12zu insts  %8.2f Minst/s  %7ld KB peak\n",
+           jit ? "jit" : BENCH_ENGINE, path, nstates, setup/nstates*1e6,
+           yarn_schedulerInstructionCount(S),
+           yarn_schedulerInstructionCount(S)/elapsed/1e6, peakRSS());
+  }
+
+  for (int i = 0; i < nstates; i++) {
+    yarn_destroy(states[i]);
+  }
+  yarn_schedulerDestroy(S);
+  free(states);
+  free(code);
+  return 0;
+}
+
+static int benchPool(const char *path, int nstates, int nthreads, int slice,
+                     int jit, int shared) {
+  size_t size;
+  double start, elapsed;
+  yarn_state **states;
+  yarn_pool *P;
+  yarn_image *I = NULL;
+  char *code = readFile(path, &size);
+
+  if (code == NULL) {
+    printf("Unable to load %s\n", path);
+    return -1;
+  }
+  states = calloc(nstates, sizeof(yarn_state *));
+  P = yarn_poolInit(nthreads, slice);
+  if (states == NULL || P == NULL) {
+    printf("Unable to create thread pool.\n");
+    free(code);
+    return -1;
+  }
+  if (shared && (I = yarn_imageInit(code, size)) == NULL) {
+    printf("Unable to create Yarn image.\n");
+    return -1;
+  }
+  for (int i = 0; i < nstates; i++) {
+    if ((states[i] = newState(code, size, I, jit)) == NULL) {
+      printf("Unable to create Yarn state.\n");
+      return -1;
+    }
+  }
+  if (I != NULL) {
+    yarn_imageRelease(I);
+  }
+
+  start = now();
+  for (int i = 0; i < nstates; i++) {
+    if (yarn_poolSubmit(P, states[i], NULL, NULL) != 0) {
+      printf("Unable to submit Yarn state.\n");
+      return -1;
+    }
+  }
+  yarn_poolWait(P);
+  elapsed = now() - start;
+  if (json) {
+    printJSONStart("pool", path, jit);
+    printf(", \"states\": %d, \"threads\": %d, \"slice\": %d, \"shared\": %s, "
+           "\"instructions\": %zu, \"minst_per_s\": %.2f", nstates,
+           yarn_poolThreads(P), slice, shared ? "true" : "false",
+           yarn_poolInstructionCount(P),
+           yarn_poolInstructionCount(P)/elapsed/1e6);
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %7d states %3d threads  %12zu insts  %8.2f Minst/s  %7ld KB peak\n",
+           jit ? "jit" : BENCH_ENGINE, path, nstates, yarn_poolThreads(P),
+           yarn_poolInstructionCount(P),
+           yarn_poolInstructionCount(P)/elapsed/1e6, peakRSS());
+  }
+
+  yarn_poolDestroy(P);
+  for (int i = 0; i < nstates; i++) {
+    yarn_destroy(states[i]);
+  }
+  free(states);
+  free(code);
+  return 0;
+}
+
+#define BENCH_FORKMEM (1024*1024)
+
+static int benchFork(const char *path, int nforks, int jit) {
+  size_t size, instructions = 0;
+  double start, forktime, copytime, runtime;
+  yarn_state **states = calloc(nforks, sizeof(yarn_state *));
+  yarn_state *Y = yarn_init(BENCH_FORKMEM);
+  yarn_snap *S;
+  char *code = readFile(path, &size);
+
+  if (code == NULL || states == NULL || Y == NULL ||
+      yarn_loadCode(Y, code, size) != 0 ||
+      yarn_setOption(Y, YARN_OPTION_JIT, jit) != 0 ||
+      (S = yarn_snapshot(Y)) == NULL) {
+    printf("Unable to snapshot %s\n", path);
+    return -1;
+  }
+
+  // What a fork saves: a fresh state plus a copy of the snapshot's memory.
+  start = now();
+  for (int i = 0; i < nforks; i++) {
+    states[i] = yarn_init(BENCH_FORKMEM);
+    if (states[i] == NULL) {
+      printf("Unable to create Yarn state.\n");
+      return -1;
+    }
+    memcpy(yarn_getMemoryPtr(states[i]), yarn_getMemoryPtr(Y), BENCH_FORKMEM);
+  }
+  copytime = now() - start;
+  for (int i = 0; i < nforks; i++) {
+    yarn_destroy(states[i]);
+  }
+
+  start = now();
+  for (int i = 0; i < nforks; i++) {
+    if ((states[i] = yarn_fork(S)) == NULL) {
+      printf("Unable to fork Yarn state.\n");
+      return -1;
+    }
+  }
+  forktime = now() - start;
+  start = now();
+  for (int i = 0; i < nforks; i++) {
+    yarn_execute(states[i], -1);
+    instructions += yarn_getInstructionCount(states[i]);
+  }
+  runtime = now() - start;
+  if (json) {
+    printJSONStart("fork", path, jit);
+    printf(", \"forks\": %d, \"fork_us\": %.3f, \"copy_us\": %.3f, "
+           "\"instructions\": %zu, \"minst_per_s\": %.2f", nforks,
+           forktime/nforks*1e6, copytime/nforks*1e6, instructions,
+           instructions/runtime/1e6);
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %7d forks  %8.2f us/fork  %8.2f us/copy  %8.2f Minst/s  %7ld KB peak\n",
+           jit ? "jit" : BENCH_ENGINE, path, nforks, forktime/nforks*1e6,
+           copytime/nforks*1e6, instructions/runtime/1e6, peakRSS());
+  }
+
+  for (int i = 0; i < nforks; i++) {
+    yarn_destroy(states[i]);
+  }
+  yarn_snapshotRelease(S);
+  yarn_destroy(Y);
+  free(states);
+  free(code);
+  return 0;
+}
+
+/*
+ * Syscall round trip for -c. Every case runs BENCH_SYSCALLS copies of one
+ * instruction and a halt on one state, runs*100 times, so the time per call
+ * includes its dispatch like a real one would.
+ */
+#define BENCH_SYSCALLS 1000
+
+// Writes n syscalls of key (nops if syscall is 0) and a halt into code,
+// returns its size.
+static size_t syscallCode(char *code, int n, int syscall, yarn_uint key) {
+  size_t size = 0;
+  for (int i = 0; i < n; i++) {
+    if (syscall) {
+      code[size++] = YARN_INST_SYSCALL;
+      for (int b = 0; b < YARN_WORDSIZE; b++) { // Little endian
+        code[size++] = (char)(key >> 8*b & 0xFF);
+      }
+    } else {
+      code[size++] = YARN_INST_NOP;
+    }
+  }
+  code[size++] = YARN_INST_HALT;
+  return size;
+}
+
+// Host syscalls count their calls through the userdata and return their
+// argument plus the count.
+static void benchSysHelpers(yarn_state *Y) {
+  size_t *calls = yarn_getUserdata(Y);
+  yarn_returnUint(Y, yarn_argUint(Y, 0) + (yarn_uint)++*calls);
+}
+static void benchSysRegisters(yarn_state *Y) {
+  size_t *calls = yarn_getUserdata(Y);
+  yarn_uint stk = 0, val = 0;
+  yarn_getRegister(Y, YARN_REG_STACK, &stk);
+  yarn_getMemory(Y, stk, &val, sizeof(val));
+  val += (yarn_uint)++*calls;
+  yarn_setRegister(Y, YARN_REG_RETURN, &val);
+}
+
+static int benchSyscalls(int runs, int jit) {
+  static const struct {
+    const char *name;
+    int syscall;            // Else a nop
+    yarn_uint key;
+    yarn_CFunc fun;         // NULL for a builtin
+  } cases[] = {
+    { "nop",       0, 0,       NULL              },
+    { "builtin",   1, 0x01,    NULL              },
+    { "helpers",   1, 0x10,    benchSysHelpers   },
+    { "registers", 1, 0x11,    benchSysRegisters },
+    { "hashed",    1, 0x10000, benchSysHelpers   },
+  };
+  char code[BENCH_SYSCALLS*YARN_LEN_BRANCH + 1];
+
+  for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); c++) {
+    size_t size = syscallCode(code, BENCH_SYSCALLS, cases[c].syscall,
+                              cases[c].key);
+    size_t calls = 0;
+    double best = -1, total = 0;
+    int reps = runs*100;
+    yarn_state *Y = yarn_init(256*sizeof(yarn_int));
+    if (Y == NULL || yarn_loadCode(Y, code, size) != 0 ||
+        yarn_setOption(Y, YARN_OPTION_JIT, jit) != 0 ||
+        (cases[c].fun != NULL &&
+         yarn_registerSysCall(Y, cases[c].key, cases[c].fun) != 0)) {
+      printf("Unable to create Yarn state.\n");
+      return -1;
+    }
+    yarn_setUserdata(Y, &calls);
+    for (int r = 0; r < reps; r++) {
+      yarn_uint ip = 0;
+      double start, elapsed;
+      yarn_setRegister(Y, YARN_REG_INSTRUCTION, &ip);
+      yarn_setStatus(Y, YARN_STATUS_OK);
+      start = now();
+      yarn_execute(Y, -1);
+      elapsed = now() - start;
+      total += elapsed;
+      if (best < 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    if (yarn_getStatus(Y) != YARN_STATUS_HALT) {
+      printf("Syscall %s failed: %s\n", cases[c].name,
+             yarn_statusToString(yarn_getStatus(Y)));
+      yarn_destroy(Y);
+      return -1;
+    }
+    if (json) {
+      printJSONStart("syscall", cases[c].name, jit);
+      printf(", \"key\": %lu, \"calls\": %d, \"ns_per_call\": %.3f, "
+             "\"ns_per_call_mean\": %.3f", (unsigned long)cases[c].key,
+             BENCH_SYSCALLS, best/BENCH_SYSCALLS*1e9,
+             total/reps/BENCH_SYSCALLS*1e9);
+      printJSONEnd();
+    } else {
+      printf("%-8s syscall %-10s 0x%05lX  %8.2f ns/call (best)  %8.2f ns/call (mean)\n",
+             jit ? "jit" : BENCH_ENGINE, cases[c].name,
+             (unsigned long)cases[c].key,
+             best/BENCH_SYSCALLS*1e9, total/reps/BENCH_SYSCALLS*1e9);
+    }
+    yarn_destroy(Y);
+  }
+  return 0;
+}
+
+/*
+ * Asynchronous syscalls for -a. n states on one scheduler each make
+ * BENCH_ASYNC syscalls that suspend them. Like an event loop, the host runs
+ * the scheduler until every state is parked, then completes all of them.
+ */
+#define BENCH_ASYNC 100
+
+typedef struct {
+  int id;                   // In the scheduler
+  yarn_uint token;          // Of the pending syscall, 0 for none
+} benchPending;
+
+static void benchSysAsync(yarn_state *Y) {
+  benchPending *pending = yarn_getUserdata(Y);
+  pending->token = yarn_suspend(Y);
+}
+
+static int benchAsync(int nstates, int slice, int jit) {
+  char code[BENCH_ASYNC*YARN_LEN_BRANCH + 1];
+  size_t size = syscallCode(code, BENCH_ASYNC, 1, 0x12);
+  size_t completions = 0;
+  double start, elapsed;
+  int completed;
+  yarn_state **states = calloc(nstates, sizeof(yarn_state *));
+  benchPending *pending = calloc(nstates, sizeof(benchPending));
+  yarn_scheduler *S = yarn_schedulerInit(slice);
+  yarn_image *I = yarn_imageInit(code, size);
+
+  if (states == NULL || pending == NULL || S == NULL || I == NULL ||
+      yarn_imageRegisterSysCall(I, 0x12, benchSysAsync) != 0) {
+    printf("Unable to create scheduler.\n");
+    return -1;
+  }
+  for (int i = 0; i < nstates; i++) {
+    states[i] = newState(code, size, I, jit);
+    if (states[i] == NULL ||
+        (pending[i].id = yarn_schedulerAdd(S, states[i])) < 0) {
+      printf("Unable to create Yarn state.\n");
+      return -1;
+    }
+    yarn_setUserdata(states[i], &pending[i]);
+  }
+  yarn_imageRelease(I);
+
+  start = now();
+  do {
+    yarn_schedulerRun(S, -1);
+    completed = 0;
+    for (int i = 0; i < nstates; i++) {
+      if (pending[i].token != 0) {
+        yarn_schedulerComplete(S, pending[i].id, pending[i].token,
+                               pending[i].token);
+        pending[i].token = 0;
+        completed++;
+      }
+    }
+    completions += completed;
+  } while (completed > 0);
+  elapsed = now() - start;
+  for (int i = 0; i < nstates; i++) {
+    if (yarn_getStatus(states[i]) != YARN_STATUS_HALT) {
+      printf("Asynchronous syscalls failed: %s\n",
+             yarn_statusToString(yarn_getStatus(states[i])));
+      return -1;
+    }
+  }
+  if (json) {
+    printJSONStart("async", "", jit);
+    printf(", \"states\": %d, \"slice\": %d, \"syscalls\": %zu, "
+           "\"ns_per_syscall\": %.3f, \"syscalls_per_s\": %.0f", nstates,
+           slice, completions, elapsed/completions*1e9, completions/elapsed);
+    printJSONEnd();
+  } else {
+    printf("%-8s async %7d states  %10zu syscalls  %8.2f ns/syscall  %8.2f M syscalls/s  %7ld KB peak\n",
+           jit ? "jit" : BENCH_ENGINE, nstates, completions,
+           elapsed/completions*1e9, completions/elapsed/1e6, peakRSS());
+  }
+
+  for (int i = 0; i < nstates; i++) {
+    yarn_destroy(states[i]);
+  }
+  yarn_schedulerDestroy(S);
+  free(pending);
+  free(states);
+  return 0;
+}
+
+/*
+ * Host to guest calls for -e. Calls the function at address 0 of the object
+ * file with yarn_call BENCH_EVENTS times per run, like an event loop handing
+ * every event to a guest handler.
+ */
+#define BENCH_EVENTS 100000
+
+static int benchEvents(const char *path, int runs, int jit) {
+  size_t size, instructions = 0;
+  double best = -1, total = 0;
+  char *code = readFile(path, &size);
+  yarn_state *Y = newState(code, size, NULL, jit);
+
+  if (code == NULL || Y == NULL) {
+    printf("Unable to load %s\n", path);
+    return -1;
+  }
+  for (int r = 0; r < runs; r++) {
+    double start = now(), elapsed;
+    size_t before = yarn_getInstructionCount(Y);
+    for (yarn_uint i = 0; i < BENCH_EVENTS; i++) {
+      yarn_uint result;
+      int status = yarn_call(Y, 0, &i, 1, &result);
+      if (status != YARN_STATUS_OK) {
+        printf("Call into %s failed: %s\n", path, yarn_statusToString(status));
+        return -1;
+      }
+    }
+    elapsed = now() - start;
+    instructions = yarn_getInstructionCount(Y) - before;
+    total += elapsed;
+    if (best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  if (json) {
+    printJSONStart("call", path, jit);
+    printf(", \"runs\": %d, \"calls\": %d, \"instructions\": %zu, "
+           "\"ns_per_call\": %.3f, \"calls_per_s\": %.0f", runs,
+           BENCH_EVENTS, instructions, best/BENCH_EVENTS*1e9,
+           BENCH_EVENTS/best);
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %10d calls  %8.2f ns/call (best)  %8.2f ns/call (mean)  %8.2f M calls/s\n",
+           jit ? "jit" : BENCH_ENGINE, path, BENCH_EVENTS,
+           best/BENCH_EVENTS*1e9, total/runs/BENCH_EVENTS*1e9,
+           BENCH_EVENTS/best/1e6);
+  }
+  yarn_destroy(Y);
+  free(code);
+  return 0;
+}
+
+/*
+ * Checkpoints for -k. Everything goes to a temporary file, so the times include
+ * the writes but hardly ever a disk.
+ */
+#define BENCH_CHECKPOINTMEM (64*1024*1024)
+
+static int benchCheckpoints(const char *path, int interval, int jit) {
+  size_t size, deltas = 0;
+  double start, fulltime, deltatime = 0, loadtime;
+  long fullbytes, deltabytes;
+  int status = YARN_STATUS_OK;
+  char *code = readFile(path, &size);
+  yarn_state *Y = pagedsize ? yarn_initPaged(pagedsize, 0)
+                            : yarn_init(BENCH_CHECKPOINTMEM);
+  yarn_state *L;
+  FILE *fp = tmpfile();
+
+  if (code == NULL || Y == NULL || fp == NULL ||
+      yarn_loadCode(Y, code, size) != 0 ||
+      yarn_setOption(Y, YARN_OPTION_JIT, jit) != 0) {
+    printf("Unable to load %s\n", path);
+    return -1;
+  }
+  start = now();
+  if (yarn_saveState(Y, fp, 0) != 0) {
+    printf("Unable to checkpoint %s\n", path);
+    return -1;
+  }
+  fulltime = now() - start;
+  fullbytes = ftell(fp);
+  while (status == YARN_STATUS_OK) {
+    status = yarn_execute(Y, interval);
+    start = now();
+    if (yarn_saveState(Y, fp, 1) != 0) {
+      printf("Unable to checkpoint %s\n", path);
+      return -1;
+    }
+    deltatime += now() - start;
+    deltas++;
+  }
+  deltabytes = ftell(fp) - fullbytes;
+
+  rewind(fp);
+  start = now();
+  L = yarn_loadState(fp);
+  loadtime = now() - start;
+  if (L == NULL ||
+      yarn_getInstructionCount(L) != yarn_getInstructionCount(Y)) {
+    printf("Checkpoints of %s don't load back\n", path);
+    return -1;
+  }
+  if (json) {
+    printJSONStart("checkpoint", path, jit);
+    printf(", \"interval\": %d, \"memory\": %zu, \"full_us\": %.3f, "
+           "\"full_bytes\": %ld, \"deltas\": %zu, \"delta_us\": %.3f, "
+           "\"delta_bytes\": %.0f, \"load_us\": %.3f", interval,
+           yarn_getMemorySize(Y), fulltime*1e6, fullbytes, deltas,
+           deltatime/deltas*1e6, (double)deltabytes/deltas, loadtime*1e6);
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %8d inst/ckpt  full %8.1f us %9ld B  %5zu deltas %8.1f us %7.0f B  load %8.1f us\n",
+           jit ? "jit" : BENCH_ENGINE, path, interval, fulltime*1e6,
+           fullbytes, deltas, deltatime/deltas*1e6,
+           (double)deltabytes/deltas, loadtime*1e6);
+  }
+  yarn_destroy(L);
+  yarn_destroy(Y);
+  fclose(fp);
+  free(code);
+  return 0;
+}
+
+/*
+ * The assembler for -x. A run assembles the source often enough to read about
+ * BENCH_ASMLINES lines, so small sources aren't timed by the clock's
+ * resolution.
+ */
+#define BENCH_ASMLINES 100000
+
+static int benchAssemble(const char *path, int runs, const char *refdir) {
+  size_t size, lines = 0, codesize = 0, refsize = 0;
+  int repeat, conforms = -1;
+  double best = -1, total = 0;
+  char *source = readFile(path, &size);
+  char *code = NULL, *err = NULL, *ref = NULL;
+  char refpath[4096];
+
+  if (source == NULL) {
+    printf("Unable to load %s\n", path);
+    return -1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    lines += source[i] == '\n';
+  }
+  if (size > 0 && source[size-1] != '\n') {
+    lines++;
+  }
+  repeat = BENCH_ASMLINES/(lines ? lines : 1) + 1;
+  for (int r = 0; r < runs; r++) {
+    double start = now(), elapsed;
+    for (int i = 0; i < repeat; i++) {
+      free(code);
+      if (yarn_assemble(source, size, &code, &codesize, &err) != 0) {
+        printf("Unable to assemble %s, %s\n", path, err);
+        free(err);
+        free(source);
+        return -1;
+      }
+    }
+    elapsed = (now() - start)/repeat;
+    total += elapsed;
+    if (best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  if (refdir != NULL && *refdir) {
+    const char *name = strrchr(path, '/');
+    const char *ext;
+    name = name ? name+1 : path;
+    ext = strrchr(name, '.');
+    snprintf(refpath, sizeof(refpath), "%s/%.*s.o", refdir,
+             (int)(ext ? (size_t)(ext - name) : strlen(name)), name);
+    ref = readFile(refpath, &refsize);
+    conforms = ref != NULL && refsize == codesize &&
+               memcmp(ref, code, codesize) == 0;
+  }
+  if (json) {
+    printJSONStart("assemble", path, 0);
+    printf(", \"runs\": %d, \"lines\": %zu, \"bytes\": %zu, "
+           "\"code_bytes\": %zu, \"us_per_source\": %.3f, "
+           "\"lines_per_s\": %.0f, \"mb_per_s\": %.1f, \"conforms\": %s",
+           runs, lines, size, codesize, best*1e6, lines/best, size/best/1e6,
+           conforms < 0 ? "null" : conforms ? "true" : "false");
+    printJSONEnd();
+  } else {
+    printf("%-8s %-32s %7zu lines  %8.2f us (best)  %8.2f us (mean)  %7.2f M lines/s  %7.1f MB/s  %s\n",
+           "asm", path, lines, best*1e6, total/runs*1e6, lines/best/1e6,
+           size/best/1e6, conforms < 0 ? "" : conforms ? "same" : "DIFFERS");
+  }
+  if (conforms == 0) {
+    printf(ref != NULL ? "%s doesn't assemble to %s\n" : "%s has no %s\n",
+           path, refpath);
+  }
+  free(ref);
+  free(code);
+  free(source);
+  return conforms == 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+  int runs = 20;
+  int jit = 0;
+  int slice = 1000;
+  int shared = 1;
+  const char *scaling = NULL;
+  const char *threads = NULL;
+  const char *forks = NULL;
+  const char *async = NULL;
+  const char *checkpoints = NULL;
+  const char *assemble = NULL;
+  int syscalls = 0;
+  int events = 0;
+  int result = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp("-r", argv[i], strlen("-r")) == 0) {
+      runs = atoi(argv[i]+2);
+    } else if (strcmp("-j", argv[i]) == 0) {
+      jit = 1;
+    } else if (strncmp("-s", argv[i], strlen("-s")) == 0) {
+      scaling = argv[i]+2;
+    } else if (strncmp("-t", argv[i], strlen("-t")) == 0) {
+      slice = atoi(argv[i]+2);
+    } else if (strncmp("-p", argv[i], strlen("-p")) == 0) {
+      threads = argv[i]+2;
+    } else if (strncmp("-f", argv[i], strlen("-f")) == 0) {
+      forks = argv[i]+2;
+    } else if (strcmp("-u", argv[i]) == 0) {
+      shared = 0;
+    } else if (strncmp("-m", argv[i], strlen("-m")) == 0) {
+      pagedsize = strtoul(argv[i]+2, NULL, 0);
+    } else if (strncmp("-a", argv[i], strlen("-a")) == 0) {
+      async = argv[i]+2;
+    } else if (strncmp("-k", argv[i], strlen("-k")) == 0) {
+      checkpoints = argv[i]+2;
+    } else if (strncmp("-x", argv[i], strlen("-x")) == 0) {
+      assemble = argv[i]+2;
+    } else if (strcmp("-e", argv[i]) == 0) {
+      events = 1;
+    } else if (strcmp("-c", argv[i]) == 0) {
+      syscalls = 1;
+    } else if (strcmp("-J", argv[i]) == 0) {
+      json = 1;
+    }
+  }
+  if (runs <= 0) {
+    runs = 1;
+  }
+  if (syscalls) {
+    return benchSyscalls(runs, jit) != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  for (const char *n = async ? async : ""; *n; ) {
+    if (benchAsync(atoi(n), slice, jit) != 0) {
+      result = EXIT_FAILURE;
+    }
+    n = strchr(n, ',');
+    n = n ? n+1 : "";
+  }
+  if (async != NULL) {
+    return result;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      continue;
+    }
+    if (assemble != NULL) {
+      if (benchAssemble(argv[i], runs, assemble) != 0) {
+        result = EXIT_FAILURE;
+      }
+      continue;
+    }
+    for (const char *n = forks ? forks : ""; *n; ) {
+      if (benchFork(argv[i], atoi(n), jit) != 0) {
+        result = EXIT_FAILURE;
+      }
+      n = strchr(n, ',');
+      n = n ? n+1 : "";
+    }
+    if (forks != NULL) {
+      continue;
+    }
+    for (const char *n = checkpoints ? checkpoints : ""; *n; ) {
+      if (benchCheckpoints(argv[i], atoi(n), jit) != 0) {
+        result = EXIT_FAILURE;
+      }
+      n = strchr(n, ',');
+      n = n ? n+1 : "";
+    }
+    if (checkpoints != NULL) {
+      continue;
+    }
+    if (events) {
+      if (benchEvents(argv[i], runs, jit) != 0) {
+        result = EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (scaling == NULL) {
+      if (benchFile(argv[i], runs, jit) != 0) {
+        result = EXIT_FAILURE;
+      }
+      continue;
+    }
+    for (const char *n = scaling; *n; ) {
+      if (threads == NULL) {
+        if (benchScheduler(argv[i], atoi(n), slice, jit, shared) != 0) {
+          result = EXIT_FAILURE;
+        }
+      }
+      for (const char *t = threads ? threads : ""; *t; ) {
+        if (benchPool(argv[i], atoi(n), atoi(t), slice, jit, shared) != 0) {
+          result = EXIT_FAILURE;
+        }
+        t = strchr(t, ',');
+        t = t ? t+1 : "";
+      }
+      n = strchr(n, ',');
+      n = n ? n+1 : "";
+    }
+  }
+  return result;
+}
@@ -0,0 +1,21 @@
+#!/bin/bash
+# Builds the benchmark harness once per dispatch engine and assembles the
+# example programs and the workloads in bench/programs into bin/ so they can
+# be run with:
+#   ./bin/yarn-bench bin/fibonacci_recursive.o bin/fibonacci_loop.o
+#   ./bin/yarn-bench-threaded bin/fibonacci_recursive.o bin/fibonacci_loop.o
+cd "$(dirname "$0")/.." || exit 1
+
+CFLAGS="-O3 -std=c11 -pthread -pedantic -Wall -Wextra -Wcast-qual \
+        -Wstrict-prototypes -Wmissing-prototypes"
+
+gcc src/*.c bench/bench.c -o bin/yarn-bench $CFLAGS "$@"
+gcc src/*.c bench/bench.c -o bin/yarn-bench-threaded -DYARN_COMPUTED_GOTO \
+        $CFLAGS "$@"
+# The programs count in words with $Nw, so they only have to be assembled
+# for the word size of the build.
+ASMFLAGS=
+case " $* " in *" -DYARN_64BIT "*) ASMFLAGS=-w64 ;; esac
+for f in examples/*.asm bench/programs/*.asm; do
+  ./tools/assemble.py $ASMFLAGS "$f" "bin/$(basename "$f" .asm).o"
+done
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Checks that superinstructions don't change what a program does: runs the
+# examples and the benchmark programs as they are, split into their single
+# instructions again (a profiled run, -p) and on the JIT (-j), and compares
+# the registers, the status and the instructions executed.
+#   ./bench/fused.sh [file.asm...]
+cd "$(dirname "$0")/.." || exit 1
+
+./build.sh || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+outcome() {
+  ./bin/yarn "$@" < /dev/null | grep -E "Reg: %|Status|Instructions executed" |
+    tail -18
+}
+
+files=("$@")
+if [ $# -eq 0 ]; then
+  files=(examples/*.asm bench/programs/*.asm)
+fi
+failed=0
+for asm in "${files[@]}"; do
+  name=$(basename "$asm" .asm)
+  ./tools/assemble.py "$asm" "$tmp/$name.o" > /dev/null || continue
+  fused=$(outcome "$tmp/$name.o")
+  result="same"
+  if [ "$fused" != "$(outcome "$tmp/$name.o" "-p$tmp/$name.folded")" ]; then
+    result="DIFFERENT unfused"
+  elif [ "$fused" != "$(outcome "$tmp/$name.o" -j)" ]; then
+    result="DIFFERENT on the JIT"
+  fi
+  printf "%-28s %s\n" "$name" "$result"
+  if [ "$result" != "same" ]; then
+    failed=1
+  fi
+done
+exit $failed
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Reports what the assembler's -O saves on the examples and the benchmark
+# programs: instructions in the code (static) and instructions run to
+# completion (dynamic), and whether the optimized program ends the same way.
+#   ./bench/optimize.sh [file.asm...]
+cd "$(dirname "$0")/.." || exit 1
+
+./build.sh || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# Registers other than %ins and the status, %ins depends on the layout.
+outcome() {
+  ./bin/yarn "$1" < /dev/null | grep -E "Reg: %[^i]|Status" | tail -16
+}
+executed() {
+  ./bin/yarn "$1" < /dev/null | grep "Instructions executed" | tail -1 |
+    awk '{print $3}'
+}
+
+printf "%-28s %8s %8s %7s %12s %12s %7s  %s\n" "Program" "Static" "-O" "Saved" \
+       "Dynamic" "-O" "Saved" "Result"
+files=("$@")
+if [ $# -eq 0 ]; then
+  files=(examples/*.asm bench/programs/*.asm)
+fi
+for asm in "${files[@]}"; do
+  name=$(basename "$asm" .asm)
+  ./tools/assemble.py "$asm" "$tmp/$name.o" > /dev/null || continue
+  report=$(./tools/assemble.py -O "$asm" "$tmp/$name-O.o") || continue
+  # "file: N instructions, M after optimizing", or why it was left alone
+  static=$(echo "$report" | sed -n 's/.*: \([0-9]*\) instructions, .*/\1/p')
+  staticO=$(echo "$report" | sed -n 's/.*, \([0-9]*\) after optimizing/\1/p')
+  if [ -z "$static" ]; then
+    echo "$report"
+    continue
+  fi
+  dynamic=$(executed "$tmp/$name.o")
+  dynamicO=$(executed "$tmp/$name-O.o")
+  result="same"
+  if [ "$(outcome "$tmp/$name.o")" != "$(outcome "$tmp/$name-O.o")" ]; then
+    result="DIFFERENT"
+  fi
+  awk -v name="$name" -v s="$static" -v so="$staticO" -v dy="$dynamic" \
+      -v dyo="$dynamicO" -v result="$result" 'BEGIN {
+    printf "%-28s %8d %8d %6.1f%% %12d %12d %6.1f%%  %s\n", name, s, so,
+           100*(s-so)/s, dy, dyo, 100*(dy-dyo)/dy, result
+  }'
+done
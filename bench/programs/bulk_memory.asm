@@ -0,0 +1,33 @@
+; Bulk memory syscalls: fills a 64 word buffer, copies it and compares the
+; copy, over and over. The same work memory_loop does one word at a time.
+Init:
+  mov $0, %s5
+  mov $1000, %c1 ; Passes over the buffers
+  mov $64w, %c2  ; Size in bytes
+  mov 0x0, %c3   ; Source
+  mov $64w, %c4 ; Destination
+
+Loop:
+  push %c2       ; memset(source, pass, size)
+  push %c1
+  push %c3
+  syscall 0x04
+  add $3w, %stk
+
+  push %c2       ; memcpy(destination, source, size)
+  push %c3
+  push %c4
+  syscall 0x03
+  add $3w, %stk
+
+  push %c2       ; memcmp(source, destination, size)
+  push %c4
+  push %c3
+  syscall 0x05
+  add $3w, %stk
+
+  sub $1, %c1
+  lt %s5, %c1
+  jif :Loop
+
+  halt
@@ -0,0 +1,31 @@
+; Deep call chains: calls down 100 frames and returns back up, over and over.
+Init:
+  mov $0, %s5
+  mov $2000, %c1 ; Chains
+
+Init_Loop:
+  mov $100, %s1  ; Depth
+  call :Descend
+  sub $1, %c1
+  lt %s5, %c1
+  jif :Init_Loop
+
+  halt
+
+; Descend(%s1 depth)
+;   Sets up a frame and calls itself until depth reaches 0.
+Descend:
+  push %bse
+  mov %stk, %bse
+
+  sub $1, %s1
+  lt %s5, %s1
+  jif :Descend_Deeper
+
+  pop %bse
+  ret
+
+Descend_Deeper:
+  call :Descend
+  pop %bse
+  ret
@@ -0,0 +1,14 @@
+; Event handler for yarn-bench -e, which calls it from the host with yarn_call
+; once per event instead of running the program from address 0.
+; Handler(event)
+;   Counts the events in memory and returns the event plus the count.
+Handler:
+  push %bse
+  mov %stk, %bse
+  mov *(%bse+$2w), %ret
+  mov *(0x0), %s1
+  add $1, %s1
+  mov %s1, *(0x0)
+  add %s1, %ret
+  pop %bse
+  ret
@@ -0,0 +1,43 @@
+; Code the way a naive compiler writes it: values go through the stack,
+; constants are built in steps and control flow is joined through jumps.
+; Sums i*3+1 for i from 0 to 99999 into %ret. See bench/optimize.sh for what
+; the assembler's -O makes of it.
+Init:
+  mov $0, %c1        ; i
+  mov $0, %c2        ; sum
+  mov $100000, %c3   ; n
+  jmp :Loop_Test
+
+Loop_Body:
+  push %c1           ; t = i
+  pop %s1
+  mov $1, %s2        ; t = t*3
+  add $2, %s2
+  mul %s2, %s1
+  add $0, %s1
+  push %s1           ; sum = sum + t
+  pop %s2
+  add %s2, %c2
+  mov $0, %s3        ; sum = sum + 1
+  add $1, %s3
+  add %s3, %c2
+  nop
+  jmp :Loop_Next
+
+Loop_Next:
+  add $1, %c1        ; i = i + 1
+  jmp :Loop_Test
+
+Loop_Test:
+  lt %c1, %c3        ; while i < n
+  jif :Loop_Continue
+  jmp :Loop_End
+Loop_Continue:
+  jmp :Loop_Body
+
+Loop_End:
+  mov %c2, %ret
+  jmp :Exit
+
+Exit:
+  halt
@@ -0,0 +1,57 @@
+; Memory heavy loop: fills a 64 word buffer, copies it and sums the copy,
+; over and over.
+Init:
+  mov $0, %s5
+  mov $1000, %c1 ; Passes over the buffers
+
+Init_Loop:
+  mov 0x0, %s1   ; Source
+  mov $64, %s2   ; Size
+  call :Fill
+
+  mov 0x0, %s1   ; Source
+  mov $64w, %s3 ; Destination
+  mov $64, %s2
+  call :Copy
+
+  mov $64w, %s1
+  mov $64, %s2
+  call :Sum
+
+  sub $1, %c1
+  lt %s5, %c1
+  jif :Init_Loop
+
+  halt
+
+; Fill(%s1 start, %s2 size), stores size, size-1, ... 1
+Fill:
+  mov %s2, *(%s1)
+  add $1w, %s1
+  sub $1, %s2
+  lt %s5, %s2
+  jif :Fill
+  ret
+
+; Copy(%s1 source, %s3 destination, %s2 size)
+Copy:
+  mov *(%s1), %s4
+  mov %s4, *(%s3)
+  add $1w, %s1
+  add $1w, %s3
+  sub $1, %s2
+  lt %s5, %s2
+  jif :Copy
+  ret
+
+; Sum(%s1 start, %s2 size), leaves the sum in %ret
+Sum:
+  mov $0, %ret
+Sum_Loop:
+  mov *(%s1), %s4
+  add %s4, %ret
+  add $1w, %s1
+  sub $1, %s2
+  lt %s5, %s2
+  jif :Sum_Loop
+  ret
@@ -0,0 +1,21 @@
+; Pushes with %stk in the register window at the top of memory, so the first
+; of two pushes overwrites %ins and the second never runs. A push-push
+; superinstruction has to end the same way as the two pushes on their own.
+Init:
+  mov $1, %s1
+  lt %c3, %s1
+  jif :Push         ; first time through
+  halt              ; the push jumped back here
+
+Push:
+  mov $1, %c3
+  mov $0, %c1
+  sub $2, %c1       ; the push moves %ins past itself as usual, to 0
+  mov $7, %c2
+  syscall 0x00      ; memory size
+  mov %ret, %stk
+  sub $1w, %stk     ; on the status word, so the push writes %ins
+  push %c1
+  push %c2          ; not reached
+  mov $1, %c4       ; not reached
+  halt
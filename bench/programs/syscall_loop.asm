@@ -0,0 +1,15 @@
+; Syscall heavy loop: asks the host for the instruction count every iteration
+; and adds it up.
+Init:
+  mov $0, %s5
+  mov $0, %c2       ; Sum
+  mov $100000, %c1  ; Iterations
+
+Loop:
+  syscall 0x01      ; Instructions executed so far, into %ret
+  add %ret, %c2
+  sub $1, %c1
+  lt %s5, %c1
+  jif :Loop
+
+  halt
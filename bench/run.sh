@@ -0,0 +1,51 @@
+#!/bin/bash
+# Runs the benchmark suite on every engine and prints the results as one JSON
+# document, to keep and compare against later runs:
+#   ./bench/run.sh > results.json
+# Arguments are passed on to bench/build.sh, e.g. -DYARN_NO_COW. Every program
+# runs in a process of its own, so the peak RSS of a result is its own.
+cd "$(dirname "$0")/.." || exit 1
+
+PROGRAMS="fibonacci_recursive fibonacci_loop memoryadd memory_loop bulk_memory \
+          syscall_loop call_chain"
+ENGINES=("bin/yarn-bench" "bin/yarn-bench-threaded" "bin/yarn-bench -j")
+
+./bench/build.sh "$@" >&2 || exit 1
+
+echo "{"
+echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null)\","
+echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+echo "  \"host\": \"$(uname -sm)\","
+echo "  \"cflags\": \"$*\","
+echo "  \"results\": ["
+separator=""
+for engine in "${ENGINES[@]}"; do
+  for program in $PROGRAMS; do
+    # The JIT isn't available everywhere, leave out what didn't run.
+    if result=$($engine -J "bin/$program.o"); then
+      printf "%s    %s" "$separator" "$result"
+      separator=$',\n'
+    fi
+  done
+  if results=$($engine -J -c && $engine -J -a1,1000 &&
+               $engine -J -e bin/event_handler.o &&
+               $engine -J -k10000 bin/memory_loop.o); then
+    while read -r result; do
+      printf "%s    %s" "$separator" "$result"
+      separator=$',\n'
+    done <<< "$results"
+  fi
+done
+# The assembler is the same for every engine. It also checks its code matches
+# what tools/assemble.py wrote for bench/build.sh, and says so when it doesn't.
+if results=$(bin/yarn-bench -J -xbin examples/*.asm bench/programs/*.asm); then
+  while read -r result; do
+    printf "%s    %s" "$separator" "$result"
+    separator=$',\n'
+  done <<< "$results"
+else
+  grep -v "^{" <<< "$results" >&2
+fi
+echo ""
+echo "  ]"
+echo "}"
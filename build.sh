@@ -1,4 +1,4 @@
 #!/bin/bash
 
-gcc src/*.c -o bin/yarn -DYARN_STANDALONE -O3 -std=c99 -pedantic -Wall -Wextra \
-        -Wcast-qual -Wstrict-prototypes -Wmissing-prototypes "$@"
+gcc src/*.c -o bin/yarn -DYARN_STANDALONE -O3 -std=c11 -pthread -pedantic \
+        -Wall -Wextra -Wcast-qual -Wstrict-prototypes -Wmissing-prototypes "$@"
@@ -6,7 +6,7 @@ Init:
 
   push %c1
   call :Multiply_by_five
-  add $4, %stk ; remove c1 from stack
+  add $1w, %stk ; remove c1 from stack
 
   halt ; Needed for graceful shutdown
 
@@ -15,7 +15,7 @@ Multiply_by_five:
   push %bse       ; Stack set up
   mov %stk, %bse
 
-  mov *(%bse+$8), %ret
+  mov *(%bse+$2w), %ret
 
   mul $5,%ret
 
@@ -13,7 +13,7 @@ Fibonacci:
   push %bse
   mov %stk, %bse
 
-  mov *(%bse+$8), %ret
+  mov *(%bse+$2w), %ret
   mov $1, %s5
 
   lt %ret, %s5      ; if i < 1 return 0
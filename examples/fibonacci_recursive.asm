@@ -16,7 +16,7 @@ Fibonacci:
   push %c1
   push %c2
 
-  mov *(%bse+$8), %ret
+  mov *(%bse+$2w), %ret
   mov $1, %s1
 
   lt %ret, %s1      ; if i < 1 return 0
@@ -33,14 +33,14 @@ Fibonacci:
   ; call Fibonacci(n-1)
   push %c1
   call :Fibonacci
-  add $4, %stk
+  add $1w, %stk
 
   mov %ret, %c1
 
   ; call Fibonacci(n-2)
   push %c2
   call :Fibonacci
-  add $4, %stk
+  add $1w, %stk
 
   add %c1, %ret ; n-1 + n-2
   jmp :Fibonacci_End
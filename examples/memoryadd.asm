@@ -6,7 +6,7 @@ Init:
   push %c1
   call :FillMemory
   call :SumMemory
-  add $8, %stk
+  add $2w, %stk
 
   halt ; Needed for graceful shutdown
 
@@ -18,15 +18,15 @@ FillMemory:
   mov %stk, %bse
 
   mov $0, %s5
-  mov *(%bse+$8), %s1  ; *start
-  mov *(%bse+$12), %s2   ; size
+  mov *(%bse+$2w), %s1  ; *start
+  mov *(%bse+$3w), %s2   ; size
 
   lte %s2, %s5
   jif :FillMemory_End
 FillMemory_Loop:
   mov %s2, *(%s1) ; *start = counter
 
-  add $4, %s1
+  add $1w, %s1
   sub $1, %s2
   lte %s2, %s5
   jif :FillMemory_End   ; if size <= 0 then break
@@ -43,8 +43,8 @@ SumMemory:
   mov %stk, %bse
 
   mov $0, %s5
-  mov *(%bse+$8), %s1  ; *start
-  mov *(%bse+$12), %s2   ; size
+  mov *(%bse+$2w), %s1  ; *start
+  mov *(%bse+$3w), %s2   ; size
   mov $0, %ret          ; sum
 
   lte %s2, %s5
@@ -54,7 +54,7 @@ Sum_Loop:
   mov *(%s1), %s3
   add %s3, %ret
 
-  add $4, %s1
+  add $1w, %s1
   sub $1, %s2
   lte %s2, %s5
   jif :Sum_End   ; if size <= 0 then break
@@ -0,0 +1,36 @@
+Init:
+  mov 0x100, %c1 ; Size
+  mov 0x0, %c2   ; Buffer
+  mov 0x100, %c3 ; Copy of the buffer
+
+  mov $7, %s1    ; memset(buffer, 7, size)
+  push %c1
+  push %s1
+  push %c2
+  syscall 0x04
+  add $3w, %stk
+
+  mov $42, %s1
+  mov %s1, *(%c2+0x80) ; Leave a marker in the middle
+
+  push %c1       ; memcpy(copy, buffer, size)
+  push %c2
+  push %c3
+  syscall 0x03
+  add $3w, %stk
+
+  push %c1       ; memcmp(buffer, copy, size), 0 if they match
+  push %c3
+  push %c2
+  syscall 0x05
+  add $3w, %stk
+  mov %ret, %c4
+
+  mov $42, %s1   ; memchr(copy, 42, size), where the marker was copied to
+  push %c1
+  push %s1
+  push %c3
+  syscall 0x06
+  add $3w, %stk
+
+  halt ; %c4 is 0 and %ret is 0x180
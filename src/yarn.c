@@ -1,49 +1,384 @@
+// The JIT tier needs mmap, only x86-64 is supported. Define YARN_NO_JIT to
+// leave it out. It emits 32 bit operations, so YARN_64BIT builds interpret.
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && \
+    defined(__GNUC__) && !defined(YARN_NO_JIT) && !defined(YARN_64BIT)
+#define YARN_JIT
+#endif
+// Object files are mapped instead of read where there is mmap. Define
+// YARN_NO_MMAP to read them.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(YARN_NO_MMAP)
+#define YARN_MMAP
+#endif
+// Forks share the memory of their snapshot copy-on-write through mmap where
+// there is one, otherwise every fork gets a copy. Define YARN_NO_COW to always
+// copy.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(YARN_NO_COW)
+#define YARN_COW
+#endif
+#if defined(YARN_JIT) || defined(YARN_COW) || defined(YARN_MMAP)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#if defined(YARN_JIT) || defined(YARN_COW) || defined(YARN_MMAP)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef YARN_MMAP
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 
 #include "yarn.h"
 
+// Images can be shared by states on different threads, their reference count
+// is only safe to touch from several threads with C11 atomics. The same goes
+// for the indices of the trace buffer, which is drained from another thread.
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+    !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef atomic_int yarn_refcount;
+typedef atomic_size_t yarn_index;
+#define yarn_acquire(x) atomic_load_explicit(&(x), memory_order_acquire)
+#define yarn_release(x, v) atomic_store_explicit(&(x), v, memory_order_release)
+#else
+typedef int yarn_refcount;
+typedef size_t yarn_index;
+#define yarn_acquire(x) (x)
+#define yarn_release(x, v) ((x) = (v))
+#endif
+
 #ifndef YARN_MAP_COUNT
 #define YARN_MAP_COUNT 256 // Has to be a power-of-two
 #endif
 #define YARN_MAP_MASK  (YARN_MAP_COUNT - 1)
+// Syscall keys below this are looked up in a table, the rest in the hash map.
+#ifndef YARN_SYSCALL_DIRECT
+#define YARN_SYSCALL_DIRECT 64 // At least 1, key 0 marks unused map slots
+#endif
 
-struct yarn_state {
+// Bytes at the top of memory holding the registers, status and flags.
+#define YARN_WINDOWSIZE ((YARN_REG_NUM+1)*sizeof(yarn_uint))
+
+// Paged memory, see yarn_initPaged. About the top YARN_PAGED_TAIL bytes, the
+// stack and the registers, are one flat block starting on a page boundary.
+// Everything below is split into pages of 1 << YARN_PAGE_SHIFT bytes.
+#ifndef YARN_PAGE_SHIFT
+#define YARN_PAGE_SHIFT 12
+#endif
+#define YARN_PAGE_SIZE ((size_t)1 << YARN_PAGE_SHIFT)
+#define YARN_PAGE_MASK (YARN_PAGE_SIZE - 1)
+#ifndef YARN_PAGED_TAIL
+#define YARN_PAGED_TAIL 65536
+#endif
+
+// Internal opcodes used by the decoded stream, they live above the real
+// instruction bytes so they can never collide with loaded code.
+enum {
+  YARN_XINST_UNDECODED = 0x100, // Not an instruction start, decode from bytes
+  YARN_XINST_INVALID,           // Unknown opcode or truncated instruction
+
+  /* Superinstructions, see yarn_fuse. Each one stands for two instructions,
+     the second is the decoded instruction at next. */
+  YARN_XINST_FUSED,
+  YARN_XINST_LT_JIF = YARN_XINST_FUSED, // Conditional then jif, d is the target
+  YARN_XINST_LTS_JIF,
+  YARN_XINST_LTE_JIF,
+  YARN_XINST_LTES_JIF,
+  YARN_XINST_EQ_JIF,
+  YARN_XINST_NEQ_JIF,
+  YARN_XINST_IR_ADD,
+  YARN_XINST_PUSH_PUSH,
+  YARN_XINST_POP_POP,
+  YARN_XINST_NUM,
+};
+
+// The first instruction of each superinstruction.
+static const unsigned short yarn_unfused[] = {
+  YARN_INST_LT, YARN_INST_LTS, YARN_INST_LTE, YARN_INST_LTES, YARN_INST_EQ,
+  YARN_INST_NEQ, YARN_INST_IR, YARN_INST_PUSH, YARN_INST_POP,
+};
+
+// A pre-decoded instruction. Fixed width and aligned so the interpreter never
+// has to touch the byte code for an instruction start.
+typedef struct {
+  unsigned short op;        // Instruction byte or one of YARN_XINST_
+  unsigned char rA, rB;     // Register nibbles
+  yarn_uint d;              // Immediate
+  yarn_uint next;           // ip of the following instruction
+} yarn_inst;
+
+// An exported symbol of linked code, see yarn_imageLink.
+typedef struct {
+  const char *name;         // NULL for an empty slot
+  uint32_t hash;
+  yarn_uint addr;
+} yarn_symbol;
+
+// Everything about a program that doesn't change while it runs. Read-only once
+// prepared, so any number of states can run from one image.
+struct yarn_image {
   char *code;               // The code that we will execute
   size_t codesize;          // The code size
+  size_t mapsize;           // Length of code's mapping if mapped, else 0
+  yarn_inst *decoded;       // Decoded form of code, indexed by byte offset
+  unsigned char *verified;  // Instruction starts yarn_verify reached, NULL if
+                            //   the code didn't verify
+  yarn_refcount refs;       // States and host handles using the image
+  yarn_CFunc direct[YARN_SYSCALL_DIRECT]; // Syscalls indexed by key
+  // Sys call hash map data structure, for the keys too big for direct:
+  struct { yarn_uint key; yarn_CFunc val; } syscalls[YARN_MAP_COUNT];
+  yarn_symbol *symbols;     // Exports by name if the code was linked, else
+  size_t symbolmask;        //   NULL. Open addressed, symbolmask+1 slots.
+  char *names;              // Their names
+};
+
+// The memory of a paged state below its flat block.
+typedef struct {
+  char **table;             // One entry per page, NULL until it's written
+  size_t count;             // Pages allocated
+  size_t cap;               // Most pages allowed, 0 for no limit
+} yarn_pages;
+
+struct yarn_state {
+  yarn_image *image;        // NULL until code is loaded or a syscall registered
+  size_t codesize;          // Copies of image->codesize, decoded and verified,
+  yarn_inst *decoded;       //   so the interpreter doesn't have to go through
+  unsigned char *verified;  //   the image
   void *memory;             // Memory for the program. Contains registers, flags, everything
   size_t memsize;           // The total size of memory
+  size_t mapsize;           // Length of memory's mapping if forked, else 0
   size_t instructioncount;  // Total count of instuctions used
-  // Sys call hash map data structure:
-  struct { unsigned key; yarn_CFunc val; } syscalls[YARN_MAP_COUNT];
+  // Register file used while executing, see yarn_loadRegisters:
+  yarn_uint reg[YARN_REG_NUM];
+  unsigned char status, flags;
+  struct yarn_jit *jit;     // Compiled code, NULL unless YARN_OPTION_JIT is on
+  struct yarn_profile *profile; // NULL unless YARN_OPTION_PROFILE is on
+  struct yarn_trace *trace; // NULL unless YARN_OPTION_TRACE is on
+  size_t base;              // Address memory starts at, 0 unless paged
+  yarn_pages paged;         // Memory below base, table is NULL unless paged
+  void *userdata;           // Host pointer for syscalls, see yarn_setUserdata
+  int cached;               // The register file is newer than the register
+                            //   window in memory, see yarn_flushRegisters
+  yarn_uint pending;        // Token of the syscall suspended in, 0 for none
+  yarn_uint tokens;         // Last token handed out by yarn_suspend
+  struct yarn_checkpoint *checkpoint; // NULL until saved or loaded
 };
 
+#ifdef YARN_JIT
+static int yarn_jitCreate(yarn_state *Y);
+static void yarn_jitReset(yarn_state *Y);
+static void yarn_jitDestroy(yarn_state *Y);
+#endif
+static int yarn_profileCreate(yarn_state *Y);
+static void yarn_profileDestroy(yarn_state *Y);
+static void yarn_traceDestroy(yarn_state *Y);
+static void yarn_pageRead(const yarn_state *Y, size_t pos, void *val, size_t bsize);
+static int yarn_pageWrite(yarn_state *Y, size_t pos, const void *val, size_t bsize);
+static void yarn_flushRegisters(yarn_state *Y);
+static void yarn_checkpointFree(yarn_state *Y);
+static void yarn_checkpointBreak(yarn_state *Y);
+
 // Syscalls:
 static void yarn_sys_gettime(yarn_state *Y) {
-  yarn_int t = time(NULL);
-  yarn_setRegister(Y, YARN_REG_RETURN, &t);
+  yarn_returnInt(Y, (yarn_int)time(NULL));
 }
 static void yarn_sys_getinstructioncount(yarn_state *Y) {
-  yarn_setRegister(Y, YARN_REG_RETURN, &Y->instructioncount);
+  yarn_returnUint(Y, (yarn_uint)Y->instructioncount);
 }
 static void yarn_sys_getvmmemory(yarn_state *Y) {
-  yarn_setRegister(Y, YARN_REG_RETURN, &Y->memsize);
+  yarn_returnUint(Y, (yarn_uint)Y->memsize);
+}
+
+/*
+ *  Bulk memory syscalls. They take their arguments on the stack like a call,
+ *    the first one pushed last, and leave it to the caller to drop them. Every
+ *    range is checked once up front, one that doesn't fit in memory fails the
+ *    call with YARN_STATUS_INVALIDMEMORY before anything is touched (only a
+ *    paged state running into its cap can stop part way). Flat memory goes
+ *    straight to the C library's vectorized routines, paged memory a chunk at
+ *    a time. Writes that hit the register window show up in the registers
+ *    after the call, like a rmmov would.
+ */
+#define YARN_SYS_CHUNK 4096
+
+static int yarn_sysRange(yarn_state *Y, yarn_uint pos, yarn_uint n) {
+  if (n > Y->memsize || pos > Y->memsize - n) {
+    yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
+    return -1;
+  }
+  if (pos+n > Y->memsize-YARN_WINDOWSIZE) { // Touched below, not through the API
+    yarn_flushRegisters(Y);
+  }
+  return 0;
+}
+
+// memcpy(dst, src, n): Copies n bytes, overlapping ranges like memmove.
+// Returns dst.
+static void yarn_sys_memcpy(yarn_state *Y) {
+  yarn_uint dst = yarn_argUint(Y, 0), src = yarn_argUint(Y, 1);
+  yarn_uint n = yarn_argUint(Y, 2);
+  if (yarn_sysRange(Y, dst, n) != 0 || yarn_sysRange(Y, src, n) != 0) {
+    return;
+  }
+  if (Y->paged.table == NULL) {
+    memmove((char*)Y->memory+dst, (char*)Y->memory+src, n);
+  } else {
+    // Copies backwards when dst overlaps the end of src.
+    char buf[YARN_SYS_CHUNK];
+    int backwards = dst > src && dst - src < n;
+    for (yarn_uint done = 0; done < n; ) {
+      yarn_uint len = n - done < YARN_SYS_CHUNK ? n - done : YARN_SYS_CHUNK;
+      yarn_uint off = backwards ? n - done - len : done;
+      yarn_pageRead(Y, src+off, buf, len);
+      if (yarn_pageWrite(Y, dst+off, buf, len) != 0) {
+        yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
+        return;
+      }
+      done += len;
+    }
+  }
+  yarn_returnUint(Y, dst);
+}
+// memset(dst, c, n): Sets n bytes to the low byte of c. Returns dst.
+static void yarn_sys_memset(yarn_state *Y) {
+  yarn_uint dst = yarn_argUint(Y, 0), c = yarn_argUint(Y, 1);
+  yarn_uint n = yarn_argUint(Y, 2);
+  if (yarn_sysRange(Y, dst, n) != 0) {
+    return;
+  }
+  if (Y->paged.table == NULL) {
+    memset((char*)Y->memory+dst, (unsigned char)c, n);
+  } else {
+    char buf[YARN_SYS_CHUNK];
+    memset(buf, (unsigned char)c, sizeof(buf));
+    for (yarn_uint done = 0; done < n; ) {
+      yarn_uint pos = dst + done;
+      size_t len = YARN_PAGE_SIZE - (pos & YARN_PAGE_MASK); // Within a page
+      len = len < YARN_SYS_CHUNK ? len : YARN_SYS_CHUNK;
+      len = n - done < len ? n - done : len;
+      // Zeroing a page that was never written leaves it unallocated.
+      if ((unsigned char)c != 0 || pos >= Y->base ||
+          Y->paged.table[pos >> YARN_PAGE_SHIFT] != NULL) {
+        if (yarn_pageWrite(Y, pos, buf, len) != 0) {
+          yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
+          return;
+        }
+      }
+      done += (yarn_uint)len;
+    }
+  }
+  yarn_returnUint(Y, dst);
+}
+// memcmp(a, b, n): Compares n bytes as unsigned chars. Returns -1, 0 or 1.
+static void yarn_sys_memcmp(yarn_state *Y) {
+  yarn_uint a = yarn_argUint(Y, 0), b = yarn_argUint(Y, 1);
+  yarn_uint n = yarn_argUint(Y, 2);
+  yarn_int result = 0;
+  if (yarn_sysRange(Y, a, n) != 0 || yarn_sysRange(Y, b, n) != 0) {
+    return;
+  }
+  if (Y->paged.table == NULL) {
+    result = memcmp((char*)Y->memory+a, (char*)Y->memory+b, n);
+  } else {
+    char bufa[YARN_SYS_CHUNK], bufb[YARN_SYS_CHUNK];
+    for (yarn_uint done = 0; done < n && result == 0; ) {
+      yarn_uint len = n - done < YARN_SYS_CHUNK ? n - done : YARN_SYS_CHUNK;
+      yarn_pageRead(Y, a+done, bufa, len);
+      yarn_pageRead(Y, b+done, bufb, len);
+      result = memcmp(bufa, bufb, len);
+      done += len;
+    }
+  }
+  yarn_returnInt(Y, (result > 0) - (result < 0));
+}
+// memchr(p, c, n): Finds the first of n bytes equal to the low byte of c.
+// Returns its address, or all ones (-1) if there is none.
+static void yarn_sys_memchr(yarn_state *Y) {
+  yarn_uint p = yarn_argUint(Y, 0), c = yarn_argUint(Y, 1);
+  yarn_uint n = yarn_argUint(Y, 2);
+  yarn_uint result = (yarn_uint)-1;
+  const char *found;
+  if (yarn_sysRange(Y, p, n) != 0) {
+    return;
+  }
+  if (Y->paged.table == NULL) {
+    found = memchr((char*)Y->memory+p, (unsigned char)c, n);
+    if (found != NULL) {
+      result = (yarn_uint)(found - (char*)Y->memory);
+    }
+  } else {
+    char buf[YARN_SYS_CHUNK];
+    for (yarn_uint done = 0; done < n; ) {
+      yarn_uint len = n - done < YARN_SYS_CHUNK ? n - done : YARN_SYS_CHUNK;
+      yarn_pageRead(Y, p+done, buf, len);
+      found = memchr(buf, (unsigned char)c, len);
+      if (found != NULL) {
+        result = p + done + (yarn_uint)(found - buf);
+        break;
+      }
+      done += len;
+    }
+  }
+  yarn_returnUint(Y, result);
 }
 
 // yarn_functions
-yarn_state *yarn_init(size_t memsize) {
+// Where the flat block of a paged state of memsize bytes starts, 0 if the
+// memory is too small to page.
+static size_t yarn_pagedBase(size_t memsize) {
+  if (memsize <= YARN_PAGED_TAIL) {
+    return 0;
+  }
+  return (memsize - YARN_PAGED_TAIL) & ~YARN_PAGE_MASK;
+}
+
+static yarn_state *yarn_create(size_t memsize, size_t base, size_t cap) {
   yarn_uint stackaddr;
   yarn_uint instaddr;
-  yarn_state *Y = malloc(sizeof(yarn_state));
+  yarn_state *Y;
+  if (memsize < (YARN_REG_NUM+2)*sizeof(yarn_uint)) { // No room for registers
+    return NULL;
+  }
+  if (memsize-1 > (size_t)(yarn_uint)-1) { // Not addressable, see YARN_64BIT
+    return NULL;
+  }
+  Y = malloc(sizeof(yarn_state));
   if (Y == NULL) {
     return NULL;
   }
-  Y->code = NULL;
+  Y->image = NULL;
+  Y->codesize = 0;
+  Y->decoded = NULL;
+  Y->verified = NULL;
+  Y->instructioncount = 0;
+  Y->jit = NULL;
+  Y->profile = NULL;
+  Y->trace = NULL;
   Y->memsize = memsize;
-  Y->memory = calloc(memsize,1);
+  Y->mapsize = 0;
+  Y->userdata = NULL;
+  Y->cached = 0;
+  Y->pending = Y->tokens = 0;
+  Y->checkpoint = NULL;
+  Y->base = base;
+  Y->paged.table = NULL;
+  Y->paged.count = 0;
+  Y->paged.cap = (cap + YARN_PAGE_MASK) >> YARN_PAGE_SHIFT;
+  if (base != 0) {
+    Y->paged.table = calloc(base >> YARN_PAGE_SHIFT, sizeof(char*));
+    if (Y->paged.table == NULL) {
+      free(Y);
+      return NULL;
+    }
+  }
+  Y->memory = calloc(memsize - base,1);
   if (Y->memory == NULL) {
+    free(Y->paged.table);
     free(Y);
     return NULL;
   }
@@ -58,551 +393,3228 @@ yarn_state *yarn_init(size_t memsize) {
   yarn_setRegister(Y, YARN_REG_STACK, &stackaddr);
   yarn_setRegister(Y, YARN_REG_BASE, &stackaddr);
 
-  struct { yarn_uint id; yarn_CFunc fn; } syscalls[] = {
-    { 0x00,  yarn_sys_getvmmemory               },
-    { 0x01,  yarn_sys_getinstructioncount       },
-    { 0x02,  yarn_sys_gettime                   },
-    { 0x00,  NULL                               }
-  };
-  for (int i = 0; syscalls[i].fn; i++) {
-    yarn_registerSysCall(Y, syscalls[i].id, syscalls[i].fn);
+  return Y;
+}
+
+yarn_state *yarn_init(size_t memsize) {
+  return yarn_create(memsize, 0, 0);
+}
+
+// Only the flat block at the top is allocated up front, pages below it are
+// allocated zeroed the first time they are written.
+yarn_state *yarn_initPaged(size_t memsize, size_t cap) {
+  return yarn_create(memsize, yarn_pagedBase(memsize), cap);
+}
+
+static void yarn_pagesFree(yarn_pages *P, size_t base) {
+  if (P->table != NULL) {
+    for (size_t i = 0; i < base >> YARN_PAGE_SHIFT; i++) {
+      free(P->table[i]);
+    }
+    free(P->table);
   }
+}
 
-  return Y;
+// Copies the pages of from into to, returns 0 or -1.
+static int yarn_pagesCopy(yarn_pages *to, const yarn_pages *from, size_t base) {
+  size_t n = base >> YARN_PAGE_SHIFT;
+  to->count = from->count;
+  to->cap = from->cap;
+  to->table = calloc(n, sizeof(char*));
+  if (to->table == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (from->table[i] != NULL) {
+      to->table[i] = malloc(YARN_PAGE_SIZE);
+      if (to->table[i] == NULL) {
+        yarn_pagesFree(to, base);
+        to->table = NULL;
+        return -1;
+      }
+      memcpy(to->table[i], from->table[i], YARN_PAGE_SIZE);
+    }
+  }
+  return 0;
 }
 
 void yarn_destroy(yarn_state *Y) {
-  free(Y->code);
+#ifdef YARN_JIT
+  yarn_jitDestroy(Y);
+#endif
+  yarn_profileDestroy(Y);
+  yarn_traceDestroy(Y);
+  yarn_checkpointFree(Y);
+  if (Y->image != NULL) {
+    yarn_imageRelease(Y->image);
+  }
+#ifdef YARN_COW
+  if (Y->mapsize) {
+    munmap(Y->memory, Y->mapsize);
+  } else
+#endif
   free(Y->memory);
+  yarn_pagesFree(&Y->paged, Y->base);
   free(Y);
 }
 
-// Will copy given code to an internal buffer.
-int yarn_loadCode(yarn_state *Y, char *code, size_t codesize) {
-  free(Y->code);
+// Creates an image without code, holding the default syscalls or a copy of the
+// ones of from.
+static yarn_image *yarn_imageNew(const yarn_image *from) {
+  yarn_image *I = malloc(sizeof(yarn_image));
+  if (I == NULL) {
+    return NULL;
+  }
+  I->code = NULL;
+  I->codesize = 0;
+  I->mapsize = 0;
+  I->decoded = NULL;
+  I->verified = NULL;
+  I->refs = 1;
+  I->symbols = NULL;
+  I->names = NULL;
+  if (from != NULL) {
+    memcpy(I->direct, from->direct, sizeof(I->direct));
+    memcpy(I->syscalls, from->syscalls, sizeof(I->syscalls));
+    return I;
+  }
+  memset(I->direct, 0, sizeof(I->direct));
+  memset(I->syscalls, 0, sizeof(I->syscalls));
 
-  Y->code = malloc(codesize);
-  if (Y->code == NULL) {
-    return -1;
+  struct { yarn_uint id; yarn_CFunc fn; } syscalls[] = {
+    { 0x00,  yarn_sys_getvmmemory               },
+    { 0x01,  yarn_sys_getinstructioncount       },
+    { 0x02,  yarn_sys_gettime                   },
+    { 0x03,  yarn_sys_memcpy                    },
+    { 0x04,  yarn_sys_memset                    },
+    { 0x05,  yarn_sys_memcmp                    },
+    { 0x06,  yarn_sys_memchr                    },
+    { 0x00,  NULL                               }
+  };
+  for (int i = 0; syscalls[i].fn; i++) {
+    yarn_imageRegisterSysCall(I, syscalls[i].id, syscalls[i].fn);
   }
-  memcpy(Y->code, code, codesize);
-  Y->codesize = codesize;
-  return 0;
+  return I;
 }
 
-// Returns the pointer to its memory.
-void *yarn_getMemoryPtr(yarn_state *Y) {
-  return Y->memory;
+void yarn_imageRetain(yarn_image *I) {
+  I->refs++;
 }
-size_t yarn_getMemorySize(yarn_state *Y) {
-  return Y->memsize;
+// Frees code, a buffer or a mapping of mapsize bytes.
+static void yarn_freeCode(char *code, size_t mapsize) {
+#ifdef YARN_MMAP
+  if (mapsize) {
+    munmap(code, mapsize);
+    return;
+  }
+#endif
+  (void)mapsize;
+  free(code);
 }
-size_t yarn_getInstructionCount(yarn_state *Y) {
-  return Y->instructioncount;
+
+void yarn_imageRelease(yarn_image *I) {
+  if (--I->refs == 0) {
+    yarn_freeCode(I->code, I->mapsize);
+    free(I->decoded);
+    free(I->verified);
+    free(I->symbols);
+    free(I->names);
+    free(I);
+  }
 }
 
-const char *yarn_registerToString(unsigned char reg) {
-  const char *result;
-  switch(reg) {
-    case YARN_REG_INSTRUCTION: result = "%ins"; break;
-    case YARN_REG_STACK: result = "%stk"; break;
-    case YARN_REG_BASE: result = "%bse"; break;
-    case YARN_REG_RETURN: result = "%ret"; break;
-    case YARN_REG_C1: result = "%C1"; break;
-    case YARN_REG_C2: result = "%C2"; break;
-    case YARN_REG_C3: result = "%C3"; break;
-    case YARN_REG_C4: result = "%C4"; break;
-    case YARN_REG_C5: result = "%C5"; break;
-    case YARN_REG_C6: result = "%C6"; break;
-    case YARN_REG_S1: result = "%S1"; break;
-    case YARN_REG_S2: result = "%S2"; break;
-    case YARN_REG_S3: result = "%S3"; break;
-    case YARN_REG_S4: result = "%S4"; break;
-    case YARN_REG_S5: result = "%S5"; break;
-    case YARN_REG_NULL: result = "%null"; break;
-    default:
-      result = "invalid";
+// Points Y at I, taking over a reference the caller holds.
+static void yarn_attach(yarn_state *Y, yarn_image *I) {
+  if (Y->image != NULL && Y->image != I) {
+    yarn_imageRelease(Y->image);
+  }
+  Y->image = I;
+  Y->codesize = I->codesize;
+  Y->decoded = I->decoded;
+  Y->verified = I->verified;
+  yarn_checkpointBreak(Y); // Deltas don't carry code, the next is full
+#ifdef YARN_JIT
+  if (Y->jit) {
+    yarn_jitReset(Y);
+  }
+#endif
+  if (Y->profile) { // Counts are per ip of the old code
+    yarn_profileDestroy(Y);
+    yarn_profileCreate(Y);
   }
-  return result;
 }
 
-const char *yarn_statusToString(int status) {
-  const char *result;
-  switch(status) {
-    case YARN_STATUS_OK: result = "ok"; break;
-    case YARN_STATUS_HALT: result = "halt"; break;
-    case YARN_STATUS_PAUSE: result = "paused"; break;
-    case YARN_STATUS_INVALIDMEMORY: result = "invalid memory access error"; break;
-    case YARN_STATUS_INVALIDINSTRUCTION: result = "invalid instruction error"; break;
-    case YARN_STATUS_DIVBYZERO: result = "divide by zero  error"; break;
-    default:
-      result = "invalid";
+// Decodes the instruction at ip into in. Never fails, invalid or truncated
+// instructions decode to YARN_XINST_INVALID.
+static void yarn_decode(const yarn_image *I, yarn_uint ip, yarn_inst *in) {
+  const unsigned char *c = (const unsigned char *)I->code + ip;
+  size_t left = I->codesize - ip;
+  size_t len;
+
+  in->op = c[0];
+  in->rA = in->rB = 0;
+  in->d = 0;
+  switch (c[0] & 0xF0) {
+    case YARN_ICODE_CONTROL: len = YARN_LEN_CONTROL; break;
+    case YARN_ICODE_ARITH: len = YARN_LEN_ARITH; break;
+    case YARN_ICODE_MOVE: len = YARN_LEN_MOVE; break;
+    case YARN_ICODE_STACK: len = YARN_LEN_STACK; break;
+    case YARN_ICODE_CONDITIONAL: len = YARN_LEN_CONDITIONAL; break;
+    case YARN_ICODE_BRANCH: len = YARN_LEN_BRANCH; break;
+    default: len = 1;
+  }
+  if (!(c[0] <= YARN_INST_NOP ||
+        (c[0] >= YARN_INST_ADD && c[0] <= YARN_INST_NOT) ||
+        (c[0] >= YARN_INST_IR && c[0] <= YARN_INST_RM) ||
+        (c[0] >= YARN_INST_PUSH && c[0] <= YARN_INST_POP) ||
+        (c[0] >= YARN_INST_CALL && c[0] <= YARN_INST_SYSCALL) ||
+        (c[0] >= YARN_INST_LT && c[0] <= YARN_INST_NEQ)) || len > left) {
+    in->op = YARN_XINST_INVALID;
+  }
+  in->next = ip + (yarn_uint)len;
+  if (in->op == YARN_XINST_INVALID) {
+    return;
+  }
+
+  switch (c[0] & 0xF0) {
+    case YARN_ICODE_ARITH:
+    case YARN_ICODE_MOVE:
+      in->rA = (c[1] & 0xF0)>>4;
+      in->rB = c[1] & 0x0F;
+      memcpy(&in->d, c+2, sizeof(in->d));
+      break;
+    case YARN_ICODE_STACK:
+      in->rA = (c[1] & 0xF0)>>4;
+      break;
+    case YARN_ICODE_CONDITIONAL:
+      in->rA = (c[1] & 0xF0)>>4;
+      in->rB = c[1] & 0x0F;
+      break;
+    case YARN_ICODE_BRANCH:
+      memcpy(&in->d, c+1, sizeof(in->d));
+      break;
   }
-  return result;
 }
 
-// Shortcuts for register manipulation
-#define registerLocation(r) Y->memsize-(yarn_uint)(r+2)*sizeof(yarn_uint)
-void yarn_getRegister(yarn_state *Y, unsigned char reg, void *val) {
-  yarn_getMemory(Y, registerLocation(reg), val, sizeof(yarn_uint));
+// Merges common instruction pairs of the decoded stream into
+// superinstructions. Only the first slot changes, so jumping straight to the
+// second instruction still runs it on its own.
+static void yarn_fuse(yarn_image *I) {
+  yarn_uint ip = 0;
+
+  while (ip < I->codesize && I->decoded[ip].next < I->codesize) {
+    yarn_inst *a = &I->decoded[ip];
+    const yarn_inst *b = &I->decoded[a->next];
+    unsigned short op = 0;
+
+    if ((a->op & 0xF0) == YARN_ICODE_CONDITIONAL && a->op <= YARN_INST_NEQ &&
+        b->op == YARN_INST_CONDJUMP) {
+      op = YARN_XINST_LT_JIF + (a->op - YARN_INST_LT);
+    } else if (a->op == YARN_INST_IR && a->rB != YARN_REG_INSTRUCTION &&
+               b->op == YARN_INST_ADD) {
+      op = YARN_XINST_IR_ADD;
+    } else if (a->op == YARN_INST_PUSH && b->op == YARN_INST_PUSH) {
+      op = YARN_XINST_PUSH_PUSH;
+    } else if (a->op == YARN_INST_POP && a->rA != YARN_REG_INSTRUCTION &&
+               b->op == YARN_INST_POP) {
+      op = YARN_XINST_POP_POP;
+    }
+    if (op == 0) {
+      ip = a->next;
+      continue;
+    }
+    if (op < YARN_XINST_IR_ADD) {
+      a->d = b->d;
+    }
+    a->op = op;
+    ip = b->next;
+  }
 }
-void yarn_setRegister(yarn_state *Y, unsigned char reg, void *val) {
-  yarn_setMemory(Y, registerLocation(reg), val, sizeof(yarn_uint));
+
+// Walks the code reachable from address 0 and checks that it can run without
+// the interpreter checking ip: every instruction is valid and fits, every
+// jump, call and fall through lands on an instruction start of the decoded
+// stream, and only branches write %ins. Marks the instruction starts it
+// reaches in verified, work has room for codesize addresses. Returns 0 if the
+// code verifies, -1 if not.
+static int yarn_verifyWalk(const yarn_image *I, unsigned char *verified,
+                           yarn_uint *work) {
+  size_t top = 0;
+
+  verified[0] = 1;
+  work[top++] = 0;
+  while (top > 0) {
+    const yarn_inst *in = &I->decoded[work[--top]];
+    unsigned short op = in->op;
+    yarn_uint next[2];
+    int nnext = 0, optional = 0;
+
+    if (op >= YARN_XINST_FUSED) { // Its second half is walked on its own
+      op = yarn_unfused[op-YARN_XINST_FUSED];
+    }
+    if (op == YARN_XINST_INVALID ||
+        (((op >= YARN_INST_ADD && op <= YARN_INST_NOT) ||
+          (op >= YARN_INST_IR && op <= YARN_INST_RR)) &&
+         in->rB == YARN_REG_INSTRUCTION) ||
+        (op == YARN_INST_POP && in->rA == YARN_REG_INSTRUCTION)) {
+      return -1;
+    }
+    switch (op) {
+      case YARN_INST_HALT:
+      case YARN_INST_PAUSE: // Only resumed through yarn_execute, which checks
+        next[nnext++] = in->next;
+        optional = 1;
+        break;
+      case YARN_INST_RET:
+        break;
+      case YARN_INST_JUMP:
+        next[nnext++] = in->d;
+        break;
+      case YARN_INST_CALL:
+      case YARN_INST_CONDJUMP:
+        next[nnext++] = in->d;
+        next[nnext++] = in->next;
+        break;
+      default:
+        next[nnext++] = in->next;
+    }
+    for (int i = 0; i < nnext; i++) {
+      if (next[i] >= I->codesize ||
+          I->decoded[next[i]].op == YARN_XINST_UNDECODED) {
+        if (optional) {
+          continue;
+        }
+        return -1;
+      }
+      if (!verified[next[i]]) {
+        verified[next[i]] = 1;
+        work[top++] = next[i];
+      }
+    }
+  }
+  return 0;
 }
-void yarn_incRegister(yarn_state *Y, unsigned char reg, yarn_int val) {
-  yarn_int rval;
-  yarn_getRegister(Y, reg, &rval);
-  rval += val;
-  yarn_setRegister(Y, reg, &rval);
+
+// Returns the instruction starts of the code that yarn_verifyWalk reached, or
+// NULL if it doesn't verify. Return addresses, syscalls and stores into the
+// register window can still move ip anywhere, the interpreter checks those
+// targets against the marks.
+static unsigned char *yarn_verify(const yarn_image *I) {
+  unsigned char *verified;
+  yarn_uint *work;
+
+  if (I->codesize == 0) {
+    return NULL;
+  }
+  verified = calloc(I->codesize, 1);
+  work = malloc(I->codesize*sizeof(yarn_uint));
+  if (verified == NULL || work == NULL ||
+      yarn_verifyWalk(I, verified, work) != 0) {
+    free(verified);
+    verified = NULL;
+  }
+  free(work);
+  return verified;
 }
-#undef registerLocation
 
-// Memory manipulations.
-void yarn_getMemory(yarn_state *Y, yarn_uint pos, void *val, size_t bsize) {
-  if ((pos+bsize) > Y->memsize) { // Check for out-of-bounds
-    yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
-    return;
+// Makes code the image's code, taking it over, and translates it into the
+// decoded stream. Does a linear sweep from address 0, any other address is
+// marked so it gets decoded from the bytes. Leaves the image as it was on
+// failure, the caller still owns code then.
+static int yarn_prepare(yarn_image *I, char *code, size_t codesize,
+                        size_t mapsize) {
+  yarn_inst *decoded = malloc((codesize ? codesize : 1)*sizeof(yarn_inst));
+  yarn_uint ip;
+
+  if (decoded == NULL) {
+    return -1;
   }
-  memcpy(val, ((char*)Y->memory)+pos, bsize);
+  yarn_freeCode(I->code, I->mapsize);
+  free(I->decoded);
+  free(I->verified);
+  free(I->symbols);         // They were the old code's
+  free(I->names);
+  I->symbols = NULL;
+  I->names = NULL;
+  I->code = code;
+  I->codesize = codesize;
+  I->mapsize = mapsize;
+  I->decoded = decoded;
+  for (ip = 0; ip < codesize; ip++) {
+    decoded[ip].op = YARN_XINST_UNDECODED;
+  }
+  for (ip = 0; ip < codesize; ip = decoded[ip].next) {
+    yarn_decode(I, ip, &decoded[ip]);
+  }
+  yarn_fuse(I);
+  I->verified = yarn_verify(I);
+  return 0;
 }
-void yarn_setMemory(yarn_state *Y, yarn_uint pos, void *val, size_t bsize) {
-  if ((pos+bsize) > Y->memsize) { // Check for out-of-bounds
-    yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
-    return;
+
+static char *yarn_copyCode(const char *code, size_t codesize) {
+  char *copy = malloc(codesize ? codesize : 1);
+  if (copy != NULL) {
+    memcpy(copy, code, codesize);
   }
-  memcpy(((char*)Y->memory)+pos, val,  bsize);
+  return copy;
 }
 
-// Pushs the stack
-void yarn_push(yarn_state *Y, yarn_int val) {
-  yarn_uint stk;
-  yarn_incRegister(Y, YARN_REG_STACK, -(int)sizeof(yarn_int));
-  yarn_getRegister(Y, YARN_REG_STACK, &stk);
-  yarn_setMemory(Y, stk, &val, sizeof(val));
+// Maps the object file at path read-only and shared, so every process running
+// it uses the same pages. Where there is no mmap, or the file is empty, it's
+// read into a buffer instead and *mapsize is 0.
+static char *yarn_mapCode(const char *path, size_t *codesize, size_t *mapsize) {
+  FILE *fp;
+  char *code;
+  long size;
+
+  *codesize = *mapsize = 0;
+#ifdef YARN_MMAP
+  {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return NULL;
+    }
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return NULL;
+    }
+    if (st.st_size > 0) {
+      code = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (code == MAP_FAILED) {
+        return NULL;
+      }
+      *codesize = *mapsize = (size_t)st.st_size;
+      return code;
+    }
+    close(fd);
+  }
+#endif
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  fseek(fp, 0L, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+  code = size >= 0 ? malloc(size ? (size_t)size : 1) : NULL;
+  if (code != NULL && fread(code, 1, (size_t)size, fp) != (size_t)size) {
+    free(code);
+    code = NULL;
+  }
+  fclose(fp);
+  *codesize = (size_t)size;
+  return code;
 }
-// Pops the stack
-yarn_int yarn_pop(yarn_state *Y) {
-  yarn_uint stk;
-  yarn_int val;
-  yarn_getRegister(Y, YARN_REG_STACK, &stk);
-  yarn_getMemory(Y, stk, &val, sizeof(val));
-  yarn_incRegister(Y, YARN_REG_STACK, (int)sizeof(yarn_int));
+
+// Decodes code into a new image with the default syscalls, taking over code.
+static yarn_image *yarn_imageFrom(char *code, size_t codesize, size_t mapsize) {
+  yarn_image *I;
+  if (code == NULL) {
+    return NULL;
+  }
+  I = yarn_imageNew(NULL);
+  if (I == NULL || yarn_prepare(I, code, codesize, mapsize) != 0) {
+    yarn_freeCode(code, mapsize);
+    if (I != NULL) {
+      yarn_imageRelease(I);
+    }
+    return NULL;
+  }
+  return I;
+}
+
+// Copies and decodes code into a new image with the default syscalls.
+yarn_image *yarn_imageInit(char *code, size_t codesize) {
+  return yarn_imageFrom(yarn_copyCode(code, codesize), codesize, 0);
+}
+yarn_image *yarn_imageInitMapped(const char *path) {
+  size_t codesize, mapsize;
+  char *code = yarn_mapCode(path, &codesize, &mapsize);
+  return yarn_imageFrom(code, codesize, mapsize);
+}
+
+/*
+ * Relocatable objects, written by `tools/assemble.py -c`. Every number is a 32
+ * bit little-endian word:
+ *   header       "yarnobj1" ("yarnob64" for YARN_64BIT code), codesize,
+ *                nsymbols, nrelocs, namesize
+ *   code         codesize bytes, assembled as if loaded at address 0
+ *   symbols      name, value, flags each: name is an offset into names and
+ *                value one into code
+ *   relocations  offset, symbol each: the immediate at offset in code gets
+ *                the address of the symbol added once it's linked
+ *   names        NUL terminated
+ * A symbol that isn't YARN_SYMBOL_DEFINED is an import, and binds to the
+ * object exporting it when linked.
+ */
+#ifdef YARN_64BIT
+#define YARN_OBJECT_MAGIC "yarnob64"
+#else
+#define YARN_OBJECT_MAGIC "yarnobj1"
+#endif
+#define YARN_OBJECT_HEADER 24
+enum { YARN_SYMBOL_DEFINED = 1, YARN_SYMBOL_EXPORTED = 2 };
+
+struct yarn_object {
+  char *code;
+  struct { uint32_t name, value, flags; } *symbols;
+  struct { uint32_t offset, symbol; } *relocs;
+  char *names;
+  uint32_t codesize, nsymbols, nrelocs, namesize;
+};
+
+static uint32_t yarn_objectWord(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+void yarn_objectRelease(yarn_object *O) {
+  free(O->code);
+  free(O->symbols);
+  free(O->relocs);
+  free(O->names);
+  free(O);
+}
+
+// Everything is checked here, so linking can trust the offsets.
+yarn_object *yarn_objectInit(const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data + YARN_OBJECT_HEADER;
+  yarn_object *O;
+  if (size < YARN_OBJECT_HEADER || memcmp(data, YARN_OBJECT_MAGIC, 8) != 0) {
+    return NULL;
+  }
+  O = calloc(1, sizeof(yarn_object));
+  if (O == NULL) {
+    return NULL;
+  }
+  O->codesize = yarn_objectWord(p-16);
+  O->nsymbols = yarn_objectWord(p-12);
+  O->nrelocs = yarn_objectWord(p-8);
+  O->namesize = yarn_objectWord(p-4);
+  if ((uint64_t)size != YARN_OBJECT_HEADER + (uint64_t)O->codesize +
+                        12*(uint64_t)O->nsymbols + 8*(uint64_t)O->nrelocs +
+                        O->namesize ||
+      (O->namesize ? data[size-1] != '\0' : O->nsymbols != 0)) {
+    yarn_objectRelease(O);
+    return NULL;
+  }
+  O->code = malloc(O->codesize ? O->codesize : 1);
+  O->symbols = malloc(O->nsymbols ? O->nsymbols*sizeof(*O->symbols) : 1);
+  O->relocs = malloc(O->nrelocs ? O->nrelocs*sizeof(*O->relocs) : 1);
+  O->names = malloc(O->namesize ? O->namesize : 1);
+  if (O->code == NULL || O->symbols == NULL || O->relocs == NULL ||
+      O->names == NULL) {
+    yarn_objectRelease(O);
+    return NULL;
+  }
+  memcpy(O->code, p, O->codesize);
+  p += O->codesize;
+  for (uint32_t i = 0; i < O->nsymbols; i++, p += 12) {
+    O->symbols[i].name = yarn_objectWord(p);
+    O->symbols[i].value = yarn_objectWord(p+4);
+    O->symbols[i].flags = yarn_objectWord(p+8);
+    if (O->symbols[i].name >= O->namesize ||
+        ((O->symbols[i].flags & YARN_SYMBOL_DEFINED) &&
+         O->symbols[i].value > O->codesize)) {
+      yarn_objectRelease(O);
+      return NULL;
+    }
+  }
+  for (uint32_t i = 0; i < O->nrelocs; i++, p += 8) {
+    O->relocs[i].offset = yarn_objectWord(p);
+    O->relocs[i].symbol = yarn_objectWord(p+4);
+    if (O->codesize < sizeof(yarn_uint) ||
+        O->relocs[i].offset > O->codesize - sizeof(yarn_uint) ||
+        O->relocs[i].symbol >= O->nsymbols) {
+      yarn_objectRelease(O);
+      return NULL;
+    }
+  }
+  memcpy(O->names, p, O->namesize);
+  return O;
+}
+yarn_object *yarn_objectInitFile(const char *path) {
+  size_t size, mapsize;
+  char *data = yarn_mapCode(path, &size, &mapsize);
+  yarn_object *O;
+  if (data == NULL) {
+    return NULL;
+  }
+  O = yarn_objectInit(data, size);
+  yarn_freeCode(data, mapsize);
+  return O;
+}
+
+// FNV-1a
+static uint32_t yarn_symbolHash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return h;
+}
+// The slot holding name, or the empty one it would go in.
+static yarn_symbol *yarn_symbolSlot(yarn_symbol *table, size_t mask,
+                                    const char *name, uint32_t hash) {
+  for (size_t i = hash & mask;; i = (i+1) & mask) {
+    if (table[i].name == NULL ||
+        (table[i].hash == hash && strcmp(table[i].name, name) == 0)) {
+      return &table[i];
+    }
+  }
+}
+
+// Lays the objects out one after the other and fills in the exports first,
+// then resolves every symbol and applies the relocations in a single pass.
+yarn_image *yarn_imageLink(yarn_object *const *objects, int n) {
+  size_t codesize = 0, nexports = 0, namesize = 0, maxsymbols = 0, mask = 1;
+  size_t base;
+  yarn_symbol *symbols;
+  yarn_uint *addrs;
+  char *names, *name, *code;
+  yarn_image *I;
+
+  for (int i = 0; i < n; i++) {
+    const yarn_object *O = objects[i];
+    codesize += O->codesize;
+    maxsymbols = O->nsymbols > maxsymbols ? O->nsymbols : maxsymbols;
+    for (uint32_t s = 0; s < O->nsymbols; s++) {
+      if (O->symbols[s].flags & YARN_SYMBOL_EXPORTED) {
+        nexports++;
+        namesize += strlen(O->names + O->symbols[s].name) + 1;
+      }
+    }
+  }
+  if (codesize > (yarn_uint)-1) {
+    return NULL;
+  }
+  while (mask+1 < 2*nexports) {
+    mask = mask*2 + 1;
+  }
+  symbols = calloc(mask+1, sizeof(yarn_symbol));
+  addrs = malloc(maxsymbols ? maxsymbols*sizeof(yarn_uint) : 1);
+  names = malloc(namesize ? namesize : 1);
+  code = malloc(codesize ? codesize : 1);
+  if (symbols == NULL || addrs == NULL || names == NULL || code == NULL) {
+    goto fail;
+  }
+
+  name = names;
+  base = 0;
+  for (int i = 0; i < n; i++) {
+    const yarn_object *O = objects[i];
+    memcpy(code + base, O->code, O->codesize);
+    for (uint32_t s = 0; s < O->nsymbols; s++) {
+      const char *sname = O->names + O->symbols[s].name;
+      uint32_t hash = yarn_symbolHash(sname);
+      yarn_symbol *slot;
+      if (!(O->symbols[s].flags & YARN_SYMBOL_EXPORTED)) {
+        continue;
+      }
+      slot = yarn_symbolSlot(symbols, mask, sname, hash);
+      if (slot->name != NULL || !(O->symbols[s].flags & YARN_SYMBOL_DEFINED)) {
+        goto fail; // Exported twice, or exported without being defined
+      }
+      strcpy(name, sname);
+      slot->name = name;
+      slot->hash = hash;
+      slot->addr = (yarn_uint)(base + O->symbols[s].value);
+      name += strlen(sname) + 1;
+    }
+    base += O->codesize;
+  }
+
+  base = 0;
+  for (int i = 0; i < n; i++) {
+    const yarn_object *O = objects[i];
+    for (uint32_t s = 0; s < O->nsymbols; s++) {
+      const char *sname = O->names + O->symbols[s].name;
+      yarn_symbol *slot;
+      if (O->symbols[s].flags & YARN_SYMBOL_DEFINED) {
+        addrs[s] = (yarn_uint)(base + O->symbols[s].value);
+        continue;
+      }
+      slot = yarn_symbolSlot(symbols, mask, sname, yarn_symbolHash(sname));
+      if (slot->name == NULL) {
+        goto fail; // Nothing exports it
+      }
+      addrs[s] = slot->addr;
+    }
+    for (uint32_t r = 0; r < O->nrelocs; r++) {
+      yarn_uint word;
+      memcpy(&word, code + base + O->relocs[r].offset, sizeof(word));
+      word += addrs[O->relocs[r].symbol];
+      memcpy(code + base + O->relocs[r].offset, &word, sizeof(word));
+    }
+    base += O->codesize;
+  }
+  free(addrs);
+
+  I = yarn_imageFrom(code, codesize, 0);
+  if (I == NULL) {
+    free(symbols);
+    free(names);
+    return NULL;
+  }
+  I->symbols = symbols;
+  I->symbolmask = mask;
+  I->names = names;
+  return I;
+fail:
+  free(symbols);
+  free(addrs);
+  free(names);
+  free(code);
+  return NULL;
+}
+
+int yarn_imageSymbol(yarn_image *I, const char *name, yarn_uint *addr) {
+  yarn_symbol *slot;
+  if (I->symbols == NULL) {
+    return -1;
+  }
+  slot = yarn_symbolSlot(I->symbols, I->symbolmask, name, yarn_symbolHash(name));
+  if (slot->name == NULL) {
+    return -1;
+  }
+  *addr = slot->addr;
+  return 0;
+}
+int yarn_getSymbol(yarn_state *Y, const char *name, yarn_uint *addr) {
+  return Y->image != NULL ? yarn_imageSymbol(Y->image, name, addr) : -1;
+}
+
+// Gives Y code, taking it over. A state that shares its image gets a private
+// one, keeping the syscalls it had.
+static int yarn_setCode(yarn_state *Y, char *code, size_t codesize,
+                       size_t mapsize) {
+  yarn_image *I = Y->image;
+
+  if (code == NULL) {
+    return -1;
+  }
+  if (I == NULL || I->refs > 1) {
+    I = yarn_imageNew(Y->image);
+  }
+  if (I == NULL || yarn_prepare(I, code, codesize, mapsize) != 0) {
+    yarn_freeCode(code, mapsize);
+    if (I != NULL && I != Y->image) {
+      yarn_imageRelease(I);
+    }
+    return -1;
+  }
+  yarn_attach(Y, I);
+  return 0;
+}
+
+// Will copy given code to an internal buffer, and decode it.
+int yarn_loadCode(yarn_state *Y, char *code, size_t codesize) {
+  return yarn_setCode(Y, yarn_copyCode(code, codesize), codesize, 0);
+}
+// Executes the object file at path from a read-only mapping of it, no copy.
+int yarn_loadCodeMapped(yarn_state *Y, const char *path) {
+  size_t codesize, mapsize;
+  char *code = yarn_mapCode(path, &codesize, &mapsize);
+  return yarn_setCode(Y, code, codesize, mapsize);
+}
+
+int yarn_loadImage(yarn_state *Y, yarn_image *I) {
+  if (Y->image != I) { // yarn_attach keeps the reference it has to I
+    yarn_imageRetain(I);
+  }
+  yarn_attach(Y, I);
+  return 0;
+}
+yarn_image *yarn_getImage(yarn_state *Y) {
+  return Y->image;
+}
+
+/*
+ * Snapshots:
+ *   A snapshot holds the memory of a state (registers, status and flags
+ *   included), its instruction count and its image, which carries the code and
+ *   syscalls. With YARN_COW the memory is written once to an unlinked temporary
+ *   file, and every fork maps it MAP_PRIVATE. Pages are shared until the fork
+ *   first writes them and the kernel copies them, so the interpreter and the
+ *   JIT access forked memory like any other. Without it, forks copy.
+ */
+struct yarn_snap {
+  yarn_image *image;
+  size_t memsize;
+  size_t instructioncount;
+  int jit;                  // YARN_OPTION_JIT of the state, forks inherit it
+  void *userdata;           // Forks inherit it too
+  yarn_uint pending, tokens; // A fork of a suspended state can be resumed
+#ifdef YARN_COW
+  FILE *file;               // Holds the memory, NULL if it's in memory below
+#endif
+  void *memory;
+  yarn_pages paged;         // Copy of a paged state's pages, memory holds its
+                            //   flat block
+};
+
+yarn_snap *yarn_snapshot(yarn_state *Y) {
+  yarn_snap *S = malloc(sizeof(yarn_snap));
+  if (S == NULL) {
+    return NULL;
+  }
+  S->image = Y->image;
+  S->memsize = Y->memsize;
+  S->instructioncount = Y->instructioncount;
+  S->jit = Y->jit != NULL;
+  S->userdata = Y->userdata;
+  S->pending = Y->pending;
+  S->tokens = Y->tokens;
+  S->memory = NULL;
+  yarn_flushRegisters(Y);
+  S->paged.table = NULL;
+#ifdef YARN_COW
+  // Paged memory is copied below, which only costs the pages that were written.
+  S->file = Y->paged.table == NULL ? tmpfile() : NULL;
+  if (S->file != NULL) {
+    if (fwrite(Y->memory, 1, Y->memsize, S->file) != Y->memsize ||
+        fflush(S->file) != 0) {
+      fclose(S->file);
+      free(S);
+      return NULL;
+    }
+  } else
+#endif
+  {
+    S->memory = malloc(Y->memsize - Y->base);
+    if (S->memory == NULL) {
+      free(S);
+      return NULL;
+    }
+    memcpy(S->memory, Y->memory, Y->memsize - Y->base);
+    if (Y->paged.table != NULL &&
+        yarn_pagesCopy(&S->paged, &Y->paged, Y->base) != 0) {
+      free(S->memory);
+      free(S);
+      return NULL;
+    }
+  }
+  if (S->image != NULL) {
+    yarn_imageRetain(S->image);
+  }
+  return S;
+}
+
+void yarn_snapshotRelease(yarn_snap *S) {
+  if (S->image != NULL) {
+    yarn_imageRelease(S->image);
+  }
+#ifdef YARN_COW
+  if (S->file != NULL) {
+    fclose(S->file); // Forks keep their mappings
+  }
+#endif
+  free(S->memory);
+  yarn_pagesFree(&S->paged, yarn_pagedBase(S->memsize));
+  free(S);
+}
+
+yarn_state *yarn_fork(yarn_snap *S) {
+  yarn_state *Y = malloc(sizeof(yarn_state));
+  if (Y == NULL) {
+    return NULL;
+  }
+  Y->image = NULL;
+  Y->codesize = 0;
+  Y->decoded = NULL;
+  Y->verified = NULL;
+  Y->instructioncount = S->instructioncount;
+  Y->jit = NULL;
+  Y->profile = NULL;
+  Y->trace = NULL;
+  Y->memsize = S->memsize;
+  Y->mapsize = 0;
+  Y->userdata = S->userdata;
+  Y->cached = 0;
+  Y->pending = S->pending;
+  Y->tokens = S->tokens;
+  Y->checkpoint = NULL;     // A fork starts its own checkpoints
+  Y->base = 0;
+  Y->paged.table = NULL;
+  Y->paged.count = 0;
+  Y->paged.cap = 0;
+  if (S->paged.table != NULL) {
+    Y->base = yarn_pagedBase(S->memsize);
+    if (yarn_pagesCopy(&Y->paged, &S->paged, Y->base) != 0) {
+      free(Y);
+      return NULL;
+    }
+  }
+#ifdef YARN_COW
+  if (S->file != NULL) {
+    Y->mapsize = S->memsize;
+    Y->memory = mmap(NULL, Y->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(S->file), 0);
+    if (Y->memory == MAP_FAILED) {
+      free(Y);
+      return NULL;
+    }
+  } else
+#endif
+  {
+    Y->memory = malloc(S->memsize - Y->base);
+    if (Y->memory == NULL) {
+      yarn_pagesFree(&Y->paged, Y->base);
+      free(Y);
+      return NULL;
+    }
+    memcpy(Y->memory, S->memory, S->memsize - Y->base);
+  }
+  if (S->image != NULL) {
+    yarn_loadImage(Y, S->image);
+  }
+  if (S->jit && yarn_setOption(Y, YARN_OPTION_JIT, 1) != 0) {
+    yarn_destroy(Y);
+    return NULL;
+  }
+  return Y;
+}
+
+/*
+ * Checkpoints:
+ *   A stream of records, each a header followed by pages of memory and ended
+ *   by YARN_CHECKPOINT_END. A full record also carries the code and the keys of
+ *   the syscalls, and holds every page that isn't zero. A delta holds only the
+ *   pages that changed since the record before it, so it costs what the guest
+ *   wrote rather than what it has. Pages are compared byte for byte against a
+ *   copy the state keeps of each one as of that record, not by hash: the guest
+ *   controls what's in memory and could write a page hashing like the old one.
+ *   The copy costs as much memory again as the pages that aren't zero.
+ *   Records of one full checkpoint and its deltas share a chain id and count
+ *   up in seq, so a delta is never applied on top of the wrong state. Deltas
+ *   don't hold code, so new code ends the chain. Every number is 64 bit
+ *   little-endian. The header
+ *   has the word size of the build, registers in memory are that wide, so a
+ *   32-bit build doesn't load a YARN_64BIT one's checkpoints or vice versa.
+ */
+#define YARN_CHECKPOINT_MAGIC "yarnckpt"
+#define YARN_CHECKPOINT_VERSION 2
+#define YARN_CHECKPOINT_END UINT64_MAX // Page index ending a record
+#define YARN_CHECKPOINT_MAXPAGE ((uint64_t)1 << 24) // Largest page a record may use
+enum { YARN_CHECKPOINT_FULL, YARN_CHECKPOINT_DELTA };
+
+struct yarn_checkpoint {
+  uint64_t chain;           // Id of the last record written or read, 0 if the
+                            //   next one has to be full
+  uint64_t seq;             // Deltas since its full checkpoint
+  char **pages;             // Copy of each page as of that record, NULL while
+                            //   it's zero
+  yarn_uint *keys;          // Syscalls of a loaded checkpoint
+  size_t nkeys;
+};
+
+typedef struct {
+  uint64_t kind, chain, seq;
+  uint64_t memsize, paged, cap; // paged is 1 for yarn_initPaged, cap in bytes
+  uint64_t pagesize, wordsize;
+  uint64_t instructioncount, pending, tokens;
+} yarn_checkpointHeader;
+
+static const char yarn_zeroPage[YARN_PAGE_SIZE];
+
+static size_t yarn_checkpointPages(const yarn_state *Y) {
+  return (Y->memsize + YARN_PAGE_MASK) >> YARN_PAGE_SHIFT;
+}
+
+// Makes the next checkpoint of Y full.
+static void yarn_checkpointBreak(yarn_state *Y) {
+  if (Y->checkpoint != NULL) {
+    Y->checkpoint->chain = 0;
+  }
+}
+
+static void yarn_checkpointFree(yarn_state *Y) {
+  if (Y->checkpoint != NULL) {
+    if (Y->checkpoint->pages != NULL) {
+      for (size_t i = 0; i < yarn_checkpointPages(Y); i++) {
+        free(Y->checkpoint->pages[i]);
+      }
+    }
+    free(Y->checkpoint->pages);
+    free(Y->checkpoint->keys);
+    free(Y->checkpoint);
+  }
+}
+
+// Page i of Y's memory and its length, NULL if it's paged and never written.
+static const char *yarn_checkpointPage(const yarn_state *Y, size_t i, size_t *len) {
+  size_t pos = i << YARN_PAGE_SHIFT;
+  *len = Y->memsize - pos < YARN_PAGE_SIZE ? Y->memsize - pos : YARN_PAGE_SIZE;
+  if (pos >= Y->base) {
+    return (const char*)Y->memory + (pos - Y->base);
+  }
+  return Y->paged.table[i];
+}
+
+// Makes the copy of page i what it is now, page being NULL for zero.
+static int yarn_checkpointKeep(struct yarn_checkpoint *C, size_t i,
+                               const char *page, size_t len) {
+  if (page == NULL) {
+    free(C->pages[i]);
+    C->pages[i] = NULL;
+    return 0;
+  }
+  if (C->pages[i] == NULL && (C->pages[i] = malloc(YARN_PAGE_SIZE)) == NULL) {
+    return -1;
+  }
+  memcpy(C->pages[i], page, len);
+  return 0;
+}
+
+// Copies every page that isn't zero, the state the next delta is taken
+// against.
+static int yarn_checkpointKeepAll(yarn_state *Y) {
+  struct yarn_checkpoint *C = Y->checkpoint;
+  if (C->pages == NULL &&
+      (C->pages = calloc(yarn_checkpointPages(Y), sizeof(char*))) == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < yarn_checkpointPages(Y); i++) {
+    size_t len;
+    const char *page = yarn_checkpointPage(Y, i, &len);
+    if (page != NULL && memcmp(page, yarn_zeroPage, len) == 0) {
+      page = NULL;
+    }
+    if (yarn_checkpointKeep(C, i, page, len) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Not random, only unlikely to repeat between the streams a host keeps.
+static uint64_t yarn_checkpointChain(const yarn_state *Y) {
+  uint64_t x = (uint64_t)time(NULL) ^ (uint64_t)clock() << 32 ^
+               (uint64_t)(uintptr_t)Y ^ (uint64_t)Y->instructioncount;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9u;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBu;
+  x ^= x >> 31;
+  return x ? x : 1;
+}
+
+static int yarn_write64(FILE *fp, uint64_t v) {
+  unsigned char b[8];
+  for (int i = 0; i < 8; i++) {
+    b[i] = (unsigned char)(v >> 8*i);
+  }
+  return fwrite(b, 1, 8, fp) == 8 ? 0 : -1;
+}
+static int yarn_read64(FILE *fp, uint64_t *v) {
+  unsigned char b[8];
+  if (fread(b, 1, 8, fp) != 8) {
+    return -1;
+  }
+  *v = 0;
+  for (int i = 8; i-- > 0;) {
+    *v = *v << 8 | b[i];
+  }
+  return 0;
+}
+
+static int yarn_checkpointWriteHeader(const yarn_state *Y, FILE *fp, int kind) {
+  uint64_t fields[] = {
+    YARN_CHECKPOINT_VERSION, kind, Y->checkpoint->chain, Y->checkpoint->seq,
+    Y->memsize, Y->paged.table != NULL, (uint64_t)Y->paged.cap << YARN_PAGE_SHIFT,
+    YARN_PAGE_SIZE, YARN_WORDSIZE, Y->instructioncount, Y->pending, Y->tokens,
+  };
+  if (fwrite(YARN_CHECKPOINT_MAGIC, 1, 8, fp) != 8) {
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+    if (yarn_write64(fp, fields[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+static int yarn_checkpointReadHeader(FILE *fp, yarn_checkpointHeader *H) {
+  char magic[8];
+  uint64_t version;
+  uint64_t *fields[] = {
+    &H->kind, &H->chain, &H->seq, &H->memsize, &H->paged, &H->cap,
+    &H->pagesize, &H->wordsize, &H->instructioncount, &H->pending, &H->tokens,
+  };
+  if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, YARN_CHECKPOINT_MAGIC, 8) ||
+      yarn_read64(fp, &version) != 0 || version != YARN_CHECKPOINT_VERSION) {
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+    if (yarn_read64(fp, fields[i]) != 0) {
+      return -1;
+    }
+  }
+  if (H->pagesize == 0 || H->pagesize > YARN_CHECKPOINT_MAXPAGE ||
+      H->wordsize != YARN_WORDSIZE || H->memsize > SIZE_MAX ||
+      H->cap > SIZE_MAX) {
+    return -1;
+  }
+  return 0;
+}
+
+// The code and the keys of every syscall the image has.
+static int yarn_checkpointWriteImage(const yarn_state *Y, FILE *fp) {
+  const yarn_image *I = Y->image;
+  uint64_t nkeys = 0;
+  if (I == NULL) {
+    return yarn_write64(fp, 0) != 0 || yarn_write64(fp, 0) != 0 ? -1 : 0;
+  }
+  for (size_t i = 0; i < YARN_SYSCALL_DIRECT; i++) {
+    nkeys += I->direct[i] != NULL;
+  }
+  for (size_t i = 0; i < YARN_MAP_COUNT; i++) {
+    nkeys += I->syscalls[i].val != NULL;
+  }
+  if (yarn_write64(fp, I->codesize) != 0 ||
+      fwrite(I->code, 1, I->codesize, fp) != I->codesize ||
+      yarn_write64(fp, nkeys) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < YARN_SYSCALL_DIRECT; i++) {
+    if (I->direct[i] != NULL && yarn_write64(fp, i) != 0) {
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < YARN_MAP_COUNT; i++) {
+    if (I->syscalls[i].val != NULL && yarn_write64(fp, I->syscalls[i].key) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Memory is written without touching the status, the state isn't running.
+static int yarn_checkpointStore(yarn_state *Y, size_t pos, const void *val,
+                                size_t bsize) {
+  if (Y->paged.table != NULL) {
+    return yarn_pageWrite(Y, pos, val, bsize);
+  }
+  memcpy((char*)Y->memory + pos, val, bsize);
+  return 0;
+}
+
+// Reads the page records of H into buf, growing it. Returns how many there
+// are, or -1 if the record is malformed or cut short.
+static long yarn_checkpointReadPages(FILE *fp, const yarn_checkpointHeader *H,
+                                     uint64_t **index, char **buf) {
+  size_t n = 0, cap = 0;
+  uint64_t npages = (H->memsize + H->pagesize - 1) / H->pagesize;
+  for (;;) {
+    uint64_t i, len;
+    if (yarn_read64(fp, &i) != 0) {
+      return -1;
+    }
+    if (i == YARN_CHECKPOINT_END) {
+      return (long)n;
+    }
+    if (i >= npages) {
+      return -1;
+    }
+    if (n == cap) {
+      uint64_t *ni;
+      char *nb;
+      cap = cap ? cap*2 : 16;
+      ni = realloc(*index, cap * sizeof(uint64_t));
+      if (ni == NULL) {
+        return -1;
+      }
+      *index = ni;
+      nb = realloc(*buf, cap * H->pagesize);
+      if (nb == NULL) {
+        return -1;
+      }
+      *buf = nb;
+    }
+    len = H->memsize - i*H->pagesize < H->pagesize ? H->memsize - i*H->pagesize
+                                                    : H->pagesize;
+    if (fread(*buf + n*H->pagesize, 1, len, fp) != len) {
+      return -1;
+    }
+    (*index)[n++] = i;
+  }
+}
+
+// Stores the pages read by yarn_checkpointReadPages and the rest of H.
+static int yarn_checkpointApply(yarn_state *Y, const yarn_checkpointHeader *H,
+                                const uint64_t *index, const char *buf, long n) {
+  for (long k = 0; k < n; k++) {
+    size_t pos = index[k] * H->pagesize;
+    size_t len = Y->memsize - pos < H->pagesize ? Y->memsize - pos : H->pagesize;
+    if (yarn_checkpointStore(Y, pos, buf + k*H->pagesize, len) != 0) {
+      return -1;
+    }
+  }
+  Y->instructioncount = H->instructioncount;
+  Y->pending = (yarn_uint)H->pending;
+  Y->tokens = (yarn_uint)H->tokens;
+  Y->checkpoint->chain = H->chain;
+  Y->checkpoint->seq = H->seq;
+  return 0;
+}
+
+// A new state from the full record of H, NULL if it's malformed or cut short.
+static yarn_state *yarn_checkpointReadFull(FILE *fp, const yarn_checkpointHeader *H) {
+  yarn_state *Y = H->paged ? yarn_initPaged(H->memsize, H->cap) : yarn_init(H->memsize);
+  uint64_t codesize, nkeys, *index = NULL;
+  char *buf = NULL;
+  long n;
+  if (Y == NULL) {
+    return NULL;
+  }
+  Y->checkpoint = calloc(1, sizeof(struct yarn_checkpoint));
+  if (Y->checkpoint == NULL || yarn_read64(fp, &codesize) != 0 ||
+      codesize > H->memsize) {
+    goto fail;
+  }
+  if (codesize != 0) {
+    char *code = malloc(codesize);
+    if (code == NULL || fread(code, 1, codesize, fp) != codesize) {
+      free(code);
+      goto fail;
+    }
+    if (yarn_setCode(Y, code, codesize, 0) != 0) {
+      goto fail;
+    }
+  }
+  if (yarn_read64(fp, &nkeys) != 0 ||
+      nkeys > YARN_SYSCALL_DIRECT + YARN_MAP_COUNT) {
+    goto fail;
+  }
+  Y->checkpoint->keys = malloc(nkeys ? nkeys * sizeof(yarn_uint) : 1);
+  if (Y->checkpoint->keys == NULL) {
+    goto fail;
+  }
+  for (; Y->checkpoint->nkeys < nkeys; Y->checkpoint->nkeys++) {
+    uint64_t key;
+    if (yarn_read64(fp, &key) != 0) {
+      goto fail;
+    }
+    Y->checkpoint->keys[Y->checkpoint->nkeys] = (yarn_uint)key;
+  }
+  n = yarn_checkpointReadPages(fp, H, &index, &buf);
+  if (n < 0 || yarn_checkpointApply(Y, H, index, buf, n) != 0) {
+    goto fail;
+  }
+  free(index);
+  free(buf);
+  return Y;
+fail:
+  free(index);
+  free(buf);
+  yarn_destroy(Y);
+  return NULL;
+}
+
+// Registers are flushed first, so the checkpoint holds them too. A write that
+// fails leaves the chain broken and the next checkpoint will be full.
+int yarn_saveState(yarn_state *Y, FILE *fp, int delta) {
+  struct yarn_checkpoint *C = Y->checkpoint;
+  int full;
+  yarn_flushRegisters(Y);
+  if (C == NULL) {
+    C = calloc(1, sizeof(struct yarn_checkpoint));
+    if (C == NULL) {
+      return -1;
+    }
+    Y->checkpoint = C;
+  }
+  if (C->pages == NULL &&
+      (C->pages = calloc(yarn_checkpointPages(Y), sizeof(char*))) == NULL) {
+    return -1;
+  }
+  full = !delta || C->chain == 0;
+  if (full) {
+    C->chain = yarn_checkpointChain(Y);
+    C->seq = 0;
+  } else {
+    C->seq++;
+  }
+  if (yarn_checkpointWriteHeader(Y, fp, full ? YARN_CHECKPOINT_FULL
+                                             : YARN_CHECKPOINT_DELTA) != 0 ||
+      (full && yarn_checkpointWriteImage(Y, fp) != 0)) {
+    goto fail;
+  }
+  for (size_t i = 0; i < yarn_checkpointPages(Y); i++) {
+    size_t len;
+    const char *page = yarn_checkpointPage(Y, i, &len);
+    const char *kept = C->pages[i] != NULL ? C->pages[i] : yarn_zeroPage;
+    int changed = page != NULL ? memcmp(page, kept, len) != 0
+                               : C->pages[i] != NULL;
+    // Without a copy the page was zero, and changed says if it still is
+    int write = !full ? changed : page != NULL &&
+                (C->pages[i] == NULL ? changed
+                                     : memcmp(page, yarn_zeroPage, len) != 0);
+    if (write && (yarn_write64(fp, i) != 0 ||
+                  fwrite(page != NULL ? page : yarn_zeroPage, 1, len, fp) != len)) {
+      goto fail;
+    }
+    if (changed && yarn_checkpointKeep(C, i, page, len) != 0) {
+      goto fail;
+    }
+  }
+  if (yarn_write64(fp, YARN_CHECKPOINT_END) != 0 || fflush(fp) != 0) {
+    goto fail;
+  }
+  return 0;
+fail:
+  C->chain = 0;
+  return -1;
+}
+
+// A full record starts over from scratch, so a stream may hold several. The
+// first record that is malformed, cut short or a delta of another chain ends
+// it, leaving the state as of the record before.
+yarn_state *yarn_loadState(FILE *fp) {
+  yarn_state *Y = NULL;
+  for (;;) {
+    yarn_checkpointHeader H;
+    uint64_t *index = NULL;
+    char *buf = NULL;
+    long n;
+    int c = getc(fp);
+    if (c == EOF) {
+      break;
+    }
+    ungetc(c, fp);
+    if (yarn_checkpointReadHeader(fp, &H) != 0) {
+      break;
+    }
+    if (H.kind == YARN_CHECKPOINT_FULL) {
+      yarn_state *N = yarn_checkpointReadFull(fp, &H);
+      if (N == NULL) {
+        break;
+      }
+      if (Y != NULL) {
+        yarn_destroy(Y);
+      }
+      Y = N;
+      continue;
+    }
+    if (Y == NULL || H.kind != YARN_CHECKPOINT_DELTA ||
+        H.chain != Y->checkpoint->chain || H.seq != Y->checkpoint->seq + 1 ||
+        H.memsize != Y->memsize) {
+      break;
+    }
+    // Read in full before applying, a delta cut short mustn't leave half of it
+    n = yarn_checkpointReadPages(fp, &H, &index, &buf);
+    if (n < 0 || yarn_checkpointApply(Y, &H, index, buf, n) != 0) {
+      free(index);
+      free(buf);
+      break;
+    }
+    free(index);
+    free(buf);
+  }
+  if (Y != NULL && yarn_checkpointKeepAll(Y) != 0) {
+    yarn_destroy(Y);
+    return NULL;
+  }
+  return Y;
+}
+
+int yarn_missingSysCalls(yarn_state *Y, yarn_uint *out, int max) {
+  int n = 0;
+  if (Y->checkpoint == NULL || Y->checkpoint->keys == NULL) {
+    return 0;
+  }
+  for (size_t i = 0; i < Y->checkpoint->nkeys; i++) {
+    if (yarn_getSysCall(Y, Y->checkpoint->keys[i]) == NULL) {
+      if (n < max) {
+        out[n] = Y->checkpoint->keys[i];
+      }
+      n++;
+    }
+  }
+  return n;
+}
+
+// Returns the pointer to its memory. Inside a syscall, the host may read the
+// registers through it.
+void *yarn_getMemoryPtr(yarn_state *Y) {
+  yarn_flushRegisters(Y);
+  return Y->paged.table == NULL ? Y->memory : NULL;
+}
+size_t yarn_getMemorySize(yarn_state *Y) {
+  return Y->memsize;
+}
+size_t yarn_getMemoryUsed(yarn_state *Y) {
+  return Y->memsize - Y->base + Y->paged.count * YARN_PAGE_SIZE;
+}
+size_t yarn_getInstructionCount(yarn_state *Y) {
+  return Y->instructioncount;
+}
+
+const char *yarn_registerToString(unsigned char reg) {
+  const char *result;
+  switch(reg) {
+    case YARN_REG_INSTRUCTION: result = "%ins"; break;
+    case YARN_REG_STACK: result = "%stk"; break;
+    case YARN_REG_BASE: result = "%bse"; break;
+    case YARN_REG_RETURN: result = "%ret"; break;
+    case YARN_REG_C1: result = "%C1"; break;
+    case YARN_REG_C2: result = "%C2"; break;
+    case YARN_REG_C3: result = "%C3"; break;
+    case YARN_REG_C4: result = "%C4"; break;
+    case YARN_REG_C5: result = "%C5"; break;
+    case YARN_REG_C6: result = "%C6"; break;
+    case YARN_REG_S1: result = "%S1"; break;
+    case YARN_REG_S2: result = "%S2"; break;
+    case YARN_REG_S3: result = "%S3"; break;
+    case YARN_REG_S4: result = "%S4"; break;
+    case YARN_REG_S5: result = "%S5"; break;
+    case YARN_REG_NULL: result = "%null"; break;
+    default:
+      result = "invalid";
+  }
+  return result;
+}
+
+const char *yarn_statusToString(int status) {
+  const char *result;
+  switch(status) {
+    case YARN_STATUS_OK: result = "ok"; break;
+    case YARN_STATUS_HALT: result = "halt"; break;
+    case YARN_STATUS_PAUSE: result = "paused"; break;
+    case YARN_STATUS_INVALIDMEMORY: result = "invalid memory access error"; break;
+    case YARN_STATUS_INVALIDINSTRUCTION: result = "invalid instruction error"; break;
+    case YARN_STATUS_DIVBYZERO: result = "divide by zero  error"; break;
+    case YARN_STATUS_SUSPENDED: result = "suspended"; break;
+    default:
+      result = "invalid";
+  }
+  return result;
+}
+
+// Shortcuts for register manipulation
+#define registerLocation(r) Y->memsize-(yarn_uint)(r+2)*sizeof(yarn_uint)
+void yarn_getRegister(yarn_state *Y, unsigned char reg, void *val) {
+  yarn_getMemory(Y, registerLocation(reg), val, sizeof(yarn_uint));
+}
+void yarn_setRegister(yarn_state *Y, unsigned char reg, void *val) {
+  yarn_setMemory(Y, registerLocation(reg), val, sizeof(yarn_uint));
+}
+void yarn_incRegister(yarn_state *Y, unsigned char reg, yarn_int val) {
+  yarn_int rval = 0;
+  yarn_getRegister(Y, reg, &rval);
+  rval += val;
+  yarn_setRegister(Y, reg, &rval);
+}
+#undef registerLocation
+
+// Paged memory below base. Pages that were never written read as zero.
+static void yarn_pageRead(const yarn_state *Y, size_t pos, void *val, size_t bsize) {
+  char *out = val;
+  while (bsize > 0) {
+    size_t off = pos & YARN_PAGE_MASK;
+    size_t n = YARN_PAGE_SIZE - off < bsize ? YARN_PAGE_SIZE - off : bsize;
+    const char *page;
+    if (pos >= Y->base) { // The rest is in the flat block
+      memcpy(out, (char*)Y->memory+(pos-Y->base), bsize);
+      return;
+    }
+    page = Y->paged.table[pos >> YARN_PAGE_SHIFT];
+    if (page != NULL) {
+      memcpy(out, page+off, n);
+    } else {
+      memset(out, 0, n);
+    }
+    out += n;
+    pos += n;
+    bsize -= n;
+  }
+}
+// Allocates the pages a write is going to touch first, so it either happens in
+// full or not at all. Returns -1 if that would go over the cap.
+static int yarn_pageWrite(yarn_state *Y, size_t pos, const void *val, size_t bsize) {
+  const char *in = val;
+  if (bsize == 0) {
+    return 0;
+  }
+  for (size_t p = pos >> YARN_PAGE_SHIFT;
+       p <= (pos+bsize-1) >> YARN_PAGE_SHIFT && p < Y->base >> YARN_PAGE_SHIFT;
+       p++) {
+    if (Y->paged.table[p] == NULL) {
+      if (Y->paged.cap && Y->paged.count >= Y->paged.cap) {
+        return -1;
+      }
+      Y->paged.table[p] = calloc(YARN_PAGE_SIZE, 1);
+      if (Y->paged.table[p] == NULL) {
+        return -1;
+      }
+      Y->paged.count++;
+    }
+  }
+  while (bsize > 0) {
+    size_t off = pos & YARN_PAGE_MASK;
+    size_t n = YARN_PAGE_SIZE - off < bsize ? YARN_PAGE_SIZE - off : bsize;
+    if (pos >= Y->base) {
+      memcpy((char*)Y->memory+(pos-Y->base), in, bsize);
+      return 0;
+    }
+    memcpy(Y->paged.table[pos >> YARN_PAGE_SHIFT]+off, in, n);
+    in += n;
+    pos += n;
+    bsize -= n;
+  }
+  return 0;
+}
+
+// Memory manipulations.
+void yarn_getMemory(yarn_state *Y, yarn_uint pos, void *val, size_t bsize) {
+  if (bsize > Y->memsize || pos > Y->memsize-bsize) { // Check for out-of-bounds
+    yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
+    return;
+  }
+  if (Y->cached && (pos+bsize) > Y->memsize-YARN_WINDOWSIZE) {
+    yarn_flushRegisters(Y);
+  }
+  if (Y->paged.table != NULL) {
+    yarn_pageRead(Y, pos, val, bsize);
+    return;
+  }
+  memcpy(val, ((char*)Y->memory)+pos, bsize);
+}
+void yarn_setMemory(yarn_state *Y, yarn_uint pos, void *val, size_t bsize) {
+  if (bsize > Y->memsize || pos > Y->memsize-bsize) { // Check for out-of-bounds
+    yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
+    return;
+  }
+  if (Y->cached && (pos+bsize) > Y->memsize-YARN_WINDOWSIZE) {
+    yarn_flushRegisters(Y);
+  }
+  if (Y->paged.table != NULL) {
+    if (yarn_pageWrite(Y, pos, val, bsize) != 0) {
+      yarn_setStatus(Y, YARN_STATUS_INVALIDMEMORY);
+    }
+    return;
+  }
+  memcpy(((char*)Y->memory)+pos, val,  bsize);
+}
+
+// Pushs the stack
+void yarn_push(yarn_state *Y, yarn_int val) {
+  yarn_uint stk = 0;
+  yarn_incRegister(Y, YARN_REG_STACK, -(int)sizeof(yarn_int));
+  yarn_getRegister(Y, YARN_REG_STACK, &stk);
+  yarn_setMemory(Y, stk, &val, sizeof(val));
+}
+// Pops the stack
+yarn_int yarn_pop(yarn_state *Y) {
+  yarn_uint stk = 0;
+  yarn_int val = 0;
+  yarn_getRegister(Y, YARN_REG_STACK, &stk);
+  yarn_getMemory(Y, stk, &val, sizeof(val));
+  yarn_incRegister(Y, YARN_REG_STACK, (int)sizeof(yarn_int));
+  return val;
+}
+
+// Gets the status of the execution. Status codes are given by YARN_STATUS_
+int yarn_getStatus(yarn_state *Y) {
+  unsigned char val = 0;
+  yarn_getMemory(Y, Y->memsize-sizeof(yarn_int), &val, sizeof(val));
+  return (int)val;
+}
+void yarn_setStatus(yarn_state *Y, unsigned char val) {
+  yarn_setMemory(Y, Y->memsize-sizeof(yarn_int), &val, sizeof(val));
+}
+
+// Gets the specified flag. Currently only used for the conditional flag.
+int yarn_getFlag(yarn_state *Y, int flag) {
+  unsigned char val = 0;
+  yarn_getMemory(Y, Y->memsize-3, &val, sizeof(val));
+  return (val>>flag)&1;
+}
+void yarn_setFlag(yarn_state *Y, int flag) {
+  unsigned char val = 0;
+  yarn_getMemory(Y, Y->memsize-3, &val, sizeof(val));
+  val |= 1 << flag;
+  yarn_setMemory(Y, Y->memsize-3, &val, sizeof(val));
+}
+void yarn_clearFlag(yarn_state *Y, int flag) {
+  unsigned char val = 0;
+  yarn_getMemory(Y, Y->memsize-3, &val, sizeof(val));
+  val &= ~(1 << flag);
+  yarn_setMemory(Y, Y->memsize-3, &val, sizeof(val));
+}
+
+/*
+  System call interface, includes helper functions to manipulate the hashmap
+*/
+
+// Folds in the high half of a YARN_64BIT key, shifted in two steps as a 32
+// bit one would shift out entirely.
+static inline unsigned int hash_uint(yarn_uint n) {
+  return (unsigned int)(n ^ n >> 16 >> 16) * 2654435761u;
+}
+
+// Small keys index the direct table, the rest are probed for in the hash map.
+// A slot keeps its key when its syscall is removed, so probes for the keys
+// placed after it still get past it. Only a slot that was never used (key 0,
+// which is always direct) ends a probe.
+int yarn_imageRegisterSysCall(yarn_image *I, yarn_uint key, yarn_CFunc fun) {
+  unsigned int n = hash_uint(key);
+  if (key < YARN_SYSCALL_DIRECT) {
+    I->direct[key] = fun;
+    return 0;
+  }
+  for (int i = 0; i < YARN_MAP_COUNT; i++, n++) {
+    unsigned idx = n & YARN_MAP_MASK;
+    if (I->syscalls[idx].key == key || I->syscalls[idx].val == NULL) {
+      I->syscalls[idx].key = key;
+      I->syscalls[idx].val = fun;
+      return 0;
+    }
+  }
+  return -1; // Full
+}
+
+// Syscalls live in the image, a state without one gets an empty image to hold
+// them until code is loaded.
+int yarn_registerSysCall(yarn_state *Y, yarn_uint key, yarn_CFunc fun) {
+  if (Y->image == NULL) {
+    yarn_image *I = yarn_imageNew(NULL);
+    if (I == NULL) {
+      return -1;
+    }
+    yarn_attach(Y, I);
+  }
+  return yarn_imageRegisterSysCall(Y->image, key, fun);
+}
+
+yarn_CFunc yarn_getSysCall(yarn_state *Y, yarn_uint key) {
+  unsigned n = hash_uint(key);
+  yarn_image *I = Y->image;
+  if (I == NULL) {
+    return NULL;
+  }
+  if (key < YARN_SYSCALL_DIRECT) {
+    return I->direct[key];
+  }
+  for (int i = 0; i < YARN_MAP_COUNT; i++, n++) {
+    unsigned idx = n & YARN_MAP_MASK;
+    if (I->syscalls[idx].key == key) {
+      return I->syscalls[idx].val;
+    }
+    if (I->syscalls[idx].key == 0) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+void yarn_setUserdata(yarn_state *Y, void *userdata) {
+  Y->userdata = userdata;
+}
+void *yarn_getUserdata(yarn_state *Y) {
+  return Y->userdata;
+}
+
+// Arguments and results of a syscall. Inside one they use the register file
+// directly, outside they go through the register window.
+yarn_uint yarn_argUint(yarn_state *Y, int n) {
+  yarn_uint stk = 0, val = 0;
+  if (Y->cached) {
+    stk = Y->reg[YARN_REG_STACK];
+    size_t pos = (size_t)stk + n*sizeof(yarn_uint);
+    if (Y->paged.table == NULL && pos+sizeof(val) <= Y->memsize-YARN_WINDOWSIZE) {
+      memcpy(&val, (char*)Y->memory+pos, sizeof(val));
+      return val;
+    }
+  } else {
+    yarn_getRegister(Y, YARN_REG_STACK, &stk);
+  }
+  yarn_getMemory(Y, stk + n*sizeof(yarn_uint), &val, sizeof(val));
+  return val;
+}
+yarn_int yarn_argInt(yarn_state *Y, int n) {
+  return (yarn_int)yarn_argUint(Y, n);
+}
+void yarn_returnUint(yarn_state *Y, yarn_uint val) {
+  if (Y->cached) {
+    Y->reg[YARN_REG_RETURN] = val;
+  } else {
+    yarn_setRegister(Y, YARN_REG_RETURN, &val);
+  }
+}
+void yarn_returnInt(yarn_state *Y, yarn_int val) {
+  yarn_returnUint(Y, (yarn_uint)val);
+}
+
+/*
+ *  Asynchronous syscalls. A syscall that has to wait on the host calls
+ *    yarn_suspend and returns, yarn_execute then stops after the syscall
+ *    instruction like it would for a pause, with YARN_STATUS_SUSPENDED. The
+ *    state holds nothing else while it waits, so the host can leave it with
+ *    any number of others until yarn_resume hands it the result. Tokens only
+ *    have to tell the syscalls of one state apart.
+ */
+yarn_uint yarn_suspend(yarn_state *Y) {
+  if (++Y->tokens == 0) { // 0 stands for none
+    Y->tokens = 1;
+  }
+  Y->pending = Y->tokens;
+  if (Y->cached) {
+    Y->status = YARN_STATUS_SUSPENDED;
+  } else {
+    yarn_setStatus(Y, YARN_STATUS_SUSPENDED);
+  }
+  return Y->pending;
+}
+yarn_uint yarn_getSuspended(yarn_state *Y) {
+  return Y->pending;
+}
+int yarn_resume(yarn_state *Y, yarn_uint token, yarn_uint result) {
+  if (token == 0 || token != Y->pending ||
+      yarn_getStatus(Y) != YARN_STATUS_SUSPENDED) {
+    return -1;
+  }
+  Y->pending = 0;
+  yarn_returnUint(Y, result);
+  yarn_setStatus(Y, YARN_STATUS_OK);
+  return 0;
+}
+
+/*
+ *  While yarn_execute runs, the registers, status and flags are kept in a host
+ *    side register file (Y->reg, Y->status, Y->flags) instead of being read
+ *    and written through the memory mapped layout at the top of memory. The
+ *    memory copy is brought up to date on return and whenever the guest
+ *    touches the register window. Syscalls run with the register file still
+ *    current (Y->cached), the public API writes it back the first time it
+ *    reaches into the window, and the interpreter only reads it again after
+ *    a syscall that did. A syscall using yarn_argUint/yarn_returnUint never
+ *    pays for either.
+ */
+#define registerLocation(r) Y->memsize-(yarn_uint)(r+2)*sizeof(yarn_uint)
+
+// Writes the register file back to memory.
+static void yarn_storeRegisters(yarn_state *Y) {
+  char *mem = (char*)Y->memory;
+  for (int r = 0; r < YARN_REG_NUM; r++) {
+    memcpy(mem+registerLocation(r), &Y->reg[r], sizeof(yarn_uint));
+  }
+  mem[Y->memsize-sizeof(yarn_int)] = (char)Y->status;
+  mem[Y->memsize-3] = (char)Y->flags;
+}
+// Reads the register file from memory.
+static void yarn_loadRegisters(yarn_state *Y) {
+  const char *mem = (const char*)Y->memory;
+  for (int r = 0; r < YARN_REG_NUM; r++) {
+    memcpy(&Y->reg[r], mem+registerLocation(r), sizeof(yarn_uint));
+  }
+  Y->status = (unsigned char)mem[Y->memsize-sizeof(yarn_int)];
+  Y->flags = (unsigned char)mem[Y->memsize-3];
+}
+// The same for a paged state, its flat block starts at base.
+static void yarn_storeRegistersPaged(yarn_state *Y) {
+  char *mem = (char*)Y->memory;
+  for (int r = 0; r < YARN_REG_NUM; r++) {
+    memcpy(mem+(registerLocation(r)-Y->base), &Y->reg[r], sizeof(yarn_uint));
+  }
+  mem[Y->memsize-Y->base-sizeof(yarn_int)] = (char)Y->status;
+  mem[Y->memsize-Y->base-3] = (char)Y->flags;
+}
+static void yarn_loadRegistersPaged(yarn_state *Y) {
+  const char *mem = (const char*)Y->memory;
+  for (int r = 0; r < YARN_REG_NUM; r++) {
+    memcpy(&Y->reg[r], mem+(registerLocation(r)-Y->base), sizeof(yarn_uint));
+  }
+  Y->status = (unsigned char)mem[Y->memsize-Y->base-sizeof(yarn_int)];
+  Y->flags = (unsigned char)mem[Y->memsize-Y->base-3];
+}
+#undef registerLocation
+
+// Makes memory the up to date copy of the registers while a syscall runs.
+static void yarn_flushRegisters(yarn_state *Y) {
+  if (Y->cached) {
+    if (Y->paged.table != NULL) {
+      yarn_storeRegistersPaged(Y);
+    } else {
+      yarn_storeRegisters(Y);
+    }
+    Y->cached = 0;
+  }
+}
+
+// Guest memory accesses made by the interpreter. They behave like
+// yarn_getMemory/yarn_setMemory but keep the register file coherent. The
+// bounds check stays in software: guard pages could only trap what lies past
+// memsize, the register window just below it still needs its own compare.
+// Folding the two compares into one, or moving the window handling out of
+// line, both made the switch engine up to 25% slower with GCC. pos is
+// compared against memsize-bsize, pos+bsize could wrap around in a 64-bit
+// build.
+static inline void yarn_load(yarn_state *Y, yarn_uint pos, void *val, size_t bsize) {
+  if (pos > Y->memsize-bsize) {
+    Y->status = YARN_STATUS_INVALIDMEMORY;
+    return;
+  }
+  if ((pos+bsize) > Y->memsize-YARN_WINDOWSIZE) {
+    yarn_storeRegisters(Y);
+  }
+  memcpy(val, ((char*)Y->memory)+pos, bsize);
+}
+static inline void yarn_store(yarn_state *Y, yarn_uint pos, const void *val, size_t bsize) {
+  if (pos > Y->memsize-bsize) {
+    Y->status = YARN_STATUS_INVALIDMEMORY;
+    return;
+  }
+  if ((pos+bsize) > Y->memsize-YARN_WINDOWSIZE) {
+    yarn_storeRegisters(Y);
+    memcpy(((char*)Y->memory)+pos, val, bsize);
+    yarn_loadRegisters(Y);
+    return;
+  }
+  memcpy(((char*)Y->memory)+pos, val, bsize);
+}
+static inline void yarn_pushReg(yarn_state *Y, yarn_uint val) {
+  Y->reg[YARN_REG_STACK] -= sizeof(yarn_int);
+  yarn_store(Y, Y->reg[YARN_REG_STACK], &val, sizeof(val));
+}
+static inline yarn_uint yarn_popReg(yarn_state *Y) {
+  yarn_uint val = 0;
+  yarn_load(Y, Y->reg[YARN_REG_STACK], &val, sizeof(val));
+  Y->reg[YARN_REG_STACK] += sizeof(yarn_int);
+  return val;
+}
+
+// The same for paged memory. The flat block is checked like flat memory, a
+// page that was written is one lookup away, the rest goes the slow way.
+static inline void yarn_loadPaged(yarn_state *Y, yarn_uint pos, void *val, size_t bsize) {
+  const char *page;
+  if (pos >= Y->base) {
+    if (pos > Y->memsize-bsize) {
+      Y->status = YARN_STATUS_INVALIDMEMORY;
+      return;
+    }
+    if ((pos+bsize) > Y->memsize-YARN_WINDOWSIZE) {
+      yarn_storeRegistersPaged(Y);
+    }
+    memcpy(val, ((char*)Y->memory)+(pos-Y->base), bsize);
+    return;
+  }
+  page = Y->paged.table[pos >> YARN_PAGE_SHIFT];
+  if (page != NULL && (pos & YARN_PAGE_MASK) <= YARN_PAGE_SIZE-bsize) {
+    memcpy(val, page+(pos & YARN_PAGE_MASK), bsize);
+    return;
+  }
+  yarn_pageRead(Y, pos, val, bsize);
+}
+static inline void yarn_storePaged(yarn_state *Y, yarn_uint pos, const void *val, size_t bsize) {
+  char *page;
+  if (pos >= Y->base) {
+    if (pos > Y->memsize-bsize) {
+      Y->status = YARN_STATUS_INVALIDMEMORY;
+      return;
+    }
+    if ((pos+bsize) > Y->memsize-YARN_WINDOWSIZE) {
+      yarn_storeRegistersPaged(Y);
+      memcpy(((char*)Y->memory)+(pos-Y->base), val, bsize);
+      yarn_loadRegistersPaged(Y);
+      return;
+    }
+    memcpy(((char*)Y->memory)+(pos-Y->base), val, bsize);
+    return;
+  }
+  page = Y->paged.table[pos >> YARN_PAGE_SHIFT];
+  if (page != NULL && (pos & YARN_PAGE_MASK) <= YARN_PAGE_SIZE-bsize) {
+    memcpy(page+(pos & YARN_PAGE_MASK), val, bsize);
+    return;
+  }
+  if (yarn_pageWrite(Y, pos, val, bsize) != 0) {
+    Y->status = YARN_STATUS_INVALIDMEMORY;
+  }
+}
+static inline void yarn_pushRegPaged(yarn_state *Y, yarn_uint val) {
+  Y->reg[YARN_REG_STACK] -= sizeof(yarn_int);
+  yarn_storePaged(Y, Y->reg[YARN_REG_STACK], &val, sizeof(val));
+}
+static inline yarn_uint yarn_popRegPaged(yarn_state *Y) {
+  yarn_uint val = 0;
+  yarn_loadPaged(Y, Y->reg[YARN_REG_STACK], &val, sizeof(val));
+  Y->reg[YARN_REG_STACK] += sizeof(yarn_int);
   return val;
 }
 
-// Gets the status of the execution. Status codes are given by YARN_STATUS_
-int yarn_getStatus(yarn_state *Y) {
-  unsigned char val;
-  yarn_getMemory(Y, Y->memsize-sizeof(yarn_int), &val, sizeof(val));
-  return (int)val;
+/*
+ *  Profiler. With YARN_OPTION_PROFILE on, yarn_execute runs the hooked
+ *    interpreter (never the JIT), which counts every instruction by ip and by
+ *    opcode. Calls and returns move through a call tree whose nodes count the
+ *    instructions run in them directly. Per function numbers and folded stacks
+ *    are worked out from the tree when asked for. With a sampling period set,
+ *    the host clock is read every period instructions and on every call and
+ *    return, and the time since the last read is charged to the current node.
+ */
+typedef struct yarn_profileNode {
+  yarn_uint entry;          // Address the function was called at, 0 for the root
+  size_t calls;
+  size_t self, total;       // Instructions run here, and here and below
+  uint64_t selfns, totalns; // Same in sampled host nanoseconds
+  struct yarn_profileNode *parent, *child, *sibling;
+} yarn_profileNode;
+
+struct yarn_profile {
+  size_t *hits;             // Per ip, codesize long
+  size_t ops[256];          // Per opcode byte
+  yarn_profileNode root;
+  yarn_profileNode *node;   // The function running now
+  int period, tick;         // Sampling period and instructions since a sample
+  uint64_t last;            // Host time of the last sample
+};
+
+static uint64_t yarn_nanoseconds(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)clock()*(1000000000u/CLOCKS_PER_SEC);
+#endif
+}
+
+static int yarn_profileCreate(yarn_state *Y) {
+  struct yarn_profile *P = calloc(1, sizeof(struct yarn_profile));
+  if (P == NULL) {
+    return -1;
+  }
+  P->hits = calloc(Y->codesize ? Y->codesize : 1, sizeof(size_t));
+  if (P->hits == NULL) {
+    free(P);
+    return -1;
+  }
+  P->root.calls = 1;
+  P->node = &P->root;
+  Y->profile = P;
+  return 0;
+}
+
+static void yarn_profileDestroy(yarn_state *Y) {
+  struct yarn_profile *P = Y->profile;
+  yarn_profileNode *node;
+  if (P == NULL) {
+    return;
+  }
+  // Frees the tree without recursing, it can be as deep as the guest's stack.
+  node = P->root.child;
+  while (node != NULL) {
+    if (node->child != NULL) {
+      node = node->child;
+    } else {
+      yarn_profileNode *parent = node->parent;
+      parent->child = node->sibling;
+      free(node);
+      node = parent == &P->root ? P->root.child : parent;
+    }
+  }
+  free(P->hits);
+  free(P);
+  Y->profile = NULL;
+}
+
+static void yarn_profileSample(struct yarn_profile *P) {
+  uint64_t now = yarn_nanoseconds();
+  P->node->selfns += now - P->last;
+  P->last = now;
+  P->tick = 0;
+}
+
+static inline void yarn_profileFetch(yarn_state *Y, struct yarn_profile *P,
+                                     yarn_uint ip) {
+  P->hits[ip]++;
+  P->ops[(unsigned char)Y->image->code[ip]]++;
+  P->node->self++;
+  if (P->period && ++P->tick >= P->period) {
+    yarn_profileSample(P);
+  }
+}
+
+static void yarn_profileCall(struct yarn_profile *P, yarn_uint target) {
+  yarn_profileNode *node;
+  for (node = P->node->child; node != NULL; node = node->sibling) {
+    if (node->entry == target) {
+      break;
+    }
+  }
+  if (node == NULL) {
+    node = calloc(1, sizeof(yarn_profileNode));
+    if (node == NULL) { // Keep charging the caller
+      return;
+    }
+    node->entry = target;
+    node->parent = P->node;
+    node->sibling = P->node->child;
+    P->node->child = node;
+  }
+  if (P->period) {
+    yarn_profileSample(P);
+  }
+  node->calls++;
+  P->node = node;
+}
+
+static void yarn_profileRet(struct yarn_profile *P) {
+  if (P->node->parent != NULL) {
+    if (P->period) {
+      yarn_profileSample(P);
+    }
+    P->node = P->node->parent;
+  }
+}
+
+size_t yarn_profileHits(yarn_state *Y, yarn_uint ip) {
+  if (Y->profile == NULL || ip >= Y->codesize) {
+    return 0;
+  }
+  return Y->profile->hits[ip];
+}
+size_t yarn_profileOpcodeHits(yarn_state *Y, unsigned char op) {
+  return Y->profile ? Y->profile->ops[op] : 0;
+}
+
+// Walks the call tree depth first without recursing. visit is called when a
+// node is entered (leaving = 0) and once all of its children are done
+// (leaving = 1).
+static void yarn_profileWalk(yarn_profileNode *root,
+    void (*visit)(yarn_profileNode *node, int leaving, void *ctx), void *ctx) {
+  yarn_profileNode *node = root;
+  for (;;) {
+    visit(node, 0, ctx);
+    if (node->child != NULL) {
+      node = node->child;
+      continue;
+    }
+    // Leave the node and every parent it was the last child of.
+    for (;;) {
+      visit(node, 1, ctx);
+      if (node == root) {
+        return;
+      }
+      if (node->sibling != NULL) {
+        node = node->sibling;
+        break;
+      }
+      node = node->parent;
+    }
+  }
+}
+
+typedef struct {
+  yarn_profileFunction *functions;
+  size_t *active;           // Times each function is on the current path
+  int count, capacity;
+  int failed;
+} yarn_profileSummary;
+
+static int yarn_profileFind(yarn_profileSummary *S, yarn_uint entry) {
+  for (int i = 0; i < S->count; i++) {
+    if (S->functions[i].entry == entry) {
+      return i;
+    }
+  }
+  if (S->count == S->capacity) {
+    int capacity = S->capacity ? S->capacity*2 : 16;
+    void *functions = realloc(S->functions, capacity*sizeof(*S->functions));
+    void *active;
+    if (functions == NULL) {
+      return -1;
+    }
+    S->functions = functions;
+    active = realloc(S->active, capacity*sizeof(*S->active));
+    if (active == NULL) {
+      return -1;
+    }
+    S->active = active;
+    S->capacity = capacity;
+  }
+  memset(&S->functions[S->count], 0, sizeof(*S->functions));
+  S->functions[S->count].entry = entry;
+  S->active[S->count] = 0;
+  return S->count++;
+}
+
+// Sums the tree up per function. Recursive calls only count towards the
+// inclusive numbers of the outermost call, so they never exceed the total.
+static void yarn_profileSum(yarn_profileNode *node, int leaving, void *ctx) {
+  yarn_profileSummary *S = ctx;
+  int i = yarn_profileFind(S, node->entry);
+  if (i < 0) {
+    S->failed = 1;
+    return;
+  }
+  if (!leaving) {
+    node->total = 0;
+    node->totalns = 0;
+    S->active[i]++;
+    return;
+  }
+  node->total += node->self;
+  node->totalns += node->selfns;
+  S->functions[i].calls += node->calls;
+  S->functions[i].exclusive += node->self;
+  S->functions[i].exclusivens += node->selfns;
+  if (--S->active[i] == 0) {
+    S->functions[i].inclusive += node->total;
+    S->functions[i].inclusivens += node->totalns;
+  }
+  if (node->parent != NULL) {
+    node->parent->total += node->total;
+    node->parent->totalns += node->totalns;
+  }
+}
+
+int yarn_profileFunctions(yarn_state *Y, yarn_profileFunction *out, int max) {
+  yarn_profileSummary S = { NULL, NULL, 0, 0, 0 };
+  if (Y->profile == NULL) {
+    return -1;
+  }
+  yarn_profileWalk(&Y->profile->root, yarn_profileSum, &S);
+  if (!S.failed && max > 0) {
+    memcpy(out, S.functions, (S.count < max ? S.count : max)*sizeof(*out));
+  }
+  free(S.functions);
+  free(S.active);
+  return S.failed ? -1 : S.count;
+}
+
+typedef struct {
+  FILE *fp;
+  yarn_uint *path;          // Entries from the root down to the current node
+  size_t depth, capacity;
+  int nanoseconds, failed;
+} yarn_profileFolded;
+
+static void yarn_profileFold(yarn_profileNode *node, int leaving, void *ctx) {
+  yarn_profileFolded *F = ctx;
+  uint64_t weight = F->nanoseconds ? node->selfns : node->self;
+  if (F->failed) {
+    return;
+  }
+  if (!leaving) {
+    if (F->depth == F->capacity) {
+      size_t capacity = F->capacity ? F->capacity*2 : 64;
+      void *path = realloc(F->path, capacity*sizeof(*F->path));
+      if (path == NULL) {
+        F->failed = 1;
+        return;
+      }
+      F->path = path;
+      F->capacity = capacity;
+    }
+    F->path[F->depth++] = node->entry;
+    return;
+  }
+  if (weight > 0) {
+    for (size_t i = 0; i < F->depth; i++) {
+      fprintf(F->fp, i ? ";0x%" YARN_PRIX : "0x%" YARN_PRIX, F->path[i]);
+    }
+    fprintf(F->fp, " %llu\n", (unsigned long long)weight);
+  }
+  F->depth--;
+}
+
+int yarn_profileSaveFolded(yarn_state *Y, const char *path, int nanoseconds) {
+  yarn_profileFolded F = { NULL, NULL, 0, 0, nanoseconds, 0 };
+  if (Y->profile == NULL || (F.fp = fopen(path, "w")) == NULL) {
+    return -1;
+  }
+  yarn_profileWalk(&Y->profile->root, yarn_profileFold, &F);
+  free(F.path);
+  if (fclose(F.fp) != 0) {
+    F.failed = 1;
+  }
+  return F.failed ? -1 : 0;
+}
+
+/*
+ *  Tracing. With YARN_OPTION_TRACE on, yarn_execute runs the hooked
+ *    interpreter, which writes a record of every instruction into a ring
+ *    buffer allocated up front. A record is started when its instruction is
+ *    fetched, with the memory address it is about to touch, and finished at
+ *    the next fetch (or when yarn_execute returns) with the value it left in
+ *    its register. Only then does head move past it, so a drain on another
+ *    thread never sees half a record. The running thread only writes head and
+ *    the drain only writes tail, so neither ever waits on the other. When the
+ *    buffer is full new records are dropped and counted, the oldest ones are
+ *    kept until drained.
+ */
+struct yarn_trace {
+  yarn_traceRecord *records;
+  size_t mask;              // Capacity-1, the capacity is a power-of-two
+  yarn_index head, tail;    // Next record to publish and to drain
+  yarn_index dropped;
+  size_t next, tailseen;    // The running thread's copies of head and tail
+  yarn_traceRecord *pending; // Started but not finished, or NULL
+};
+
+static int yarn_traceCreate(yarn_state *Y, int capacity) {
+  struct yarn_trace *T = calloc(1, sizeof(struct yarn_trace));
+  size_t size = 1;
+  if (T == NULL) {
+    return -1;
+  }
+  while (size < (size_t)capacity) {
+    size *= 2;
+  }
+  T->records = malloc(size*sizeof(yarn_traceRecord));
+  if (T->records == NULL) {
+    free(T);
+    return -1;
+  }
+  T->mask = size-1;
+  Y->trace = T;
+  return 0;
+}
+
+static void yarn_traceDestroy(yarn_state *Y) {
+  if (Y->trace != NULL) {
+    free(Y->trace->records);
+    free(Y->trace);
+    Y->trace = NULL;
+  }
+}
+
+static void yarn_traceFinish(yarn_state *Y, struct yarn_trace *T) {
+  yarn_traceRecord *R = T->pending;
+  if (R != NULL) {
+    R->value = R->reg == YARN_REG_NULL ? 0 : Y->reg[R->reg];
+    R->flags = Y->flags;
+    T->pending = NULL;
+    yarn_release(T->head, ++T->next);
+  }
+}
+
+static inline void yarn_traceFetch(yarn_state *Y, struct yarn_trace *T,
+                                   yarn_uint ip, const yarn_inst *in) {
+  yarn_traceRecord *R;
+  yarn_traceFinish(Y, T);
+  if (T->next - T->tailseen > T->mask) {
+    T->tailseen = yarn_acquire(T->tail);
+    if (T->next - T->tailseen > T->mask) {
+      T->dropped++;
+      return;
+    }
+  }
+  R = &T->records[T->next & T->mask];
+  R->ip = ip;
+  R->op = (unsigned char)Y->image->code[ip];
+  R->reg = YARN_REG_NULL;
+  R->access = 0;
+  R->addr = 0;
+  // Superinstructions are split before the hooks run, in->op is a real opcode.
+  switch (in->op) {
+    case YARN_INST_ADD: case YARN_INST_SUB: case YARN_INST_MUL:
+    case YARN_INST_DIV: case YARN_INST_DIVS: case YARN_INST_LSH:
+    case YARN_INST_RSH: case YARN_INST_RSHS: case YARN_INST_AND:
+    case YARN_INST_OR: case YARN_INST_XOR: case YARN_INST_NOT:
+    case YARN_INST_IR: case YARN_INST_RR:
+      R->reg = in->rB;
+      break;
+    case YARN_INST_MR:
+      R->reg = in->rB;
+      R->access = YARN_TRACE_READ;
+      R->addr = (in->rA == YARN_REG_NULL ? 0 : Y->reg[in->rA]) + in->d;
+      break;
+    case YARN_INST_RM:
+      R->access = YARN_TRACE_WRITE;
+      R->addr = Y->reg[in->rB] + in->d;
+      break;
+    case YARN_INST_PUSH: case YARN_INST_CALL:
+      R->reg = YARN_REG_STACK;
+      R->access = YARN_TRACE_WRITE;
+      R->addr = Y->reg[YARN_REG_STACK] - sizeof(yarn_uint);
+      break;
+    case YARN_INST_POP:
+      R->reg = in->rA;
+      R->access = YARN_TRACE_READ;
+      R->addr = Y->reg[YARN_REG_STACK];
+      break;
+    case YARN_INST_RET: // Reads the return address above the d dropped words
+      R->reg = YARN_REG_STACK;
+      R->access = YARN_TRACE_READ;
+      R->addr = Y->reg[YARN_REG_STACK] + in->d*sizeof(yarn_uint);
+      break;
+    case YARN_INST_SYSCALL:
+      R->reg = YARN_REG_RETURN;
+      break;
+  }
+  T->pending = R;
+}
+
+size_t yarn_traceDrain(yarn_state *Y, yarn_traceRecord *out, size_t max) {
+  struct yarn_trace *T = Y->trace;
+  size_t head, tail, n;
+  if (T == NULL) {
+    return 0;
+  }
+  tail = yarn_acquire(T->tail);
+  head = yarn_acquire(T->head);
+  n = head-tail < max ? head-tail : max;
+  for (size_t i = 0; i < n; i++) {
+    out[i] = T->records[(tail+i) & T->mask];
+  }
+  yarn_release(T->tail, tail+n);
+  return n;
+}
+
+size_t yarn_traceDropped(yarn_state *Y) {
+  return Y->trace ? yarn_acquire(Y->trace->dropped) : 0;
+}
+
+// Hooks called by the hooked interpreter.
+static inline void yarn_hookFetch(yarn_state *Y, yarn_uint ip,
+                                  const yarn_inst *in) {
+  if (Y->profile != NULL) {
+    yarn_profileFetch(Y, Y->profile, ip);
+  }
+  if (Y->trace != NULL) {
+    yarn_traceFetch(Y, Y->trace, ip, in);
+  }
+}
+static inline void yarn_hookCall(yarn_state *Y, yarn_uint target) {
+  if (Y->profile != NULL) {
+    yarn_profileCall(Y->profile, target);
+  }
+}
+static inline void yarn_hookRet(yarn_state *Y) {
+  if (Y->profile != NULL) {
+    yarn_profileRet(Y->profile);
+  }
+}
+
+/*
+ *  The interpreter. icount is the maximum number of instructions to execute,
+ *    -1 to indicate indefinite execution. Expects the register file to be
+ *    loaded, will execute until the status is anything but YARN_STATUS_OK.
+ */
+#define arithinst_s_setup() \
+  rB = in->rB; \
+  valB_s = (yarn_int)Y->reg[rB]; \
+  if (in->rA == YARN_REG_NULL) { \
+    valA_s = (yarn_int)in->d; \
+  } else { \
+    valA_s = (yarn_int)Y->reg[in->rA]; \
+  } \
+
+#define arithinst_setup() \
+  rB = in->rB; \
+  valB = Y->reg[rB]; \
+  if (in->rA == YARN_REG_NULL) { \
+    valA = in->d; \
+  } else { \
+    valA = Y->reg[in->rA]; \
+  } \
+
+#define moveinst_setup() \
+  rB = in->rB; \
+  d = in->d; \
+  if (in->rA == YARN_REG_NULL) { \
+    valA = 0; \
+  } else { \
+    valA = Y->reg[in->rA]; \
+  } \
+
+#define stackinst_setup() \
+  rA = in->rA; \
+
+#define branchinst_setup() \
+  d = in->d; \
+
+#define conditionalinst_setup() \
+  valA = Y->reg[in->rA]; \
+  valB = Y->reg[in->rB]; \
+  Y->flags &= ~(1 << YARN_FLAG_CONDITIONAL); \
+
+#define conditionalinst_s_setup() \
+  valA_s = (yarn_int)Y->reg[in->rA]; \
+  valB_s = (yarn_int)Y->reg[in->rB]; \
+  Y->flags &= ~(1 << YARN_FLAG_CONDITIONAL); \
+
+#define setcondition() Y->flags |= 1 << YARN_FLAG_CONDITIONAL
+#define incip(n) Y->reg[YARN_REG_INSTRUCTION] += n
+
+// Superinstructions count the first of their two instructions themselves.
+#define countfused() \
+  Y->instructioncount += 1; \
+  if (icount != -1) { \
+    icount -= 1; \
+  } \
+
+#define fusedcondjump(cond) \
+  if (cond) { \
+    setcondition(); \
+    Y->reg[YARN_REG_INSTRUCTION] = in->d; \
+  } else { \
+    Y->reg[YARN_REG_INSTRUCTION] = Y->decoded[in->next].next; \
+  } \
+  countfused();
+
+// Define YARN_COMPUTED_GOTO to build the threaded dispatch engine. It needs
+// GCC/Clang labels-as-values, other compilers fall back to the portable switch.
+#if defined(YARN_COMPUTED_GOTO) && defined(__GNUC__)
+#define YARN_THREADED
+#endif
+
+// Run from the decoded stream, anything that isn't a known instruction start
+// (e.g. a jump into the middle of one) goes through the decoder. Verified code
+// skips those checks, yarn_verify has made sure ip is always a start. A
+// superinstruction is split back up if only one instruction is left to run, or
+// if the hooks have to see every instruction.
+#ifdef YARN_DEBUG
+#define yarn_fetch_debug() \
+  printf("instruction: 0x%02X icode: 0x%02X\n",in->op,in->op & 0xF0);
+#else
+#define yarn_fetch_debug()
+#endif
+#define yarn_fetch() \
+  ip = Y->reg[YARN_REG_INSTRUCTION]; \
+  if (yarn_verified) { \
+    in = &Y->decoded[ip]; \
+  } else if (ip >= Y->codesize) { \
+    yarn_invalidInstruction(); \
+    break; \
+  } else if (Y->decoded[ip].op != YARN_XINST_UNDECODED) { \
+    in = &Y->decoded[ip]; \
+  } else { \
+    yarn_decode(Y->image, ip, &decoded); \
+    in = &decoded; \
+  } \
+  if (in->op >= YARN_XINST_FUSED && (icount == 1 || yarn_unfuse)) { \
+    decoded = *in; \
+    decoded.op = yarn_unfused[in->op-YARN_XINST_FUSED]; \
+    in = &decoded; \
+  } \
+  yarn_fetch_debug(); \
+  yarn_hook_fetch();
+
+// Each handler ends in its own copy of the dispatch when threaded, so the
+// branch predictor sees one indirect jump per handler instead of one shared.
+#ifdef YARN_THREADED
+#define yarn_handler(op) [op] = &&yarn_handler_##op
+#define yarn_case(op) yarn_handler_##op
+#define yarn_default() yarn_handler_invalid
+#define yarn_next() \
+  Y->instructioncount += 1; \
+  if (icount != -1) { \
+    icount -= 1; \
+  } \
+  if (Y->status != YARN_STATUS_OK || (icount <= 0 && icount != -1)) { \
+    break; \
+  } \
+  yarn_fetch(); \
+  goto *handlers[in->op];
+#else
+#define yarn_case(op) case op
+#define yarn_default() default
+#define yarn_next() break
+#endif
+
+#ifdef YARN_DEBUG
+#define yarn_invalidInstruction() \
+  Y->status = YARN_STATUS_INVALIDINSTRUCTION; \
+  printf("INVALID: %d %%ins: 0x%" YARN_PRIX "\n",__LINE__,ip);
+#else
+#define yarn_invalidInstruction() \
+  Y->status = YARN_STATUS_INVALIDINSTRUCTION;
+#endif
+
+// The interpreter loops are big enough that inlining one into yarn_execute
+// only makes the registers tighter for it, which measurably slows it down.
+#ifdef __GNUC__
+#define YARN_NOINLINE __attribute__((noinline))
+#else
+#define YARN_NOINLINE
+#endif
+
+#define YARN_INTERPRET yarn_interpret
+#include "yarn_interpret.h"
+#define YARN_INTERPRET yarn_interpretHooked
+#define YARN_INTERPRET_HOOKS
+#include "yarn_interpret.h"
+#define YARN_INTERPRET yarn_interpretVerified
+#define YARN_INTERPRET_VERIFIED
+#include "yarn_interpret.h"
+#define YARN_INTERPRET yarn_interpretPaged
+#define YARN_INTERPRET_PAGED
+#include "yarn_interpret.h"
+
+#undef arithinst_setup
+#undef arithinst_s_setup
+#undef moveinst_setup
+#undef stackinst_setup
+#undef branchinst_setup
+#undef conditionalinst_setup
+#undef conditionalinst_s_setup
+#undef setcondition
+#undef incip
+#undef countfused
+#undef fusedcondjump
+#undef yarn_invalidInstruction
+#undef yarn_fetch
+#undef yarn_fetch_debug
+#undef yarn_case
+#undef yarn_default
+#undef yarn_next
+#ifdef YARN_THREADED
+#undef yarn_handler
+#endif
+
+/*
+ *  JIT tier. Compiles basic blocks of decoded instructions into x86-64 code.
+ *    A block works directly on the register file in the state (rdi holds Y)
+ *    and returns the number of guest instructions it executed after storing
+ *    the next %ins. Anything a block can't do on its own (syscalls, control
+ *    instructions, faults, touching the register window, writing %ins) ends
+ *    the block before that instruction, and the interpreter runs it instead.
+ *    Code can't be modified by the guest, so blocks only go away when new
+ *    code is loaded or the buffer fills up.
+ */
+#ifdef YARN_JIT
+
+#ifndef YARN_JIT_SIZE
+#define YARN_JIT_SIZE (256*1024) // Bytes of executable memory per state
+#endif
+#ifndef YARN_JIT_THRESHOLD
+#define YARN_JIT_THRESHOLD 32    // Times a block start is reached before compiling
+#endif
+#define YARN_JIT_MAXBLOCK 64     // Max instructions in a block
+#define YARN_JIT_MAXCODE 64      // Max bytes emitted for one instruction
+#define YARN_JIT_MAXEXIT (YARN_JIT_MAXBLOCK+2)
+
+typedef yarn_uint (*yarn_jitfn)(yarn_state *Y);
+
+struct yarn_jit {
+  unsigned char *buf;       // mmap'd code buffer, mapped on first compile
+  size_t used;              // Bytes of buf handed out
+  struct {
+    yarn_jitfn fn;
+    int len;                // Instructions in the block, -1 if uncompilable
+    int hits;               // Times reached while not compiled
+  } *blocks;                // Indexed by ip
+  size_t nblocks;
+};
+
+typedef struct {
+  unsigned char *p;                                        // Emit position
+  struct { unsigned char *at; yarn_uint ip, count; } exits[YARN_JIT_MAXEXIT];
+  int nexits;
+} yarn_emitter;
+
+#define jit_regoff(r) (offsetof(yarn_state, reg) + (r)*sizeof(yarn_uint))
+#define jit_flagoff() offsetof(yarn_state, flags)
+
+static void jit_byte(yarn_emitter *E, unsigned b) {
+  *E->p++ = (unsigned char)b;
 }
-void yarn_setStatus(yarn_state *Y, unsigned char val) {
-  yarn_setMemory(Y, Y->memsize-sizeof(yarn_int), &val, sizeof(val));
+static void jit_u32(yarn_emitter *E, yarn_uint v) {
+  memcpy(E->p, &v, sizeof(v));
+  E->p += sizeof(v);
 }
-
-// Gets the specified flag. Currently only used for the conditional flag.
-int yarn_getFlag(yarn_state *Y, int flag) {
-  unsigned char val;
-  yarn_getMemory(Y, Y->memsize-3, &val, sizeof(val));
-  return (val>>flag)&1;
+// <op> reg, [rdi+disp32]
+static void jit_rdi(yarn_emitter *E, unsigned op, unsigned reg, size_t disp) {
+  jit_byte(E, op);
+  jit_byte(E, 0x80 | (reg<<3) | 7);
+  jit_u32(E, (yarn_uint)disp);
 }
-void yarn_setFlag(yarn_state *Y, int flag) {
-  unsigned char val;
-  yarn_getMemory(Y, Y->memsize-3, &val, sizeof(val));
-  val |= 1 << flag;
-  yarn_setMemory(Y, Y->memsize-3, &val, sizeof(val));
+// Conditional jump to a stub that leaves the block at ip having run count
+// instructions. Stubs are emitted after the block body.
+static void jit_exit(yarn_emitter *E, unsigned cc, yarn_uint ip, yarn_uint count) {
+  jit_byte(E, 0x0F);
+  jit_byte(E, cc);
+  E->exits[E->nexits].at = E->p;
+  E->exits[E->nexits].ip = ip;
+  E->exits[E->nexits].count = count;
+  E->nexits++;
+  jit_u32(E, 0);
 }
-void yarn_clearFlag(yarn_state *Y, int flag) {
-  unsigned char val;
-  yarn_getMemory(Y, Y->memsize-3, &val, sizeof(val));
-  val &= ~(1 << flag);
-  yarn_setMemory(Y, Y->memsize-3, &val, sizeof(val));
+// Leaves the block at ip, having run count instructions.
+static void jit_leave(yarn_emitter *E, yarn_uint ip, yarn_uint count) {
+  jit_rdi(E, 0xC7, 0, jit_regoff(YARN_REG_INSTRUCTION)); // mov dword [ins], ip
+  jit_u32(E, ip);
+  jit_byte(E, 0xB8); // mov eax, count
+  jit_u32(E, count);
+  jit_byte(E, 0xC3); // ret
 }
-
-/*
-  System call interface, includes helper functions to manipulate the hashmap
-*/
-
-static inline unsigned int hash_uint(unsigned int n) {
-  return n * 2654435761;
+// eax = value of rA, or imm if rA is the null register.
+static void jit_operand(yarn_emitter *E, unsigned char rA, yarn_uint imm) {
+  if (rA == YARN_REG_NULL) {
+    jit_byte(E, 0xB8);
+    jit_u32(E, imm);
+  } else {
+    jit_rdi(E, 0x8B, 0, jit_regoff(rA));
+  }
+}
+// Side exits unless rax is a 4 byte guest address below the register window.
+static void jit_checkaddr(yarn_emitter *E, yarn_uint ip, yarn_uint count) {
+  jit_byte(E, 0x4C); jit_byte(E, 0x39); jit_byte(E, 0xC0); // cmp rax, r8
+  jit_exit(E, 0x87, ip, count);                            // ja exit
 }
 
-void yarn_registerSysCall(yarn_state *Y, yarn_uint key, yarn_CFunc fun) {
-  unsigned int n = hash_uint(key);
-  for (;;) {
-    unsigned idx = n & YARN_MAP_MASK;
-    if (Y->syscalls[idx].key == key || Y->syscalls[idx].val == NULL) {
-      Y->syscalls[idx].key = key;
-      Y->syscalls[idx].val = fun;
-      break;
-    }
-    n++;
+// Does the instruction read or write %ins? Blocks don't keep %ins up to date.
+static int jit_readsip(const yarn_inst *in) {
+  switch (in->op & 0xF0) {
+    case YARN_ICODE_ARITH:
+    case YARN_ICODE_CONDITIONAL:
+      return in->rA == YARN_REG_INSTRUCTION || in->rB == YARN_REG_INSTRUCTION;
+    case YARN_ICODE_MOVE:
+      return in->rA == YARN_REG_INSTRUCTION ||
+             (in->op == YARN_INST_RM && in->rB == YARN_REG_INSTRUCTION);
+    case YARN_ICODE_STACK:
+      return in->op == YARN_INST_PUSH && in->rA == YARN_REG_INSTRUCTION;
   }
+  return 0;
 }
-
-yarn_CFunc yarn_getSysCall(yarn_state *Y, yarn_uint key) {
-  unsigned n = hash_uint(key);
-  for (;;) {
-    unsigned idx = n & YARN_MAP_MASK;
-    if (Y->syscalls[idx].val == NULL) {
-      return NULL;
-    }
-    if (Y->syscalls[idx].key == key) {
-      return Y->syscalls[idx].val;
-    }
-    n++;
+static int jit_writesip(const yarn_inst *in) {
+  switch (in->op & 0xF0) {
+    case YARN_ICODE_ARITH:
+      return in->rB == YARN_REG_INSTRUCTION;
+    case YARN_ICODE_MOVE:
+      return in->op != YARN_INST_RM && in->rB == YARN_REG_INSTRUCTION;
+    case YARN_ICODE_STACK:
+      return in->op == YARN_INST_POP && in->rA == YARN_REG_INSTRUCTION;
   }
+  return 0;
 }
 
-/*
- *  External function to execute the program. icount is the maximum number of
- *    instructions to execute. Use -1 to indicate indefinite execution. Will
- *    execute until program sets status to anything but YARN_STATUS_OK,
- */
-#define arithinst_s_setup() \
-  yarn_validInstruction(5);\
-  rA = (Y->code[ip+1] & 0xF0)>>4; \
-  rB = Y->code[ip+1] & 0x0F; \
-  d_s = *((yarn_int *) &Y->code[ip+2]); \
-  yarn_getRegister(Y, rB, &valB_s); \
-  if (rA == YARN_REG_NULL) { \
-    valA_s = d_s; \
-  } else { \
-    yarn_getRegister(Y, rA, &valA_s); \
-  } \
+// Emits instruction number k of the block. Returns 1 if it ended the block,
+// 0 if the block continues and -1 if the instruction has to be interpreted.
+static int jit_instruction(yarn_emitter *E, const yarn_inst *in, yarn_uint ip, yarn_uint k) {
+  static const unsigned char arithops[] = {
+    [YARN_INST_ADD-YARN_ICODE_ARITH] = 0x01, [YARN_INST_SUB-YARN_ICODE_ARITH] = 0x29,
+    [YARN_INST_AND-YARN_ICODE_ARITH] = 0x21, [YARN_INST_OR-YARN_ICODE_ARITH] = 0x09,
+    [YARN_INST_XOR-YARN_ICODE_ARITH] = 0x31,
+  };
+  static const unsigned char shiftops[] = {
+    [YARN_INST_LSH-YARN_INST_LSH] = 4, [YARN_INST_RSH-YARN_INST_LSH] = 5,
+    [YARN_INST_RSHS-YARN_INST_LSH] = 7,
+  };
+  static const unsigned char setcc[] = {
+    [YARN_INST_LT-YARN_ICODE_CONDITIONAL] = 0x92, [YARN_INST_LTS-YARN_ICODE_CONDITIONAL] = 0x9C,
+    [YARN_INST_LTE-YARN_ICODE_CONDITIONAL] = 0x96, [YARN_INST_LTES-YARN_ICODE_CONDITIONAL] = 0x9E,
+    [YARN_INST_EQ-YARN_ICODE_CONDITIONAL] = 0x94, [YARN_INST_NEQ-YARN_ICODE_CONDITIONAL] = 0x95,
+  };
 
-#define arithinst_setup() \
-  yarn_validInstruction(5);\
-  rA = (Y->code[ip+1] & 0xF0)>>4; \
-  rB = Y->code[ip+1] & 0x0F; \
-  d = *((yarn_uint *) &Y->code[ip+2]); \
-  yarn_getRegister(Y, rB, &valB); \
-  if (rA == YARN_REG_NULL) { \
-    valA = d; \
-  } else { \
-    yarn_getRegister(Y, rA, &valA); \
-  } \
+  if (jit_writesip(in)) {
+    return -1;
+  }
+  if (jit_readsip(in)) {
+    jit_rdi(E, 0xC7, 0, jit_regoff(YARN_REG_INSTRUCTION)); // mov dword [ins], ip
+    jit_u32(E, ip);
+  }
+  switch (in->op) {
+    case YARN_INST_ADD: case YARN_INST_SUB: case YARN_INST_AND:
+    case YARN_INST_OR: case YARN_INST_XOR:
+      jit_operand(E, in->rA, in->d);
+      jit_rdi(E, arithops[in->op-YARN_ICODE_ARITH], 0, jit_regoff(in->rB)); // op [rB], eax
+      return 0;
+    case YARN_INST_MUL:
+      jit_operand(E, in->rA, in->d);
+      jit_rdi(E, 0x8B, 1, jit_regoff(in->rB));              // mov ecx, [rB]
+      jit_byte(E, 0x0F); jit_byte(E, 0xAF); jit_byte(E, 0xC8); // imul ecx, eax
+      jit_rdi(E, 0x89, 1, jit_regoff(in->rB));              // mov [rB], ecx
+      return 0;
+    case YARN_INST_DIV:
+    case YARN_INST_DIVS:
+      jit_operand(E, in->rA, in->d);
+      jit_byte(E, 0x85); jit_byte(E, 0xC0);                 // test eax, eax
+      jit_exit(E, 0x84, ip, k);                             // jz exit
+      jit_byte(E, 0x89); jit_byte(E, 0xC1);                 // mov ecx, eax
+      if (in->op == YARN_INST_DIVS) {
+        jit_byte(E, 0x83); jit_byte(E, 0xF9); jit_byte(E, 0xFF); // cmp ecx, -1
+        jit_exit(E, 0x84, ip, k);                           // je exit
+      }
+      jit_rdi(E, 0x8B, 0, jit_regoff(in->rB));              // mov eax, [rB]
+      if (in->op == YARN_INST_DIVS) {
+        jit_byte(E, 0x99);                                  // cdq
+        jit_byte(E, 0xF7); jit_byte(E, 0xF9);               // idiv ecx
+      } else {
+        jit_byte(E, 0x31); jit_byte(E, 0xD2);               // xor edx, edx
+        jit_byte(E, 0xF7); jit_byte(E, 0xF1);               // div ecx
+      }
+      jit_rdi(E, 0x89, 0, jit_regoff(in->rB));              // mov [rB], eax
+      return 0;
+    case YARN_INST_LSH: case YARN_INST_RSH: case YARN_INST_RSHS:
+      jit_operand(E, in->rA, in->d);
+      jit_byte(E, 0x3D); jit_u32(E, 8*sizeof(yarn_uint));   // cmp eax, 32
+      jit_exit(E, 0x83, ip, k);                             // jae exit
+      jit_byte(E, 0x89); jit_byte(E, 0xC1);                 // mov ecx, eax
+      jit_rdi(E, 0xD3, shiftops[in->op-YARN_INST_LSH], jit_regoff(in->rB)); // shift [rB], cl
+      return 0;
+    case YARN_INST_NOT:
+      jit_operand(E, in->rA, in->d);
+      jit_byte(E, 0xF7); jit_byte(E, 0xD0);                 // not eax
+      jit_rdi(E, 0x89, 0, jit_regoff(in->rB));              // mov [rB], eax
+      return 0;
 
-#define moveinst_setup() \
-  yarn_validInstruction(5);\
-  rA = (Y->code[ip+1] & 0xF0)>>4; \
-  rB = Y->code[ip+1] & 0x0F; \
-  d = *((yarn_int *) &Y->code[ip+2]); \
-  if (rA == YARN_REG_NULL) { \
-    valA = 0; \
-  } else { \
-    yarn_getRegister(Y, rA, &valA); \
-  } \
+    case YARN_INST_IR:
+    case YARN_INST_RR:
+      jit_operand(E, in->rA, 0);
+      if (in->op == YARN_INST_IR) {
+        jit_byte(E, 0x05); jit_u32(E, in->d);               // add eax, d
+      }
+      jit_rdi(E, 0x89, 0, jit_regoff(in->rB));              // mov [rB], eax
+      return 0;
+    case YARN_INST_MR:
+      jit_operand(E, in->rA, 0);
+      jit_byte(E, 0x05); jit_u32(E, in->d);                 // add eax, d
+      jit_checkaddr(E, ip, k);
+      jit_byte(E, 0x8B); jit_byte(E, 0x0C); jit_byte(E, 0x06); // mov ecx, [rsi+rax]
+      jit_rdi(E, 0x89, 1, jit_regoff(in->rB));              // mov [rB], ecx
+      return 0;
+    case YARN_INST_RM:
+      jit_operand(E, in->rA, 0);
+      jit_byte(E, 0x89); jit_byte(E, 0xC1);                 // mov ecx, eax
+      jit_rdi(E, 0x8B, 0, jit_regoff(in->rB));              // mov eax, [rB]
+      jit_byte(E, 0x05); jit_u32(E, in->d);                 // add eax, d
+      jit_checkaddr(E, ip, k);
+      jit_byte(E, 0x89); jit_byte(E, 0x0C); jit_byte(E, 0x06); // mov [rsi+rax], ecx
+      return 0;
 
-#define stackinst_setup() \
-  yarn_validInstruction(1);\
-  rA = (Y->code[ip+1] & 0xF0)>>4; \
+    case YARN_INST_PUSH:
+    case YARN_INST_CALL:
+      if (in->op == YARN_INST_PUSH) {
+        jit_rdi(E, 0x8B, 1, jit_regoff(in->rA));            // mov ecx, [rA]
+      } else {
+        jit_byte(E, 0xB9); jit_u32(E, in->next);            // mov ecx, next
+      }
+      jit_rdi(E, 0x8B, 0, jit_regoff(YARN_REG_STACK));      // mov eax, [stk]
+      jit_byte(E, 0x2D); jit_u32(E, sizeof(yarn_int));      // sub eax, 4
+      jit_checkaddr(E, ip, k);
+      jit_rdi(E, 0x89, 0, jit_regoff(YARN_REG_STACK));      // mov [stk], eax
+      jit_byte(E, 0x89); jit_byte(E, 0x0C); jit_byte(E, 0x06); // mov [rsi+rax], ecx
+      if (in->op == YARN_INST_CALL) {
+        jit_leave(E, in->d, k+1);
+        return 1;
+      }
+      return 0;
+    case YARN_INST_POP:
+    case YARN_INST_RET:
+      if (in->op == YARN_INST_RET && in->d != 0) {
+        return -1;
+      }
+      jit_rdi(E, 0x8B, 0, jit_regoff(YARN_REG_STACK));      // mov eax, [stk]
+      jit_checkaddr(E, ip, k);
+      jit_byte(E, 0x8B); jit_byte(E, 0x0C); jit_byte(E, 0x06); // mov ecx, [rsi+rax]
+      jit_byte(E, 0x05); jit_u32(E, sizeof(yarn_int));      // add eax, 4
+      jit_rdi(E, 0x89, 0, jit_regoff(YARN_REG_STACK));      // mov [stk], eax
+      if (in->op == YARN_INST_POP) {
+        jit_rdi(E, 0x89, 1, jit_regoff(in->rA));            // mov [rA], ecx
+        return 0;
+      }
+      jit_rdi(E, 0x89, 1, jit_regoff(YARN_REG_INSTRUCTION)); // mov [ins], ecx
+      jit_byte(E, 0xB8); jit_u32(E, k+1);                   // mov eax, count
+      jit_byte(E, 0xC3);                                    // ret
+      return 1;
 
-#define branchinst_setup() \
-  yarn_validInstruction(4); \
-  d = *((yarn_int *) &Y->code[ip+1]); \
+    case YARN_INST_JUMP:
+      jit_leave(E, in->d, k+1);
+      return 1;
+    case YARN_INST_CONDJUMP:
+      jit_byte(E, 0xF6); jit_byte(E, 0x87);                 // test byte [flags], 1
+      jit_u32(E, (yarn_uint)jit_flagoff());
+      jit_byte(E, 1 << YARN_FLAG_CONDITIONAL);
+      jit_exit(E, 0x85, in->d, k+1);                        // jnz taken
+      jit_leave(E, in->next, k+1);
+      return 1;
 
-#define conditionalinst_setup() \
-  yarn_validInstruction(1);\
-  rA = (Y->code[ip+1] & 0xF0)>>4; \
-  rB = Y->code[ip+1] & 0x0F; \
-  yarn_getRegister(Y, rA, &valA); \
-  yarn_getRegister(Y, rB, &valB); \
-  yarn_clearFlag(Y, YARN_FLAG_CONDITIONAL); \
+    case YARN_INST_LT: case YARN_INST_LTS: case YARN_INST_LTE:
+    case YARN_INST_LTES: case YARN_INST_EQ: case YARN_INST_NEQ:
+      jit_rdi(E, 0x8B, 0, jit_regoff(in->rA));              // mov eax, [rA]
+      jit_rdi(E, 0x3B, 0, jit_regoff(in->rB));              // cmp eax, [rB]
+      jit_byte(E, 0x0F); jit_byte(E, setcc[in->op-YARN_ICODE_CONDITIONAL]);
+      jit_byte(E, 0xC1);                                    // setcc cl
+      jit_rdi(E, 0x80, 4, jit_flagoff());                   // and byte [flags], ~1
+      jit_byte(E, (unsigned char)~(1 << YARN_FLAG_CONDITIONAL));
+      jit_rdi(E, 0x08, 1, jit_flagoff());                   // or byte [flags], cl
+      return 0;
+  }
+  return -1;
+}
 
-#define conditionalinst_s_setup() \
-  yarn_validInstruction(1);\
-  rA = (Y->code[ip+1] & 0xF0)>>4; \
-  rB = Y->code[ip+1] & 0x0F; \
-  yarn_getRegister(Y, rA, &valA_s); \
-  yarn_getRegister(Y, rB, &valB_s); \
-  yarn_clearFlag(Y, YARN_FLAG_CONDITIONAL); \
+// Frees all compiled blocks.
+static void yarn_jitFlush(yarn_state *Y) {
+  struct yarn_jit *J = Y->jit;
+  J->used = 0;
+  if (J->blocks) {
+    memset(J->blocks, 0, J->nblocks*sizeof(*J->blocks));
+  }
+}
+// Forgets everything about the loaded code.
+static void yarn_jitReset(yarn_state *Y) {
+  free(Y->jit->blocks);
+  Y->jit->blocks = NULL;
+  Y->jit->nblocks = 0;
+  Y->jit->used = 0;
+}
 
-#ifdef YARN_DEBUG
-#define yarn_validInstruction(o) if (ip+o >= Y->codesize) { \
-  yarn_setStatus(Y,YARN_STATUS_INVALIDINSTRUCTION); \
-  printf("INVALID: %d %%ins: 0x%X\n",__LINE__,ip); \
-  break; \
+static void yarn_jitDestroy(yarn_state *Y) {
+  if (Y->jit == NULL) {
+    return;
+  }
+  if (Y->jit->buf) {
+    munmap(Y->jit->buf, YARN_JIT_SIZE);
+  }
+  free(Y->jit->blocks);
+  free(Y->jit);
+  Y->jit = NULL;
 }
-#else
-#define yarn_validInstruction(o) if (ip+o >= Y->codesize) { \
-  yarn_setStatus(Y,YARN_STATUS_INVALIDINSTRUCTION); \
-  break; \
+
+static int yarn_jitCreate(yarn_state *Y) {
+  struct yarn_jit *J = calloc(1, sizeof(struct yarn_jit));
+  if (J == NULL) {
+    return -1;
+  }
+  Y->jit = J;
+  return 0;
 }
-#endif
 
-int yarn_execute(yarn_state *Y, int icount) {
-  yarn_uint ip;
-  int instruction;
+// Compiles the block starting at ip, returns 0 on success.
+static int yarn_jitCompile(yarn_state *Y, yarn_uint ip) {
+  struct yarn_jit *J = Y->jit;
+  yarn_emitter E;
+  yarn_uint k, start = ip;
+  unsigned char *entry;
+  int ended = 0;
 
-  while (yarn_getStatus(Y) == YARN_STATUS_OK && (icount > 0 || icount == -1)) {
-    yarn_getRegister(Y, YARN_REG_INSTRUCTION, &ip);
-    yarn_validInstruction(0);
+  if (J->buf == NULL) {
+    void *buf = mmap(NULL, YARN_JIT_SIZE, PROT_READ | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      return -1;
+    }
+    J->buf = buf;
+  }
+  if (YARN_JIT_SIZE - J->used < (YARN_JIT_MAXBLOCK+YARN_JIT_MAXEXIT)*YARN_JIT_MAXCODE) {
+    yarn_jitFlush(Y);
+  }
+  if (mprotect(J->buf, YARN_JIT_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    return -1;
+  }
+  entry = E.p = J->buf + J->used;
+  E.nexits = 0;
 
-    unsigned char rA, rB;
-    yarn_uint valA, valB, valM, d;
-    yarn_int valA_s, valB_s, d_s;
+  jit_byte(&E, 0x48); jit_byte(&E, 0x8B); jit_byte(&E, 0xB7); // mov rsi, [memory]
+  jit_u32(&E, (yarn_uint)offsetof(yarn_state, memory));
+  jit_byte(&E, 0x4C); jit_byte(&E, 0x8B); jit_byte(&E, 0x87); // mov r8, [memsize]
+  jit_u32(&E, (yarn_uint)offsetof(yarn_state, memsize));
+  jit_byte(&E, 0x49); jit_byte(&E, 0x83); jit_byte(&E, 0xE8); // sub r8, window+4
+  jit_byte(&E, YARN_WINDOWSIZE+sizeof(yarn_uint));
 
-    instruction = Y->code[ip];
-    #if YARN_DEBUG
-    printf("instruction: 0x%02X icode: 0x%02X\n",instruction,instruction & 0xF0);
-    #endif
+  for (k = 0; k < YARN_JIT_MAXBLOCK && ip < Y->codesize && !ended; k++) {
+    const yarn_inst *in = &Y->decoded[ip];
+    yarn_emitter save = E;
+    yarn_inst unfused;
+    if (in->op == YARN_XINST_UNDECODED || in->op == YARN_XINST_INVALID) {
+      break;
+    }
+    if (in->op >= YARN_XINST_FUSED) { // Blocks already avoid the dispatch
+      unfused = *in;
+      unfused.op = yarn_unfused[in->op-YARN_XINST_FUSED];
+      in = &unfused;
+    }
+    ended = jit_instruction(&E, in, ip, k);
+    if (ended < 0) {
+      E = save;
+      ended = 0;
+      break;
+    }
+    ip = in->next;
+  }
+  if (k == 0) {
+    mprotect(J->buf, YARN_JIT_SIZE, PROT_READ | PROT_EXEC);
+    return -1;
+  }
+  if (!ended) {
+    jit_leave(&E, ip, k);
+  }
+  for (int i = 0; i < E.nexits; i++) {
+    int32_t rel = (int32_t)(E.p - (E.exits[i].at + 4));
+    memcpy(E.exits[i].at, &rel, sizeof(rel));
+    jit_leave(&E, E.exits[i].ip, E.exits[i].count);
+  }
 
-    // Here we execute the specified function for the icode and increment the
-    // instruction register.
-    switch(instruction) {
-      //   Control
-      case YARN_INST_HALT:
-        yarn_setStatus(Y,YARN_STATUS_HALT);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 1);
-        break;
-      case YARN_INST_PAUSE:
-        yarn_setStatus(Y,YARN_STATUS_PAUSE);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 1);
-        break;
-      case YARN_INST_NOP:
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 1);
-        break;
+  J->used = (size_t)(E.p - J->buf + 15) & ~(size_t)15;
+  if (mprotect(J->buf, YARN_JIT_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    return -1;
+  }
+  __builtin___clear_cache((char *)entry, (char *)E.p);
+  J->blocks[start].fn = (yarn_jitfn)(uintptr_t)entry;
+  J->blocks[start].len = (int)k;
+  return 0;
+}
 
-      //   Arith:
-      case YARN_INST_ADD:
-        arithinst_setup();
-        valB += valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_SUB:
-        arithinst_setup();
-        valB -= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_MUL:
-        arithinst_setup();
-        valB *= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_DIV:
-        arithinst_setup();
-        if (valA == 0) {
-          yarn_setStatus(Y, YARN_STATUS_DIVBYZERO);
-        } else {
-          valB /= valA;
-          yarn_setRegister(Y, rB, &valB);
-        }
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_DIVS:
-        arithinst_s_setup();
-        if (valA_s == 0) {
-          yarn_setStatus(Y, YARN_STATUS_DIVBYZERO);
-        } else {
-          valB_s /= valA_s;
-          yarn_setRegister(Y, rB, &valB_s);
-        }
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_LSH:
-        arithinst_setup();
-        valB <<= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_RSH:
-        arithinst_setup();
-        valB >>= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_RSHS:
-        arithinst_s_setup();
-        valB_s >>= valA_s;
-        yarn_setRegister(Y, rB, &valB_s);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_AND:
-        arithinst_setup();
-        valB &= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_OR:
-        arithinst_setup();
-        valB |= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_XOR:
-        arithinst_setup();
-        valB ^= valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_NOT:
-        arithinst_setup();
-        valB = ~valA;
-        yarn_setRegister(Y, rB, &valB);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
+// Runs icount instructions, compiled where possible. Same contract as
+// yarn_interpret.
+static int yarn_jitRun(yarn_state *Y, int icount) {
+  struct yarn_jit *J = Y->jit;
 
-      //   Move:
-      case YARN_INST_IR:
-        moveinst_setup();
-        valA += d;
-        yarn_setRegister(Y, rB, &valA);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_MR:
-        moveinst_setup();
-        yarn_getMemory(Y,d+valA, &valM, sizeof(valM));
-        yarn_setRegister(Y,rB,&valM);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_RR:
-        moveinst_setup();
-        yarn_setRegister(Y,rB,&valA); // Do we want to use d?
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
-      case YARN_INST_RM:
-        moveinst_setup();
-        yarn_getRegister(Y, rB, &valB);
-        yarn_setMemory(Y, valB+d, &valA, sizeof(valA));
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 6);
-        break;
+  if (J->blocks == NULL) {
+    J->nblocks = Y->codesize;
+    J->blocks = calloc(J->nblocks ? J->nblocks : 1, sizeof(*J->blocks));
+    if (J->blocks == NULL) {
+      J->nblocks = 0;
+      return yarn_interpret(Y, icount);
+    }
+  }
+  while (Y->status == YARN_STATUS_OK && (icount > 0 || icount == -1)) {
+    yarn_uint ip = Y->reg[YARN_REG_INSTRUCTION];
+    yarn_uint n = 0;
 
-      //   Stack:
-      case YARN_INST_PUSH:
-        stackinst_setup();
-        yarn_getRegister(Y, rA, &valA);
-        yarn_push(Y, valA);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      case YARN_INST_POP:
-        stackinst_setup();
-        valA = yarn_pop(Y);
-        yarn_setRegister(Y, rA, &valA);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
+    if (ip < Y->codesize && J->blocks[ip].fn == NULL && J->blocks[ip].len == 0 &&
+        ++J->blocks[ip].hits >= YARN_JIT_THRESHOLD && yarn_jitCompile(Y, ip) != 0) {
+      J->blocks[ip].len = -1;
+    }
+    // Only enter a block if the budget covers all of it, so preemption
+    // happens on exactly the same instruction as with the interpreter.
+    if (ip < Y->codesize && J->blocks[ip].fn != NULL &&
+        (icount == -1 || icount >= J->blocks[ip].len)) {
+      n = J->blocks[ip].fn(Y);
+      Y->instructioncount += n;
+      if (icount != -1) {
+        icount -= (int)n;
+      }
+    }
+    if (n == 0) {
+      yarn_interpret(Y, 1);
+      if (icount != -1) {
+        icount -= 1;
+      }
+    }
+  }
+  return Y->status;
+}
 
-      //   Branches:
-      case YARN_INST_CALL:
-        branchinst_setup();
-        yarn_push(Y, ip+5);
-        yarn_setRegister(Y, YARN_REG_INSTRUCTION, &d);
-        break;
-      case YARN_INST_RET:
-        branchinst_setup();
-        for(yarn_uint i=0; i<d; i++) {
-          yarn_pop(Y);
-        }
-        valA = yarn_pop(Y);
-        yarn_setRegister(Y, YARN_REG_INSTRUCTION, &valA);
-        break;
-      case YARN_INST_JUMP:
-        branchinst_setup();
-        yarn_setRegister(Y, YARN_REG_INSTRUCTION, &d);
-        break;
-      case YARN_INST_CONDJUMP:
-        branchinst_setup();
-        if (yarn_getFlag(Y, YARN_FLAG_CONDITIONAL)) {
-          yarn_setRegister(Y, YARN_REG_INSTRUCTION, &d);
-        } else {
-          yarn_incRegister(Y, YARN_REG_INSTRUCTION, 5);
-        }
-        break;
-      case YARN_INST_SYSCALL:
-        branchinst_setup();
-        yarn_CFunc fun = yarn_getSysCall(Y, (yarn_uint)d);
-        if (fun == NULL) {
-          yarn_setStatus(Y, YARN_STATUS_INVALIDINSTRUCTION);
-        } else {
-          (*fun)(Y);
-        }
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 5);
-        break;
+#undef jit_regoff
+#undef jit_flagoff
+#endif
 
-      //   Conditionals:
-      case YARN_INST_LT:
-        conditionalinst_setup();
-        if (valA < valB) yarn_setFlag(Y, YARN_FLAG_CONDITIONAL);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      case YARN_INST_LTS:
-        conditionalinst_s_setup();
-        if (valA_s < valB_s) yarn_setFlag(Y, YARN_FLAG_CONDITIONAL);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      case YARN_INST_LTE:
-        conditionalinst_setup();
-        if (valA <= valB) yarn_setFlag(Y, YARN_FLAG_CONDITIONAL);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      case YARN_INST_LTES:
-        conditionalinst_s_setup();
-        if (valA_s <= valB_s) yarn_setFlag(Y, YARN_FLAG_CONDITIONAL);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      case YARN_INST_EQ:
-        conditionalinst_setup();
-        if (valA == valB) yarn_setFlag(Y, YARN_FLAG_CONDITIONAL);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      case YARN_INST_NEQ:
-        conditionalinst_setup();
-        if (valA != valB) yarn_setFlag(Y, YARN_FLAG_CONDITIONAL);
-        yarn_incRegister(Y, YARN_REG_INSTRUCTION, 2);
-        break;
-      default:
-        yarn_setStatus(Y,YARN_STATUS_INVALIDINSTRUCTION);
-        break;
+/*
+ *  Calls into the guest. yarn_call pushes the arguments and a return address
+ *    no code can have, and runs from addr. The ret that pops that address
+ *    leaves ip outside the code, which stops the run with
+ *    YARN_STATUS_INVALIDINSTRUCTION. If the stack is then back where the
+ *    address was pushed, the function returned. Everything happens in the
+ *    register file, so a call allocates nothing and moves the registers
+ *    between memory and the register file once each way.
+ */
+#define YARN_CALL_RETURN ((yarn_uint)-1)
+
+static void yarn_callPush(yarn_state *Y, yarn_uint val) {
+  if (Y->paged.table != NULL) {
+    yarn_pushRegPaged(Y, val);
+  } else {
+    yarn_pushReg(Y, val);
+  }
+}
+
+int yarn_call(yarn_state *Y, yarn_uint addr, const yarn_uint *args, int nargs,
+              yarn_uint *result) {
+  yarn_uint ins, stk, bse, top;
+  unsigned char status;
+  int outer = Y->cached; // Called from a syscall, which keeps running after
+  if (!Y->cached) {
+    if (Y->paged.table != NULL) {
+      yarn_loadRegistersPaged(Y);
+    } else {
+      yarn_loadRegisters(Y);
+    }
+    Y->cached = 1;
+  }
+  ins = Y->reg[YARN_REG_INSTRUCTION];
+  stk = Y->reg[YARN_REG_STACK];
+  bse = Y->reg[YARN_REG_BASE];
+  status = Y->status;
+  Y->status = YARN_STATUS_OK;
+  for (int i = nargs-1; i >= 0; i--) {
+    yarn_callPush(Y, args[i]);
+  }
+  top = Y->reg[YARN_REG_STACK];
+  yarn_callPush(Y, YARN_CALL_RETURN);
+  if (Y->status == YARN_STATUS_OK) {
+    Y->reg[YARN_REG_INSTRUCTION] = addr;
+    if (Y->profile) {
+      yarn_profileCall(Y->profile, addr);
+    }
+    yarn_execute(Y, -1);
+    Y->cached = 1; // Written back, but still current
+    if (Y->status == YARN_STATUS_INVALIDINSTRUCTION &&
+        Y->reg[YARN_REG_INSTRUCTION] == YARN_CALL_RETURN &&
+        Y->reg[YARN_REG_STACK] == top) {
+      if (result != NULL) {
+        *result = Y->reg[YARN_REG_RETURN];
+      }
+      Y->reg[YARN_REG_INSTRUCTION] = ins;
+      Y->reg[YARN_REG_STACK] = stk;
+      Y->reg[YARN_REG_BASE] = bse;
+      Y->status = status;
+      if (!outer) {
+        yarn_flushRegisters(Y);
+      }
+      return YARN_STATUS_OK;
     }
+  }
+  status = Y->status;
+  if (!outer) {
+    yarn_flushRegisters(Y);
+  }
+  return status;
+}
 
-    // Check and make sure we haven't run out of instructions to use.
-    Y->instructioncount += 1;
+/*
+ *  External function to execute the program. icount is the maximum number of
+ *    instructions to execute. Use -1 to indicate indefinite execution. Will
+ *    execute until program sets status to anything but YARN_STATUS_OK,
+ */
+int yarn_execute(yarn_state *Y, int icount) {
+  if (!Y->cached) { // Run from a syscall, it's newer than memory already
+    if (Y->paged.table != NULL) {
+      yarn_loadRegistersPaged(Y);
+    } else {
+      yarn_loadRegisters(Y);
+    }
+    Y->cached = 1;
+  }
+  if (Y->profile || Y->trace) {
+    // Only time spent in here is charged to the guest.
+    if (Y->profile) {
+      Y->profile->last = yarn_nanoseconds();
+    }
+    yarn_interpretHooked(Y, icount);
+    if (Y->profile && Y->profile->period) {
+      yarn_profileSample(Y->profile);
+    }
+    if (Y->trace) { // The host may change registers before the next fetch
+      yarn_traceFinish(Y, Y->trace);
+    }
+  } else
+#ifdef YARN_JIT
+  if (Y->jit) {
+    yarn_jitRun(Y, icount);
+  } else
+#endif
+  if (Y->paged.table != NULL) {
+    yarn_interpretPaged(Y, icount);
+  } else if (Y->verified) {
+    // Returns early if ip leaves the verified code, the checked interpreter
+    // runs the rest.
+    size_t start = Y->instructioncount;
+    yarn_interpretVerified(Y, icount);
     if (icount != -1) {
-      icount -= 1;
+      icount -= (int)(Y->instructioncount - start);
     }
+    yarn_interpret(Y, icount);
+  } else {
+    yarn_interpret(Y, icount);
   }
-  return yarn_getStatus(Y);
+  yarn_flushRegisters(Y);
+  return Y->status;
 }
 
-#undef arithinst_setup
-#undef arithinst_s_setup
-#undef moveinst_setup
-#undef stackinst_setup
-#undef branchinst_setup
-#undef conditionalinst_setup
-#undef conditionalinst_s_setup
-#undef yarn_validInstruction
+// Turns optional features of a state on or off. Returns 0 on success, -1 if
+// the option isn't available in this build or couldn't be set up.
+int yarn_setOption(yarn_state *Y, int option, int value) {
+  switch (option) {
+    case YARN_OPTION_JIT:
+#ifdef YARN_JIT
+      if (value && Y->jit == NULL) {
+        if (Y->paged.table != NULL) { // Compiled code addresses memory directly
+          return -1;
+        }
+        return yarn_jitCreate(Y);
+      } else if (!value) {
+        yarn_jitDestroy(Y);
+      }
+      return 0;
+#else
+      (void)Y;
+      return value ? -1 : 0;
+#endif
+    case YARN_OPTION_PROFILE:
+      yarn_profileDestroy(Y);
+      return value ? yarn_profileCreate(Y) : 0;
+    case YARN_OPTION_PROFILESAMPLE:
+      if (Y->profile == NULL || value < 0) {
+        return -1;
+      }
+      Y->profile->period = value;
+      return 0;
+    case YARN_OPTION_TRACE:
+      if (value < 0) {
+        return -1;
+      }
+      yarn_traceDestroy(Y);
+      return value ? yarn_traceCreate(Y, value) : 0;
+  }
+  return -1;
+}
 
 #ifdef YARN_STANDALONE
+#include "yarn_asm.h"
 /*
  * Command line program.
  *   Usage: ./bin/yarn code.o
+ *   A source ending in .asm is assembled with yarn_assemble and run instead.
  *   Flags:
  *     -m<file> - Dumps the memory state to a file. Ex: -mmemdump.mem
  *     -c<icount> - Limits execution to icount instructions. Ex: -c20
+ *     -j - Enables the JIT.
+ *     -p<file> - Profiles the program, writing its call stacks in the folded
+ *                format of flamegraph.pl. Ex: -pyarn.folded
+ *     -n<period> - With -p, samples the host clock every period instructions
+ *                  and weights the stacks by time instead. Ex: -n1000
+ *     -t<file> - Writes a record of every instruction run to a file, see
+ *                tools/trace.py to read it. Ex: -tyarn.trace
+ *     -s<file> - Appends a checkpoint to a file every time execution stops,
+ *                the first one full and deltas after it. Ex: -syarn.ckpt
+ *     -r - Resumes from the checkpoints in the file given instead of code.
+ *          Ex: ./bin/yarn yarn.ckpt -r -syarn.ckpt
+ *     -l<file> - Links a relocatable object after the one given, which has to
+ *                be relocatable too. Ex: ./bin/yarn main.yo -llib.yo
  */
+// Relocatable objects of either width start with it, plain code can't.
+#define CLI_OBJECT_MAGIC "yarnob"
+#define CLI_OBJECT_MAX 64
+// Trace files are the magic followed by the raw yarn_traceRecords, which are
+// wider in a YARN_64BIT build.
+#ifdef YARN_64BIT
+#define CLI_TRACE_MAGIC "yarntr64"
+#else
+#define CLI_TRACE_MAGIC "yarntrc1"
+#endif
+#define CLI_TRACE_SIZE 65536
 inline static void printProgramStatus(yarn_state *Y) {
   printf("Register contents:\n");
-  yarn_uint rval;
+  yarn_uint rval = 0;
   for (int r=0; r < 16; r++) {
     yarn_getRegister(Y, r, &rval);
-    printf("\tReg: %-5s = 0x%08X   %d\n",yarn_registerToString(r), rval, rval);
+    printf("\tReg: %-5s = 0x%0*" YARN_PRIX "   %" YARN_PRId "\n",
+           yarn_registerToString(r), YARN_WORDSIZE*2, rval, (yarn_int)rval);
   }
 
   printf("Status: %s\n",yarn_statusToString(yarn_getStatus(Y)));
   printf("Instructions executed: %zu\n",yarn_getInstructionCount(Y));
 
 }
+static int isObject(const char *path) {
+  char magic[8];
+  FILE *fp = fopen(path, "rb");
+  int object = fp != NULL && fread(magic, 1, 8, fp) == 8 &&
+               memcmp(magic, CLI_OBJECT_MAGIC, 6) == 0;
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  return object;
+}
+// Assembles the source at path into the code of Y.
+static int loadSource(yarn_state *Y, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  char *source = NULL, *code, *err;
+  long size = -1;
+  size_t codesize;
+  int result = -1;
+  if (fp != NULL && fseek(fp, 0L, SEEK_END) == 0) {
+    size = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+  }
+  if (size >= 0) {
+    source = malloc(size ? (size_t)size : 1);
+  }
+  if (source == NULL || fread(source, 1, (size_t)size, fp) != (size_t)size) {
+    printf("Unable to read %s\n", path);
+  } else if (yarn_assemble(source, (size_t)size, &code, &codesize, &err) != 0) {
+    printf("%s, %s\n", path, err);
+    free(err);
+  } else {
+    result = yarn_loadCode(Y, code, codesize);
+    free(code);
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  free(source);
+  return result;
+}
+// Links the object files at paths into the code of Y.
+static int loadObjects(yarn_state *Y, char **paths, int n) {
+  yarn_object *objects[CLI_OBJECT_MAX];
+  yarn_image *I = NULL;
+  int loaded = 0;
+  for (; loaded < n; loaded++) {
+    objects[loaded] = yarn_objectInitFile(paths[loaded]);
+    if (objects[loaded] == NULL) {
+      printf("Invalid relocatable object: %s\n", paths[loaded]);
+      break;
+    }
+  }
+  if (loaded == n) {
+    I = yarn_imageLink(objects, n);
+    if (I == NULL) {
+      printf("Unable to link, a symbol is missing or defined twice.\n");
+    } else {
+      yarn_loadImage(Y, I);
+      yarn_imageRelease(I);
+    }
+  }
+  while (loaded-- > 0) {
+    yarn_objectRelease(objects[loaded]);
+  }
+  return I != NULL ? 0 : -1;
+}
+inline static void printProfile(yarn_state *Y) {
+  int count = yarn_profileFunctions(Y, NULL, 0);
+  yarn_profileFunction *functions =
+      malloc((count > 0 ? count : 1)*sizeof(yarn_profileFunction));
+  if (count < 0 || functions == NULL) {
+    free(functions);
+    return;
+  }
+  yarn_profileFunctions(Y, functions, count);
+  printf("Functions:\n");
+  printf("\t%-10s %10s %14s %14s %12s %12s\n", "Address", "Calls", "Inclusive",
+         "Exclusive", "Incl. us", "Excl. us");
+  for (int i = 0; i < count; i++) {
+    printf("\t0x%08" YARN_PRIX " %10zu %14zu %14zu %12.1f %12.1f\n",
+           functions[i].entry, functions[i].calls, functions[i].inclusive,
+           functions[i].exclusive, functions[i].inclusivens/1e3,
+           functions[i].exclusivens/1e3);
+  }
+  free(functions);
+}
+// Runs in steps the trace buffer can hold, so no records are dropped.
+static int executeTraced(yarn_state *Y, int icount, FILE *fp) {
+  static yarn_traceRecord records[CLI_TRACE_SIZE];
+  int status = YARN_STATUS_OK;
+  while (status == YARN_STATUS_OK && icount != 0) {
+    int step = icount == -1 || icount > CLI_TRACE_SIZE ? CLI_TRACE_SIZE : icount;
+    status = yarn_execute(Y, step);
+    fwrite(records, sizeof(yarn_traceRecord),
+           yarn_traceDrain(Y, records, CLI_TRACE_SIZE), fp);
+    if (icount != -1) {
+      icount -= step;
+    }
+  }
+  return status;
+}
 int main(int argc, char **argv) {
   FILE *fp;
-  size_t fsize;
   yarn_state *Y;
-  char *buffer;
   char *memoryfile = NULL;
+  char *profilefile = NULL;
+  char *tracefile = NULL;
+  FILE *tracefp = NULL;
+  char *checkpointfile = NULL;
+  FILE *checkpointfp = NULL;
+  int resume = 0;
+  char *objects[CLI_OBJECT_MAX];
+  int nobjects = 1;
+  int period = 0;
   int icount = -1;
+  int jit = 0;
   int status = YARN_STATUS_OK;
 
   if (argc <= 1) {
@@ -614,39 +3626,98 @@ int main(int argc, char **argv) {
       memoryfile = argv[i]+2;
     } else if (strncmp("-c", argv[i], strlen("-c")) == 0) {
       icount = atoi(argv[i]+2);
+    } else if (strcmp("-j", argv[i]) == 0) {
+      jit = 1;
+    } else if (strncmp("-p", argv[i], strlen("-p")) == 0) {
+      profilefile = argv[i]+2;
+    } else if (strncmp("-n", argv[i], strlen("-n")) == 0) {
+      period = atoi(argv[i]+2);
+    } else if (strncmp("-t", argv[i], strlen("-t")) == 0) {
+      tracefile = argv[i]+2;
+    } else if (strncmp("-s", argv[i], strlen("-s")) == 0) {
+      checkpointfile = argv[i]+2;
+    } else if (strcmp("-r", argv[i]) == 0) {
+      resume = 1;
+    } else if (strncmp("-l", argv[i], strlen("-l")) == 0 &&
+               nobjects < CLI_OBJECT_MAX) {
+      objects[nobjects++] = argv[i]+2;
     }
   }
+  objects[0] = argv[1];
 
-  fp = fopen(argv[1], "r");
-  if (!fp) {
-    printf("Invalid object file.\n");
-    return EXIT_FAILURE;
+  if (resume) {
+    yarn_uint missing;
+    fp = fopen(argv[1], "rb");
+    Y = fp != NULL ? yarn_loadState(fp) : NULL;
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    if (Y == NULL) {
+      printf("Invalid checkpoint file.\n");
+      return EXIT_FAILURE;
+    }
+    if (yarn_missingSysCalls(Y, &missing, 1) > 0) {
+      printf("Checkpoint uses syscalls that are missing, like 0x%" YARN_PRIX
+             ".\n", missing);
+    }
+  } else {
+    Y = yarn_init(256*sizeof(yarn_int));
+    if (Y == NULL) {
+      printf("Unable to create Yarn state.\n");
+      return EXIT_FAILURE;
+    }
+    if (isObject(argv[1])) {
+      if (loadObjects(Y, objects, nobjects) != 0) {
+        return EXIT_FAILURE;
+      }
+    } else if (nobjects > 1) {
+      printf("Only relocatable objects can be linked.\n");
+      return EXIT_FAILURE;
+    } else if (strlen(argv[1]) > 4 &&
+               strcmp(argv[1] + strlen(argv[1]) - 4, ".asm") == 0) {
+      if (loadSource(Y, argv[1]) != 0) {
+        return EXIT_FAILURE;
+      }
+    } else if (yarn_loadCodeMapped(Y, argv[1]) != 0) {
+      printf("Invalid object file.\n");
+      return EXIT_FAILURE;
+    }
   }
-  fseek(fp, 0L, SEEK_END);
-  fsize = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
-
-  buffer = malloc(sizeof(char)*fsize);
-  if (buffer == NULL) {
-    printf("Unable to load object file.\n");
-    return EXIT_FAILURE;
+  if (checkpointfile != NULL) {
+    checkpointfp = fopen(checkpointfile, "ab");
+    if (!checkpointfp) {
+      printf("Invalid checkpoint name.\n");
+      return EXIT_FAILURE;
+    }
   }
-  fread(buffer,1,fsize,fp);
-  fclose(fp);
-
-  Y = yarn_init(256*sizeof(yarn_int));
-  if (Y == NULL) {
-    printf("Unable to create Yarn state.\n");
-    return EXIT_FAILURE;
+  if (jit && yarn_setOption(Y, YARN_OPTION_JIT, 1) != 0) {
+    printf("JIT is not available, interpreting.\n");
   }
-  if (yarn_loadCode(Y,buffer,fsize) != 0) {
-    printf("Unable to load Yarn object code.\n");
+  if (profilefile != NULL && (yarn_setOption(Y, YARN_OPTION_PROFILE, 1) != 0 ||
+      yarn_setOption(Y, YARN_OPTION_PROFILESAMPLE, period) != 0)) {
+    printf("Unable to profile.\n");
     return EXIT_FAILURE;
   }
+  if (tracefile != NULL) {
+    tracefp = fopen(tracefile, "wb");
+    if (!tracefp || yarn_setOption(Y, YARN_OPTION_TRACE, CLI_TRACE_SIZE) != 0) {
+      printf("Unable to trace.\n");
+      return EXIT_FAILURE;
+    }
+    fwrite(CLI_TRACE_MAGIC, 1, 8, tracefp);
+  }
 
   while (status == YARN_STATUS_OK) {
-    status = yarn_execute(Y, icount);
+    if (tracefp != NULL) {
+      status = executeTraced(Y, icount, tracefp);
+    } else {
+      status = yarn_execute(Y, icount);
+    }
     printProgramStatus(Y);
+    if (checkpointfp != NULL && yarn_saveState(Y, checkpointfp, 1) != 0) {
+      printf("Unable to write checkpoint.\n");
+      return EXIT_FAILURE;
+    }
     if (status == YARN_STATUS_PAUSE) {
       printf("Program paused, hit enter to continue.");
       getchar();
@@ -666,9 +3737,27 @@ int main(int argc, char **argv) {
     fclose(fp);
     printf("Wrote memory dump: %s\n",memoryfile);
   }
+  if (profilefile != NULL) {
+    printProfile(Y);
+    if (yarn_profileSaveFolded(Y, profilefile, period > 0) != 0) {
+      printf("Invalid profile name.\n");
+      return EXIT_FAILURE;
+    }
+    printf("Wrote profile: %s\n",profilefile);
+  }
+  if (tracefp != NULL) {
+    if (fclose(tracefp) != 0) {
+      printf("Invalid trace name.\n");
+      return EXIT_FAILURE;
+    }
+    printf("Wrote trace: %s\n",tracefile);
+  }
+  if (checkpointfp != NULL) {
+    fclose(checkpointfp);
+    printf("Wrote checkpoints: %s\n",checkpointfile);
+  }
 
   yarn_destroy(Y);
-  free(buffer);
   return 0;
 }
 #endif
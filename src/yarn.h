@@ -15,11 +15,27 @@
 //   instructions it should execute. -1 will execute forever. This is useful if
 //   you want to embed yarn elsewhere and don't want it to dominate your program.
 //
+//   To run many copies of one program, load it once into an image and attach
+//   the image to every state. The code, its decoded form and the syscalls are
+//   then shared, each state only has its own memory:
+//     I = yarn_imageInit(buffer,bufsize);
+//     Y = yarn_init(256*sizeof(yarn_int));
+//     yarn_loadImage(Y,I);
+//     yarn_imageRelease(I); // The states keep their own references
+//
 // Extending:
-//   Currently there is no API for extending it with "system calls", however this
-//   is planned for the future.
+//   The guest calls into the host with `syscall <key>`. Register a yarn_CFunc
+//   for the key, it gets its arguments with yarn_argUint/yarn_argInt, leaves
+//   its result with yarn_returnUint/yarn_returnInt, and can reach host data
+//   through the state's userdata:
+//     static void add(yarn_state *Y) {
+//       yarn_returnInt(Y, yarn_argInt(Y, 0) + yarn_argInt(Y, 1));
+//     }
+//     yarn_registerSysCall(Y, 0x10, add);
 
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #ifndef YARN_H_
@@ -28,21 +44,65 @@
 #define YARN_VERSION "0.0.1"
 
 typedef struct yarn_state yarn_state;
+typedef struct yarn_image yarn_image;
+typedef struct yarn_snap yarn_snap;
+typedef struct yarn_object yarn_object;
+// Registers, stack slots and immediates are 32 bits wide, or 64 bits in a
+// build with -DYARN_64BIT. Code assembled for one width doesn't run on the
+// other, since the immediates in it are YARN_WORDSIZE bytes.
+#ifdef YARN_64BIT
+typedef int64_t yarn_int;
+typedef uint64_t yarn_uint;
+#define YARN_PRId PRId64
+#define YARN_PRIX PRIX64
+#else
 typedef int32_t yarn_int;
 typedef uint32_t yarn_uint;
+#define YARN_PRId PRId32
+#define YARN_PRIX PRIX32
+#endif
+#define YARN_WORDSIZE ((int)sizeof(yarn_uint))
 typedef void (*yarn_CFunc)(yarn_state *Y);
 
 // Create the yarn state, returns NULL on failure
 yarn_state *yarn_init(size_t memsize);
+// Creates a state whose memory is allocated page by page as the guest writes
+// it, so a large and mostly unused address space only costs what is touched.
+// Untouched memory reads as zero. A write that needs more than cap bytes of
+// pages (0 for no limit) fails with YARN_STATUS_INVALIDMEMORY. The stack and
+// registers at the top stay in one flat block that is always allocated. Paged
+// states have no memory pointer and can't use the JIT. Returns NULL on failure.
+yarn_state *yarn_initPaged(size_t memsize, size_t cap);
 // Destroys the yarn state.
 void yarn_destroy(yarn_state *Y);
-// Loads the object code, returns 0 on success, -1 on failure.
+// Loads and pre-decodes the object code, returns 0 on success, -1 on failure.
 int yarn_loadCode(yarn_state *Y, char *code, size_t codesize);
+// Loads the object file at path without copying it. It's mapped read-only and
+// shared where mmap is available, so processes running the same file share its
+// pages. The file must not change while it's loaded. Returns 0 or -1.
+int yarn_loadCodeMapped(yarn_state *Y, const char *path);
+// Runs the state from a shared image, see yarn_imageInit. Returns 0.
+int yarn_loadImage(yarn_state *Y, yarn_image *I);
+yarn_image *yarn_getImage(yarn_state *Y);
 // Executes icount instructions (-1 for the whole program). Returns the status.
 int yarn_execute(yarn_state *Y, int icount);
+// Calls the guest function at addr with nargs arguments, pushed like a call
+// instruction would (args[0] last), and runs until it returns. Its %ret goes
+// into result (may be NULL), and %ins, %stk, %bse and the status are put back
+// as they were, so a halted program can serve as a library of handlers. Safe
+// to call from a syscall. Returns YARN_STATUS_OK once the function returned,
+// otherwise the status it stopped with (a halt, pause, suspension or fault),
+// leaving the state where it stopped.
+int yarn_call(yarn_state *Y, yarn_uint addr, const yarn_uint *args, int nargs,
+              yarn_uint *result);
+// Turns a YARN_OPTION_ on or off. Returns 0 on success, -1 if unavailable.
+int yarn_setOption(yarn_state *Y, int option, int value);
 
+// NULL for a paged state, use yarn_getMemory/yarn_setMemory instead.
 void *yarn_getMemoryPtr(yarn_state *Y);
 size_t yarn_getMemorySize(yarn_state *Y);
+// Bytes of guest memory allocated, memsize unless the state is paged.
+size_t yarn_getMemoryUsed(yarn_state *Y);
 size_t yarn_getInstructionCount(yarn_state *Y);
 
 const char *yarn_registerToString(unsigned char reg);
@@ -65,8 +125,128 @@ int yarn_getFlag(yarn_state *Y, int flag);
 void yarn_setFlag(yarn_state *Y, int flag);
 void yarn_clearFlag(yarn_state *Y, int flag);
 
-void yarn_registerSysCall(yarn_state *Y, yarn_uint key, yarn_CFunc fun);
+// Syscalls are bound in the state's image, registering one on a state that
+// shares its image registers it for every state sharing it. Keys below
+// YARN_SYSCALL_DIRECT (64) are found fastest. Registering NULL removes a
+// syscall. Returns 0, or -1 if there is no room for another key.
+int yarn_registerSysCall(yarn_state *Y, yarn_uint key, yarn_CFunc fun);
 yarn_CFunc yarn_getSysCall(yarn_state *Y, yarn_uint key);
+// A pointer for the host to find its own data from a syscall. Forks inherit it.
+void yarn_setUserdata(yarn_state *Y, void *userdata);
+void *yarn_getUserdata(yarn_state *Y);
+// Argument n of a syscall, 0 being the last one the guest pushed, and its
+// result in %ret. Inside a syscall these use the registers directly, where
+// yarn_getRegister/yarn_setRegister first write them all back to memory.
+yarn_uint yarn_argUint(yarn_state *Y, int n);
+yarn_int yarn_argInt(yarn_state *Y, int n);
+void yarn_returnUint(yarn_state *Y, yarn_uint val);
+void yarn_returnInt(yarn_state *Y, yarn_int val);
+// Asynchronous syscalls. A syscall that can't finish right away calls
+// yarn_suspend and returns, yarn_execute then returns YARN_STATUS_SUSPENDED
+// with the state just past the syscall. The host finishes the work whenever
+// it can, on any thread once yarn_execute returned, and yarn_resume puts the
+// result in %ret and makes the state runnable again. yarn_suspend returns the
+// token to resume with, never 0.
+yarn_uint yarn_suspend(yarn_state *Y);
+// The token the state is suspended on, 0 if it isn't.
+yarn_uint yarn_getSuspended(yarn_state *Y);
+// Returns 0, or -1 if the state isn't suspended on token.
+int yarn_resume(yarn_state *Y, yarn_uint token, yarn_uint result);
+
+// Copies and pre-decodes the object code into a read-only image holding one
+// reference, returns NULL on failure.
+yarn_image *yarn_imageInit(char *code, size_t codesize);
+// Same, but from the object file at path mapped like yarn_loadCodeMapped.
+yarn_image *yarn_imageInitMapped(const char *path);
+// Images are reference counted, they are freed when the last reference is
+// released. Safe to use from several threads when built as C11.
+void yarn_imageRetain(yarn_image *I);
+void yarn_imageRelease(yarn_image *I);
+// Binds a syscall for every state using the image. Do this before the image is
+// shared with running states. Returns 0 or -1 like yarn_registerSysCall.
+int yarn_imageRegisterSysCall(yarn_image *I, yarn_uint key, yarn_CFunc fun);
+
+// Relocatable objects, written by `tools/assemble.py -c`. An object is parsed
+// and checked once and can then be linked into any number of images, so a
+// library is prepared once for every program using it. Returns NULL if the
+// object is malformed.
+yarn_object *yarn_objectInit(const char *data, size_t size);
+yarn_object *yarn_objectInitFile(const char *path);
+void yarn_objectRelease(yarn_object *O);
+// Links the objects into a new image holding one reference, the first one at
+// address 0 and the rest after it in order. Every import binds to the object
+// exporting that name. Returns NULL if one isn't exported or a name is
+// exported twice.
+yarn_image *yarn_imageLink(yarn_object *const *objects, int n);
+// Address of a symbol a linked image exports, for yarn_call. Returns 0, or -1
+// if there is none by that name.
+int yarn_imageSymbol(yarn_image *I, const char *name, yarn_uint *addr);
+int yarn_getSymbol(yarn_state *Y, const char *name, yarn_uint *addr);
+
+// Captures the memory (registers, status and flags included), the instruction
+// count and the image of a state that isn't executing. Returns NULL on failure.
+yarn_snap *yarn_snapshot(yarn_state *Y);
+// Forks are independent of the snapshot and may outlive it.
+void yarn_snapshotRelease(yarn_snap *S);
+// Creates a state that continues from the snapshot. Its memory is shared with
+// the snapshot copy-on-write page by page where mmap is available, so a fork
+// costs next to nothing until the guest writes. Returns NULL on failure.
+yarn_state *yarn_fork(yarn_snap *S);
+
+// Checkpoints, a versioned binary stream of a state's code, memory (registers,
+// status and flags included), instruction count and suspended syscall, which
+// outlives the process. yarn_saveState appends one to fp. With delta set it
+// only holds the pages that changed since the state's last checkpoint, fp has
+// to continue the stream that one went to. The first checkpoint of a state is
+// always full. From then on the state keeps a copy of its pages that aren't
+// zero to find the changed ones. Returns 0 or -1.
+int yarn_saveState(yarn_state *Y, FILE *fp, int delta);
+// Reads a stream into a new state, as of the last record that was written in
+// full. It can be saved to again with deltas that continue the stream. Options,
+// userdata and the exports of linked code aren't saved, nor syscalls, which are
+// host functions: the state has the default ones. Returns NULL on failure.
+yarn_state *yarn_loadState(FILE *fp);
+// Fills out with up to max keys of syscalls the checkpointed state had that Y
+// has not, returns how many there are. Register those before running it.
+int yarn_missingSysCalls(yarn_state *Y, yarn_uint *out, int max);
+
+// Profiling, see YARN_OPTION_PROFILE. Everything is counted since the option
+// was turned on or code was last loaded.
+typedef struct {
+  yarn_uint entry;          // Address of the function, 0 for the program itself
+  size_t calls;
+  // Instructions run in the function and its callees, and in it alone. A
+  // recursive function's inclusive count only includes its outermost calls.
+  size_t inclusive, exclusive;
+  // Host time, only with YARN_OPTION_PROFILESAMPLE.
+  uint64_t inclusivens, exclusivens;
+} yarn_profileFunction;
+// Times the instruction at ip ran.
+size_t yarn_profileHits(yarn_state *Y, yarn_uint ip);
+// Times an instruction with the opcode byte op ran.
+size_t yarn_profileOpcodeHits(yarn_state *Y, unsigned char op);
+// Fills out with up to max functions, returns the number of functions there
+// are, or -1 if the state isn't profiled.
+int yarn_profileFunctions(yarn_state *Y, yarn_profileFunction *out, int max);
+// Writes the call stacks in the folded format of flamegraph.pl, weighted by
+// instructions or by sampled nanoseconds. Returns 0 or -1.
+int yarn_profileSaveFolded(yarn_state *Y, const char *path, int nanoseconds);
+
+// Tracing, see YARN_OPTION_TRACE. Every instruction run leaves one record.
+typedef struct {
+  yarn_uint ip;
+  yarn_uint value;          // Value of reg after the instruction
+  yarn_uint addr;           // Memory address touched, if access isn't 0
+  unsigned char op;         // Opcode byte
+  unsigned char reg;        // Register written, YARN_REG_NULL for none
+  unsigned char access;     // YARN_TRACE_READ, YARN_TRACE_WRITE or 0
+  unsigned char flags;      // Flags after the instruction
+} yarn_traceRecord;
+// Moves up to max of the oldest records into out, returns how many it moved.
+// May be called from another thread while the state runs.
+size_t yarn_traceDrain(yarn_state *Y, yarn_traceRecord *out, size_t max);
+// Records lost because the buffer was full when their instruction ran.
+size_t yarn_traceDropped(yarn_state *Y);
 
 enum {
   YARN_STATUS_OK,
@@ -75,8 +255,20 @@ enum {
   YARN_STATUS_INVALIDMEMORY,
   YARN_STATUS_INVALIDINSTRUCTION,
   YARN_STATUS_DIVBYZERO,
+  YARN_STATUS_SUSPENDED, // Waiting on an asynchronous syscall, see yarn_suspend
   YARN_STATUS_NUM,
 };
+enum {
+  YARN_OPTION_JIT,  // Compile hot code to native code (x86-64 only)
+  YARN_OPTION_PROFILE,       // Count instructions per ip, opcode and function
+  YARN_OPTION_PROFILESAMPLE, // Read the host clock every value instructions
+  YARN_OPTION_TRACE,         // Trace into a ring buffer of value records
+  YARN_OPTION_NUM,
+};
+enum {
+  YARN_TRACE_READ = 1,
+  YARN_TRACE_WRITE,
+};
 enum {
   YARN_FLAG_CONDITIONAL, // 0x0 // Stores result of last COND statement.
   YARN_FLAG_NUM,
@@ -111,6 +303,15 @@ enum {
   YARN_ICODE_CONDITIONAL = 0x50,   //0x50
   YARN_ICODE_NUM = 0x60,           //0x60
 };
+// Bytes an instruction takes in code. Arith and move instructions are the
+// opcode, a byte with rA and rB and the immediate, branches the opcode and the
+// immediate.
+#define YARN_LEN_CONTROL 1
+#define YARN_LEN_ARITH (2+YARN_WORDSIZE)
+#define YARN_LEN_MOVE (2+YARN_WORDSIZE)
+#define YARN_LEN_STACK 2
+#define YARN_LEN_BRANCH (1+YARN_WORDSIZE)
+#define YARN_LEN_CONDITIONAL 2
 
 enum {
   YARN_INST_HALT = YARN_ICODE_CONTROL,  //0x00
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yarn_asm.h"
+
+#define ASM_ERRORSIZE 160
+// The longest instruction, room for it is made before each one.
+#define ASM_MAXINSTRUCTION YARN_LEN_ARITH
+
+typedef struct {
+  const char *name;         // Points into the source, not terminated
+  size_t len;
+  yarn_uint addr;           // Of its last definition so far
+  int defined;
+  int exportline;           // Line of the first .export naming it, 0 for none
+} asm_label;
+
+// A jump to a label not defined yet, patched once the source is read.
+typedef struct {
+  size_t offset;            // Of the d in the code
+  int label;
+  int line;
+} asm_fixup;
+
+typedef struct {
+  char *code;
+  size_t size, capacity;
+  asm_label *labels;
+  int nlabels, labelcapacity;
+  int *slots;               // Open addressed label indices, -1 for empty
+  size_t slotmask;
+  asm_fixup *fixups;
+  int nfixups, fixupcapacity;
+  int line;
+  char error[ASM_ERRORSIZE];
+} asm_state;
+
+typedef struct {
+  int reg;
+  yarn_uint d;
+  int mem;                  // Written as *(...)
+  const char *loc;          // Label after a :, NULL for none
+  size_t loclen;
+} asm_operand;
+
+// The mnemonics of assemble.py, mov picks one of the four moves.
+static const struct {
+  const char *name;
+  unsigned char op;
+} asmInstructions[] = {
+  {"halt", YARN_INST_HALT}, {"pause", YARN_INST_PAUSE}, {"nop", YARN_INST_NOP},
+  {"add", YARN_INST_ADD}, {"sub", YARN_INST_SUB}, {"mul", YARN_INST_MUL},
+  {"div", YARN_INST_DIV}, {"divs", YARN_INST_DIVS}, {"lsh", YARN_INST_LSH},
+  {"rsh", YARN_INST_RSH}, {"rshs", YARN_INST_RSHS}, {"and", YARN_INST_AND},
+  {"or", YARN_INST_OR}, {"xor", YARN_INST_XOR}, {"not", YARN_INST_NOT},
+  {"mov", YARN_INST_IR}, {"irmov", YARN_INST_IR}, {"mrmov", YARN_INST_MR},
+  {"rrmov", YARN_INST_RR}, {"rmmov", YARN_INST_RM},
+  {"push", YARN_INST_PUSH}, {"pop", YARN_INST_POP},
+  {"call", YARN_INST_CALL}, {"ret", YARN_INST_RET}, {"jmp", YARN_INST_JUMP},
+  {"jif", YARN_INST_CONDJUMP}, {"syscall", YARN_INST_SYSCALL},
+  {"lt", YARN_INST_LT}, {"lts", YARN_INST_LTS}, {"lte", YARN_INST_LTE},
+  {"ltes", YARN_INST_LTES}, {"eq", YARN_INST_EQ}, {"neq", YARN_INST_NEQ},
+};
+static const char *const asmRegisters[YARN_REG_NUM] = {
+  "ins", "stk", "bse", "ret", "c1", "c2", "c3", "c4", "c5", "c6",
+  "s1", "s2", "s3", "s4", "s5", "null"
+};
+
+// Whitespace as Python's str.strip sees it.
+static int asm_isSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r') || (c >= 0x1C && c <= 0x1F);
+}
+static int asm_isWord(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+static int asm_hexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+static void asm_strip(const char **p, const char **end) {
+  while (*p < *end && asm_isSpace(**p)) {
+    (*p)++;
+  }
+  while (*end > *p && asm_isSpace((*end)[-1])) {
+    (*end)--;
+  }
+}
+
+static int asm_error(asm_state *A, int line, const char *message,
+                     const char *s, size_t n) {
+  snprintf(A->error, ASM_ERRORSIZE, "line %d: %s%.*s", line, message,
+           n > 64 ? 64 : (int)n, s);
+  return -1;
+}
+
+static int asm_reserve(asm_state *A) {
+  if (A->size + ASM_MAXINSTRUCTION > A->capacity) {
+    size_t capacity = A->capacity*2;
+    char *code = realloc(A->code, capacity);
+    if (code == NULL) {
+      return asm_error(A, A->line, "Out of memory", "", 0);
+    }
+    A->code = code;
+    A->capacity = capacity;
+  }
+  return 0;
+}
+static void asm_emit(asm_state *A, unsigned char op, int rA, int rB,
+                     yarn_uint d) {
+  char *p = A->code + A->size;
+  p[0] = op;
+  switch (op & 0xF0) {
+    case YARN_ICODE_CONTROL:
+      A->size += YARN_LEN_CONTROL;
+      break;
+    case YARN_ICODE_STACK:
+      p[1] = rA << 4;
+      A->size += YARN_LEN_STACK;
+      break;
+    case YARN_ICODE_BRANCH:
+      memcpy(p+1, &d, sizeof(yarn_uint));
+      A->size += YARN_LEN_BRANCH;
+      break;
+    case YARN_ICODE_CONDITIONAL:
+      p[1] = rA << 4 | rB;
+      A->size += YARN_LEN_CONDITIONAL;
+      break;
+    default: // Arith and move
+      p[1] = rA << 4 | rB;
+      memcpy(p+2, &d, sizeof(yarn_uint));
+      A->size += YARN_LEN_ARITH;
+  }
+}
+
+// FNV-1a, like the export tables of linked images.
+static size_t asm_hash(const char *name, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)name[i])*16777619u;
+  }
+  return hash;
+}
+static int asm_grow(asm_state *A) {
+  size_t nslots = (A->slotmask + 1)*2;
+  int *slots = malloc(nslots*sizeof(int));
+  asm_label *labels = realloc(A->labels,
+                              A->labelcapacity*2*sizeof(asm_label));
+  if (labels != NULL) {
+    A->labels = labels;
+    A->labelcapacity *= 2;
+  }
+  if (slots == NULL || labels == NULL) {
+    free(slots);
+    return -1;
+  }
+  memset(slots, 0xFF, nslots*sizeof(int));
+  for (int i = 0; i < A->nlabels; i++) {
+    size_t slot = asm_hash(labels[i].name, labels[i].len) & (nslots - 1);
+    while (slots[slot] != -1) {
+      slot = (slot + 1) & (nslots - 1);
+    }
+    slots[slot] = i;
+  }
+  free(A->slots);
+  A->slots = slots;
+  A->slotmask = nslots - 1;
+  return 0;
+}
+// Index of the label, added undefined if it's new. -1 when out of memory.
+static int asm_findLabel(asm_state *A, const char *name, size_t len) {
+  size_t slot = asm_hash(name, len) & A->slotmask;
+  while (A->slots[slot] != -1) {
+    asm_label *L = &A->labels[A->slots[slot]];
+    if (L->len == len && memcmp(L->name, name, len) == 0) {
+      return A->slots[slot];
+    }
+    slot = (slot + 1) & A->slotmask;
+  }
+  // Keep the table at most half full
+  if (A->nlabels == A->labelcapacity ||
+      (size_t)(A->nlabels + 1)*2 > A->slotmask + 1) {
+    if (asm_grow(A) != 0) {
+      return asm_error(A, A->line, "Out of memory", "", 0);
+    }
+    return asm_findLabel(A, name, len);
+  }
+  A->slots[slot] = A->nlabels;
+  A->labels[A->nlabels].name = name;
+  A->labels[A->nlabels].len = len;
+  A->labels[A->nlabels].addr = 0;
+  A->labels[A->nlabels].defined = 0;
+  A->labels[A->nlabels].exportline = 0;
+  return A->nlabels++;
+}
+
+// $1234 and $-1234 are decimal, 0x1F and -0x1F hex. Like assemble.py the sign
+// is dropped, -0x1F is 0x1F, and a w after the digits counts in words, $2w is
+// 2*YARN_WORDSIZE. Numbers wrap at the word size.
+static int asm_number(asm_state *A, const char *p, const char *end,
+                      yarn_uint *d) {
+  const char *start = p;
+  int base = 16, words = 0;
+  if (p < end && *p == '$') {
+    base = 10;
+    p++;
+    if (p < end && *p == '-') {
+      p++;
+    }
+  } else {
+    if (p < end && *p == '-') {
+      p++;
+    }
+    if (end - p < 2 || p[0] != '0' || p[1] != 'x') {
+      return asm_error(A, A->line, "Invalid operand: ", start, end - start);
+    }
+    p += 2;
+  }
+  if (p < end && end[-1] == 'w') {
+    words = 1;
+    end--;
+  }
+  if (p == end) {
+    return asm_error(A, A->line, "Invalid operand: ", start,
+                     end + words - start);
+  }
+  *d = 0;
+  for (; p < end; p++) {
+    int digit = asm_hexDigit(*p);
+    if (digit < 0 || digit >= base) {
+      return asm_error(A, A->line, "Invalid number: ", start,
+                       end + words - start);
+    }
+    *d = *d*base + digit;
+  }
+  if (words) {
+    *d *= YARN_WORDSIZE;
+  }
+  return 0;
+}
+static int asm_register(asm_state *A, const char *name, size_t len) {
+  for (int r = 0; r < YARN_REG_NUM; r++) {
+    if (strlen(asmRegisters[r]) == len &&
+        memcmp(asmRegisters[r], name, len) == 0) {
+      return r;
+    }
+  }
+  return asm_error(A, A->line, "Unknown register: %", name, len);
+}
+// Parses one of %reg, %reg+<number>, <number> or :label, optionally inside
+// *(...) for memory.
+static int asm_parseOperand(asm_state *A, const char *p, const char *end,
+                            asm_operand *o) {
+  const char *close;
+  o->reg = YARN_REG_NULL;
+  o->d = 0;
+  o->mem = 0;
+  o->loc = NULL;
+  o->loclen = 0;
+  asm_strip(&p, &end);
+  if (end - p >= 4 && p[0] == '*' && p[1] == '(' &&
+      (close = memchr(p+3, ')', end - (p+3))) != NULL) {
+    // Anything after the ) is ignored, like assemble.py does
+    o->mem = 1;
+    p += 2;
+    end = close;
+  }
+  if (p == end) {
+    return asm_error(A, A->line, "Missing operand", "", 0);
+  }
+  if (*p == '%') {
+    const char *name = ++p;
+    while (p < end && asm_isWord(*p)) {
+      p++;
+    }
+    if (p == name || (p < end && *p != '+')) {
+      return asm_error(A, A->line, "Invalid operand: %", name, end - name);
+    }
+    o->reg = asm_register(A, name, p - name);
+    if (o->reg < 0) {
+      return -1;
+    }
+    return p < end ? asm_number(A, p+1, end, &o->d) : 0;
+  } else if (*p == ':') {
+    o->loc = ++p;
+    while (p < end && asm_isWord(*p)) {
+      p++;
+    }
+    o->loclen = p - o->loc;
+    if (p != end || o->loclen == 0) {
+      return asm_error(A, A->line, "Invalid label: :", o->loc, end - o->loc);
+    }
+    return 0;
+  }
+  return asm_number(A, p, end, &o->d);
+}
+
+// Splits the arguments after an instruction at the commas, returning how
+// many there are. Only the first two are kept, no instruction takes more.
+static int asm_split(const char *p, const char *end, const char **args,
+                     const char **ends) {
+  int n = 0;
+  for (;;) {
+    const char *comma = memchr(p, ',', end - p);
+    const char *e = comma != NULL ? comma : end;
+    if (n < 2) {
+      args[n] = p;
+      ends[n] = e;
+    }
+    n++;
+    if (comma == NULL) {
+      return n;
+    }
+    p = comma + 1;
+  }
+}
+
+static int asm_instruction(asm_state *A, unsigned char op, int nargs,
+                           const char **args, const char **ends) {
+  asm_operand a, b;
+  int needed = 0;
+  switch (op & 0xF0) {
+    case YARN_ICODE_STACK: needed = 1; break;
+    case YARN_ICODE_ARITH:
+    case YARN_ICODE_MOVE:
+    case YARN_ICODE_CONDITIONAL: needed = 2; break;
+  }
+  if (nargs < needed) {
+    return asm_error(A, A->line, "Missing operand", "", 0);
+  }
+  if (needed >= 1 && asm_parseOperand(A, args[0], ends[0], &a) != 0) {
+    return -1;
+  }
+  if (needed >= 2 && asm_parseOperand(A, args[1], ends[1], &b) != 0) {
+    return -1;
+  }
+  if (asm_reserve(A) != 0) {
+    return -1;
+  }
+  switch (op & 0xF0) {
+    case YARN_ICODE_CONTROL:
+      asm_emit(A, op, YARN_REG_NULL, YARN_REG_NULL, 0);
+      break;
+    case YARN_ICODE_STACK:
+      asm_emit(A, op, a.reg, YARN_REG_NULL, 0);
+      break;
+    case YARN_ICODE_ARITH:
+    case YARN_ICODE_CONDITIONAL:
+      asm_emit(A, op, a.reg, b.reg, a.d);
+      break;
+    case YARN_ICODE_MOVE:
+      if (a.mem && !b.mem) {
+        asm_emit(A, YARN_INST_MR, a.reg, b.reg, a.d);
+      } else if (!a.mem && b.mem) {
+        asm_emit(A, YARN_INST_RM, a.reg, b.reg, b.d);
+      } else if (a.reg == YARN_REG_NULL && !b.mem) {
+        asm_emit(A, YARN_INST_IR, a.reg, b.reg, a.d);
+      } else if (a.reg != YARN_REG_NULL && b.reg != YARN_REG_NULL && !b.mem) {
+        asm_emit(A, YARN_INST_RR, a.reg, b.reg, a.d);
+      } else {
+        return asm_error(A, A->line, "Invalid mov statement.", "", 0);
+      }
+      break;
+    case YARN_ICODE_BRANCH:
+      a.d = 0;
+      a.loc = NULL;
+      if (nargs > 0 && asm_parseOperand(A, args[0], ends[0], &a) != 0) {
+        return -1;
+      }
+      if (a.loc != NULL) {
+        int label = asm_findLabel(A, a.loc, a.loclen);
+        if (label < 0) {
+          return -1;
+        }
+        if (A->labels[label].defined) {
+          a.d = A->labels[label].addr;
+        } else {
+          if (A->nfixups == A->fixupcapacity) {
+            int capacity = A->fixupcapacity ? A->fixupcapacity*2 : 64;
+            asm_fixup *fixups = realloc(A->fixups, capacity*sizeof(asm_fixup));
+            if (fixups == NULL) {
+              return asm_error(A, A->line, "Out of memory", "", 0);
+            }
+            A->fixups = fixups;
+            A->fixupcapacity = capacity;
+          }
+          A->fixups[A->nfixups].offset = A->size + 1;
+          A->fixups[A->nfixups].label = label;
+          A->fixups[A->nfixups].line = A->line;
+          A->nfixups++;
+        }
+      }
+      asm_emit(A, op, YARN_REG_NULL, YARN_REG_NULL, a.d);
+      break;
+  }
+  return 0;
+}
+
+static int asm_line(asm_state *A, const char *p, const char *end) {
+  const char *comment = memchr(p, ';', end - p);
+  const char *head, *args[2], *ends[2];
+  int nargs = 0;
+  if (comment != NULL) {
+    end = comment;
+  }
+  asm_strip(&p, &end);
+  if (p == end) {
+    return 0;
+  }
+  // The mnemonic or label ends at the first space, tabs don't count
+  head = memchr(p, ' ', end - p);
+  if (head != NULL) {
+    nargs = asm_split(head + 1, end, args, ends);
+  } else {
+    head = end;
+  }
+
+  if (head - p == 7 && memcmp(p, ".export", 7) == 0) {
+    const char *arg = head + 1;
+    while (arg <= end) {
+      const char *comma = memchr(arg, ',', end - arg);
+      const char *e = comma != NULL ? comma : end;
+      const char *name = arg;
+      int label;
+      asm_strip(&name, &e);
+      label = asm_findLabel(A, name, e - name);
+      if (label < 0) {
+        return -1;
+      }
+      if (A->labels[label].exportline == 0) {
+        A->labels[label].exportline = A->line;
+      }
+      arg = (comma != NULL ? comma : end) + 1;
+    }
+    return 0;
+  }
+  if (head[-1] == ':') {
+    // Anything after a label on its line is ignored, like assemble.py does
+    int label = asm_findLabel(A, p, head - 1 - p);
+    if (label < 0) {
+      return -1;
+    }
+    A->labels[label].addr = (yarn_uint)A->size;
+    A->labels[label].defined = 1;
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(asmInstructions)/sizeof(asmInstructions[0]); i++) {
+    if (strlen(asmInstructions[i].name) == (size_t)(head - p) &&
+        memcmp(asmInstructions[i].name, p, head - p) == 0) {
+      return asm_instruction(A, asmInstructions[i].op, nargs, args, ends);
+    }
+  }
+  return asm_error(A, A->line, "Unknown instruction: ", p, head - p);
+}
+
+static void asm_release(asm_state *A) {
+  free(A->code);
+  free(A->labels);
+  free(A->slots);
+  free(A->fixups);
+}
+static int asm_fail(asm_state *A, char **err) {
+  if (err != NULL) {
+    size_t len = strlen(A->error) + 1;
+    *err = malloc(len);
+    if (*err != NULL) {
+      memcpy(*err, A->error, len);
+    }
+  }
+  asm_release(A);
+  return -1;
+}
+int yarn_assemble(const char *src, size_t len, char **out, size_t *outlen,
+                  char **err) {
+  asm_state A;
+  const char *p = src, *end = src + len;
+  memset(&A, 0, sizeof(asm_state));
+  // About one instruction for every 16 bytes of source
+  A.capacity = len/2 + 64;
+  A.code = malloc(A.capacity);
+  A.labelcapacity = 32;
+  A.labels = malloc(A.labelcapacity*sizeof(asm_label));
+  A.slotmask = 63;
+  A.slots = malloc((A.slotmask + 1)*sizeof(int));
+  if (A.code == NULL || A.labels == NULL || A.slots == NULL) {
+    asm_error(&A, 0, "Out of memory", "", 0);
+    return asm_fail(&A, err);
+  }
+  memset(A.slots, 0xFF, (A.slotmask + 1)*sizeof(int));
+
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+    A.line++;
+    if (asm_line(&A, p, eol) != 0) {
+      return asm_fail(&A, err);
+    }
+    p = eol + 1;
+  }
+
+  // Jumps ahead go to the last definition of their label
+  for (int i = 0; i < A.nfixups; i++) {
+    asm_label *L = &A.labels[A.fixups[i].label];
+    if (!L->defined) {
+      asm_error(&A, A.fixups[i].line, "Invalid location: ", L->name, L->len);
+      return asm_fail(&A, err);
+    }
+    memcpy(A.code + A.fixups[i].offset, &L->addr, sizeof(yarn_uint));
+  }
+  for (int i = 0; i < A.nlabels; i++) {
+    asm_label *L = &A.labels[i];
+    if (L->exportline != 0 && !L->defined) {
+      asm_error(&A, L->exportline, "Exported location not defined: ", L->name,
+                L->len);
+      return asm_fail(&A, err);
+    }
+  }
+  *out = A.code;
+  *outlen = A.size;
+  A.code = NULL;
+  asm_release(&A);
+  return 0;
+}
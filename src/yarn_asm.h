@@ -0,0 +1,36 @@
+// Assembler:
+//   Assembles the syntax of tools/assemble.py into the same code, so hosts
+//   that generate programs at runtime don't have to run Python for each one.
+//     if (yarn_assemble(src, strlen(src), &code, &size, &err) != 0) {
+//       fprintf(stderr, "%s\n", err);
+//       free(err);
+//     } else {
+//       yarn_loadCode(Y, code, size);
+//       free(code);
+//     }
+//
+//   The source is read once, line by line, without copying it: labels point
+//   into it, and jumps to labels that aren't defined yet are patched at the
+//   end. Like assemble.py a jump goes to the last definition of a label
+//   before it, or to the last one in the source if there is none, and
+//   `.export` only checks its labels exist. Where assemble.py silently reads
+//   an operand it doesn't understand as %null, this reports an error.
+//
+//   The code is for the word size of the build, like `assemble.py -w64` for
+//   a YARN_64BIT one.
+
+#include <stddef.h>
+
+#include "yarn.h"
+
+#ifndef YARN_ASM_H_
+#define YARN_ASM_H_
+
+// Assembles the len bytes of source at src. Returns 0 and sets *out to the
+// code, which the caller frees, and *outlen to its size. Returns -1 on
+// failure, setting *err (when err isn't NULL) to a message naming the line,
+// which the caller frees too.
+int yarn_assemble(const char *src, size_t len, char **out, size_t *outlen,
+                  char **err);
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ * The interpreter loop, included by yarn.c once per variant. Not a public
+ * header. Before including it define:
+ *   YARN_INTERPRET       - The name of the function to generate.
+ *   YARN_INTERPRET_HOOKS - (Optional) Call the yarn_hook* functions around
+ *                          every instruction, and run superinstructions as
+ *                          their two instructions so hooks see both.
+ *   YARN_INTERPRET_VERIFIED - (Optional) Run code yarn_verify accepted without
+ *                          checking ip on every fetch. Only the instructions
+ *                          that can move ip somewhere unknown check where it
+ *                          went, and return if it isn't verified code, so the
+ *                          caller can finish with a checked variant.
+ *   YARN_INTERPRET_PAGED - (Optional) Run states made by yarn_initPaged.
+ * The variant without hooks has no trace of them, so turning an instrumenting
+ * feature off costs nothing.
+ */
+
+#ifdef YARN_INTERPRET_HOOKS
+#define yarn_hook_fetch() yarn_hookFetch(Y, ip, in);
+#define yarn_hook_call(target) yarn_hookCall(Y, target);
+#define yarn_hook_ret() yarn_hookRet(Y);
+#define yarn_unfuse 1
+#else
+#define yarn_hook_fetch()
+#define yarn_hook_call(target)
+#define yarn_hook_ret()
+#define yarn_unfuse 0
+#endif
+
+#ifdef YARN_INTERPRET_VERIFIED
+#define yarn_verified 1
+#define yarn_verifiedip() \
+  (Y->reg[YARN_REG_INSTRUCTION] < Y->codesize && \
+   Y->verified[Y->reg[YARN_REG_INSTRUCTION]])
+// Counts the instruction that just ran and leaves if it moved ip out of the
+// verified code.
+#define yarn_check_target() \
+  if (!yarn_verifiedip()) { \
+    Y->instructioncount += 1; \
+    goto yarn_unverified; \
+  }
+#else
+#define yarn_verified 0
+#define yarn_check_target()
+#endif
+
+// Guest memory and the register window in it. The hooked variant runs both
+// kinds of memory.
+#if defined(YARN_INTERPRET_PAGED)
+#define yarn_mem_load(pos, val, bsize) yarn_loadPaged(Y, pos, val, bsize)
+#define yarn_mem_store(pos, val, bsize) yarn_storePaged(Y, pos, val, bsize)
+#define yarn_mem_push(val) yarn_pushRegPaged(Y, val)
+#define yarn_mem_pop() yarn_popRegPaged(Y)
+#define yarn_mem_reload() yarn_loadRegistersPaged(Y)
+#elif defined(YARN_INTERPRET_HOOKS)
+#define yarn_mem_load(pos, val, bsize) (Y->paged.table ? \
+  yarn_loadPaged(Y, pos, val, bsize) : yarn_load(Y, pos, val, bsize))
+#define yarn_mem_store(pos, val, bsize) (Y->paged.table ? \
+  yarn_storePaged(Y, pos, val, bsize) : yarn_store(Y, pos, val, bsize))
+#define yarn_mem_push(val) (Y->paged.table ? \
+  yarn_pushRegPaged(Y, val) : yarn_pushReg(Y, val))
+#define yarn_mem_pop() (Y->paged.table ? yarn_popRegPaged(Y) : yarn_popReg(Y))
+#define yarn_mem_reload() (Y->paged.table ? \
+  yarn_loadRegistersPaged(Y) : yarn_loadRegisters(Y))
+#else
+#define yarn_mem_load(pos, val, bsize) yarn_load(Y, pos, val, bsize)
+#define yarn_mem_store(pos, val, bsize) yarn_store(Y, pos, val, bsize)
+#define yarn_mem_push(val) yarn_pushReg(Y, val)
+#define yarn_mem_pop() yarn_popReg(Y)
+#define yarn_mem_reload() yarn_loadRegisters(Y)
+#endif
+
+#ifdef YARN_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+static YARN_NOINLINE int YARN_INTERPRET(yarn_state *Y, int icount) {
+  yarn_uint ip;
+  yarn_inst decoded;
+  const yarn_inst *in;
+#ifdef YARN_THREADED
+  static const void *const handlers[] = {
+    [0 ... YARN_XINST_NUM-1] = &&yarn_handler_invalid,
+    yarn_handler(YARN_INST_HALT), yarn_handler(YARN_INST_PAUSE),
+    yarn_handler(YARN_INST_NOP),
+    yarn_handler(YARN_INST_ADD), yarn_handler(YARN_INST_SUB),
+    yarn_handler(YARN_INST_MUL), yarn_handler(YARN_INST_DIV),
+    yarn_handler(YARN_INST_DIVS), yarn_handler(YARN_INST_LSH),
+    yarn_handler(YARN_INST_RSH), yarn_handler(YARN_INST_RSHS),
+    yarn_handler(YARN_INST_AND), yarn_handler(YARN_INST_OR),
+    yarn_handler(YARN_INST_XOR), yarn_handler(YARN_INST_NOT),
+    yarn_handler(YARN_INST_IR), yarn_handler(YARN_INST_MR),
+    yarn_handler(YARN_INST_RR), yarn_handler(YARN_INST_RM),
+    yarn_handler(YARN_INST_PUSH), yarn_handler(YARN_INST_POP),
+    yarn_handler(YARN_INST_CALL), yarn_handler(YARN_INST_RET),
+    yarn_handler(YARN_INST_JUMP), yarn_handler(YARN_INST_CONDJUMP),
+    yarn_handler(YARN_INST_SYSCALL),
+    yarn_handler(YARN_INST_LT), yarn_handler(YARN_INST_LTS),
+    yarn_handler(YARN_INST_LTE), yarn_handler(YARN_INST_LTES),
+    yarn_handler(YARN_INST_EQ), yarn_handler(YARN_INST_NEQ),
+    yarn_handler(YARN_XINST_LT_JIF), yarn_handler(YARN_XINST_LTS_JIF),
+    yarn_handler(YARN_XINST_LTE_JIF), yarn_handler(YARN_XINST_LTES_JIF),
+    yarn_handler(YARN_XINST_EQ_JIF), yarn_handler(YARN_XINST_NEQ_JIF),
+    yarn_handler(YARN_XINST_IR_ADD), yarn_handler(YARN_XINST_PUSH_PUSH),
+    yarn_handler(YARN_XINST_POP_POP),
+  };
+#endif
+
+#ifdef YARN_INTERPRET_VERIFIED
+  if (!yarn_verifiedip()) {
+    return Y->status;
+  }
+#endif
+  while (Y->status == YARN_STATUS_OK && (icount > 0 || icount == -1)) {
+    unsigned char rA, rB;
+    yarn_uint valA, valB, valM, d;
+    yarn_int valA_s, valB_s;
+
+    yarn_fetch();
+
+    // Here we execute the specified function for the icode and increment the
+    // instruction register.
+#ifdef YARN_THREADED
+    goto *handlers[in->op];
+    {
+#else
+    switch(in->op) {
+#endif
+      //   Control
+      yarn_case(YARN_INST_HALT):
+        Y->status = YARN_STATUS_HALT;
+        incip(1);
+        yarn_next();
+      yarn_case(YARN_INST_PAUSE):
+        Y->status = YARN_STATUS_PAUSE;
+        incip(1);
+        yarn_next();
+      yarn_case(YARN_INST_NOP):
+        incip(1);
+        yarn_next();
+
+      //   Arith:
+      yarn_case(YARN_INST_ADD):
+        arithinst_setup();
+        Y->reg[rB] = valB + valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_SUB):
+        arithinst_setup();
+        Y->reg[rB] = valB - valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_MUL):
+        arithinst_setup();
+        Y->reg[rB] = valB * valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_DIV):
+        arithinst_setup();
+        if (valA == 0) {
+          Y->status = YARN_STATUS_DIVBYZERO;
+        } else {
+          Y->reg[rB] = valB / valA;
+        }
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_DIVS):
+        arithinst_s_setup();
+        if (valA_s == 0) {
+          Y->status = YARN_STATUS_DIVBYZERO;
+        } else {
+          Y->reg[rB] = (yarn_uint)(valB_s / valA_s);
+        }
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_LSH):
+        arithinst_setup();
+        Y->reg[rB] = valB << valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_RSH):
+        arithinst_setup();
+        Y->reg[rB] = valB >> valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_RSHS):
+        arithinst_s_setup();
+        Y->reg[rB] = (yarn_uint)(valB_s >> valA_s);
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_AND):
+        arithinst_setup();
+        Y->reg[rB] = valB & valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_OR):
+        arithinst_setup();
+        Y->reg[rB] = valB | valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_XOR):
+        arithinst_setup();
+        Y->reg[rB] = valB ^ valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_INST_NOT):
+        arithinst_setup();
+        Y->reg[rB] = ~valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+
+      //   Move:
+      yarn_case(YARN_INST_IR):
+        moveinst_setup();
+        Y->reg[rB] = valA + d;
+        incip(YARN_LEN_MOVE);
+        yarn_next();
+      yarn_case(YARN_INST_MR):
+        moveinst_setup();
+        valM = 0;
+        yarn_mem_load(d+valA, &valM, sizeof(valM));
+        Y->reg[rB] = valM;
+        incip(YARN_LEN_MOVE);
+        yarn_next();
+      yarn_case(YARN_INST_RR):
+        moveinst_setup();
+        Y->reg[rB] = valA; // Do we want to use d?
+        incip(YARN_LEN_MOVE);
+        yarn_next();
+      yarn_case(YARN_INST_RM):
+        moveinst_setup();
+        yarn_mem_store(Y->reg[rB]+d, &valA, sizeof(valA));
+        incip(YARN_LEN_MOVE);
+        yarn_check_target();
+        yarn_next();
+
+      //   Stack:
+      yarn_case(YARN_INST_PUSH):
+        stackinst_setup();
+        yarn_mem_push(Y->reg[rA]);
+        incip(2);
+        yarn_check_target();
+        yarn_next();
+      yarn_case(YARN_INST_POP):
+        stackinst_setup();
+        valA = yarn_mem_pop();
+        Y->reg[rA] = valA;
+        incip(2);
+        yarn_next();
+
+      //   Branches:
+      yarn_case(YARN_INST_CALL):
+        branchinst_setup();
+        yarn_mem_push(ip+YARN_LEN_BRANCH);
+        Y->reg[YARN_REG_INSTRUCTION] = d;
+        yarn_hook_call(d);
+        yarn_check_target();
+        yarn_next();
+      yarn_case(YARN_INST_RET):
+        branchinst_setup();
+        for(yarn_uint i=0; i<d; i++) {
+          yarn_mem_pop();
+        }
+        valA = yarn_mem_pop();
+        Y->reg[YARN_REG_INSTRUCTION] = valA;
+        yarn_hook_ret();
+        yarn_check_target();
+        yarn_next();
+      yarn_case(YARN_INST_JUMP):
+        branchinst_setup();
+        Y->reg[YARN_REG_INSTRUCTION] = d;
+        yarn_next();
+      yarn_case(YARN_INST_CONDJUMP):
+        branchinst_setup();
+        if ((Y->flags >> YARN_FLAG_CONDITIONAL) & 1) {
+          Y->reg[YARN_REG_INSTRUCTION] = d;
+        } else {
+          incip(YARN_LEN_BRANCH);
+        }
+        yarn_next();
+      yarn_case(YARN_INST_SYSCALL):
+        branchinst_setup();
+        yarn_CFunc fun = (yarn_uint)d < YARN_SYSCALL_DIRECT ?
+          Y->image->direct[d] : yarn_getSysCall(Y, (yarn_uint)d);
+        if (fun == NULL) {
+          Y->status = YARN_STATUS_INVALIDINSTRUCTION;
+        } else {
+          // Syscalls see the state through the public API, which writes the
+          // register file back if it reaches the register window.
+          (*fun)(Y);
+          if (!Y->cached) {
+            yarn_mem_reload();
+            Y->cached = 1;
+          }
+        }
+        incip(YARN_LEN_BRANCH);
+        yarn_check_target();
+        yarn_next();
+
+      //   Conditionals:
+      yarn_case(YARN_INST_LT):
+        conditionalinst_setup();
+        if (valA < valB) setcondition();
+        incip(2);
+        yarn_next();
+      yarn_case(YARN_INST_LTS):
+        conditionalinst_s_setup();
+        if (valA_s < valB_s) setcondition();
+        incip(2);
+        yarn_next();
+      yarn_case(YARN_INST_LTE):
+        conditionalinst_setup();
+        if (valA <= valB) setcondition();
+        incip(2);
+        yarn_next();
+      yarn_case(YARN_INST_LTES):
+        conditionalinst_s_setup();
+        if (valA_s <= valB_s) setcondition();
+        incip(2);
+        yarn_next();
+      yarn_case(YARN_INST_EQ):
+        conditionalinst_setup();
+        if (valA == valB) setcondition();
+        incip(2);
+        yarn_next();
+      yarn_case(YARN_INST_NEQ):
+        conditionalinst_setup();
+        if (valA != valB) setcondition();
+        incip(2);
+        yarn_next();
+
+      //   Superinstructions:
+      yarn_case(YARN_XINST_LT_JIF):
+        conditionalinst_setup();
+        fusedcondjump(valA < valB);
+        yarn_next();
+      yarn_case(YARN_XINST_LTS_JIF):
+        conditionalinst_s_setup();
+        fusedcondjump(valA_s < valB_s);
+        yarn_next();
+      yarn_case(YARN_XINST_LTE_JIF):
+        conditionalinst_setup();
+        fusedcondjump(valA <= valB);
+        yarn_next();
+      yarn_case(YARN_XINST_LTES_JIF):
+        conditionalinst_s_setup();
+        fusedcondjump(valA_s <= valB_s);
+        yarn_next();
+      yarn_case(YARN_XINST_EQ_JIF):
+        conditionalinst_setup();
+        fusedcondjump(valA == valB);
+        yarn_next();
+      yarn_case(YARN_XINST_NEQ_JIF):
+        conditionalinst_setup();
+        fusedcondjump(valA != valB);
+        yarn_next();
+      yarn_case(YARN_XINST_IR_ADD):
+        moveinst_setup();
+        Y->reg[rB] = valA + d;
+        incip(YARN_LEN_MOVE);
+        countfused();
+        in = &Y->decoded[in->next];
+        arithinst_setup();
+        Y->reg[rB] = valB + valA;
+        incip(YARN_LEN_ARITH);
+        yarn_next();
+      yarn_case(YARN_XINST_PUSH_PUSH):
+        stackinst_setup();
+        yarn_mem_push(Y->reg[rA]);
+        incip(2);
+        // A push into the register window can move %ins, then the next
+        // instruction isn't the second push and this ran as a single one.
+        if (Y->status == YARN_STATUS_OK &&
+            Y->reg[YARN_REG_INSTRUCTION] == ip+2) {
+          countfused();
+          in = &Y->decoded[in->next];
+          stackinst_setup();
+          yarn_mem_push(Y->reg[rA]);
+          incip(2);
+        }
+        yarn_check_target();
+        yarn_next();
+      yarn_case(YARN_XINST_POP_POP):
+        stackinst_setup();
+        valA = yarn_mem_pop();
+        Y->reg[rA] = valA;
+        incip(2);
+        if (Y->status == YARN_STATUS_OK) {
+          countfused();
+          in = &Y->decoded[in->next];
+          stackinst_setup();
+          valA = yarn_mem_pop();
+          Y->reg[rA] = valA;
+          incip(2);
+        }
+        yarn_next();
+
+      yarn_default():
+        yarn_invalidInstruction();
+        yarn_next();
+    }
+
+    // Check and make sure we haven't run out of instructions to use.
+    Y->instructioncount += 1;
+    if (icount != -1) {
+      icount -= 1;
+    }
+  }
+#ifdef YARN_INTERPRET_VERIFIED
+yarn_unverified:
+#endif
+  return Y->status;
+}
+#ifdef YARN_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+#undef yarn_hook_fetch
+#undef yarn_hook_call
+#undef yarn_hook_ret
+#undef yarn_unfuse
+#undef yarn_verified
+#undef yarn_verifiedip
+#undef yarn_check_target
+#undef yarn_mem_load
+#undef yarn_mem_store
+#undef yarn_mem_push
+#undef yarn_mem_pop
+#undef yarn_mem_reload
+#undef YARN_INTERPRET
+#undef YARN_INTERPRET_HOOKS
+#undef YARN_INTERPRET_VERIFIED
+#undef YARN_INTERPRET_PAGED
@@ -0,0 +1,405 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "yarn_pool.h"
+
+// Times an idle worker yields looking for work before it goes to sleep.
+#ifndef YARN_POOL_SPIN
+#define YARN_POOL_SPIN 64
+#endif
+// States a worker moves from the submission queue to its deque at once.
+#ifndef YARN_POOL_BATCH
+#define YARN_POOL_BATCH 16
+#endif
+// Initial deque capacity, must be a power of two.
+#ifndef YARN_POOL_DEQUESIZE
+#define YARN_POOL_DEQUESIZE 64
+#endif
+
+typedef struct yarn_task {
+  yarn_state *Y;
+  yarn_poolCallback callback;
+  void *userdata;
+  struct yarn_task *next;   // Submission queue link
+} yarn_task;
+
+typedef struct yarn_taskArray {
+  long size;
+  struct yarn_taskArray *retired; // Smaller arrays thieves may still be reading
+  _Atomic(yarn_task *) tasks[];
+} yarn_taskArray;
+
+// A worker and its Chase-Lev deque. Only the worker pushes at the bottom, and
+// everyone, the worker included, takes from the top. That makes the worker run
+// its own states round-robin instead of running the last one forever.
+typedef struct yarn_worker {
+  atomic_long top;
+  char pad0[64];            // Keep thieves and the owner off one cache line
+  atomic_long bottom;
+  _Atomic(yarn_taskArray *) array;
+  atomic_size_t instructioncount; // Only written by the worker
+  yarn_pool *P;
+  pthread_t thread;
+  unsigned int seed;        // Picks steal victims
+  char pad1[64];
+} yarn_worker;
+
+struct yarn_pool {
+  int slice;                // Instructions per turn
+  int nthreads;
+  yarn_worker *workers;
+  pthread_mutex_t lock;     // Guards the submission queue and sleeping
+  pthread_cond_t wake;      // Signalled when sleeping workers have work
+  pthread_cond_t done;      // Broadcast when nothing is pending
+  yarn_task *head, *tail;   // Submission queue
+  atomic_long queued;       // Length of the submission queue
+  atomic_long pending;      // Submitted states that haven't completed
+  atomic_int sleepers;
+  atomic_int stop;
+};
+
+static yarn_taskArray *yarn_taskArrayNew(long size) {
+  yarn_taskArray *a = malloc(sizeof(yarn_taskArray) + size*sizeof(a->tasks[0]));
+  if (a != NULL) {
+    a->size = size;
+    a->retired = NULL;
+  }
+  return a;
+}
+
+static long yarn_dequeSize(yarn_worker *W) {
+  long b = atomic_load(&W->bottom);
+  long t = atomic_load(&W->top);
+  return b - t;
+}
+
+// Owner only. Returns 0, or -1 if the deque was full and couldn't grow.
+static int yarn_dequePush(yarn_worker *W, yarn_task *task) {
+  long b = atomic_load_explicit(&W->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&W->top, memory_order_acquire);
+  yarn_taskArray *a = atomic_load_explicit(&W->array, memory_order_relaxed);
+
+  if (b - t >= a->size) {
+    yarn_taskArray *grown = yarn_taskArrayNew(a->size*2);
+    if (grown == NULL) {
+      return -1;
+    }
+    for (long i = t; i < b; i++) {
+      yarn_task *moved = atomic_load_explicit(&a->tasks[i & (a->size-1)],
+                                              memory_order_relaxed);
+      atomic_store_explicit(&grown->tasks[i & (grown->size-1)], moved,
+                            memory_order_relaxed);
+    }
+    grown->retired = a;
+    atomic_store_explicit(&W->array, grown, memory_order_release);
+    a = grown;
+  }
+  atomic_store_explicit(&a->tasks[b & (a->size-1)], task, memory_order_relaxed);
+  // Sequentially consistent so a worker going to sleep either sees the new
+  // state or is seen by yarn_poolNotify.
+  atomic_store(&W->bottom, b+1);
+  return 0;
+}
+
+// Takes the oldest state. Returns NULL if the deque is empty or another thread
+// took it first.
+static yarn_task *yarn_dequeSteal(yarn_worker *W) {
+  long t = atomic_load(&W->top);
+  long b = atomic_load(&W->bottom);
+  if (t < b) {
+    yarn_taskArray *a = atomic_load_explicit(&W->array, memory_order_acquire);
+    yarn_task *task = atomic_load_explicit(&a->tasks[t & (a->size-1)],
+                                           memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&W->top, &t, t+1,
+        memory_order_seq_cst, memory_order_relaxed)) {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// Wakes a sleeping worker, if there is one.
+static void yarn_poolNotify(yarn_pool *P) {
+  if (atomic_load(&P->sleepers) > 0) {
+    pthread_mutex_lock(&P->lock);
+    pthread_cond_signal(&P->wake);
+    pthread_mutex_unlock(&P->lock);
+  }
+}
+
+// Puts a task on the submission queue, for when a deque can't take it.
+static void yarn_poolEnqueue(yarn_pool *P, yarn_task *task) {
+  task->next = NULL;
+  pthread_mutex_lock(&P->lock);
+  if (P->tail != NULL) {
+    P->tail->next = task;
+  } else {
+    P->head = task;
+  }
+  P->tail = task;
+  atomic_fetch_add(&P->queued, 1);
+  if (atomic_load(&P->sleepers) > 0) {
+    pthread_cond_signal(&P->wake);
+  }
+  pthread_mutex_unlock(&P->lock);
+}
+
+// Takes a state off the submission queue, moving a batch more into the
+// worker's deque.
+static yarn_task *yarn_poolDequeue(yarn_worker *W) {
+  yarn_pool *P = W->P;
+  yarn_task *task;
+  long n = 0;
+
+  if (atomic_load(&P->queued) == 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&P->lock);
+  task = P->head;
+  if (task != NULL) {
+    P->head = task->next;
+    for (n = 1; n < YARN_POOL_BATCH && P->head != NULL; n++) {
+      yarn_task *extra = P->head;
+      if (yarn_dequePush(W, extra) != 0) {
+        break;
+      }
+      P->head = extra->next;
+    }
+    if (P->head == NULL) {
+      P->tail = NULL;
+    }
+    atomic_fetch_sub(&P->queued, n);
+  }
+  pthread_mutex_unlock(&P->lock);
+  if (n > 1) {
+    yarn_poolNotify(P);
+  }
+  return task;
+}
+
+static yarn_task *yarn_poolFind(yarn_worker *W) {
+  yarn_pool *P = W->P;
+  yarn_task *task;
+  int victim;
+
+  while (yarn_dequeSize(W) > 0) {
+    if ((task = yarn_dequeSteal(W)) != NULL) {
+      return task;
+    }
+  }
+  if ((task = yarn_poolDequeue(W)) != NULL) {
+    return task;
+  }
+  W->seed = W->seed*1103515245 + 12345;
+  victim = (W->seed >> 16) % P->nthreads;
+  for (int i = 0; i < P->nthreads; i++) {
+    yarn_worker *V = &P->workers[(victim + i) % P->nthreads];
+    if (V != W && (task = yarn_dequeSteal(V)) != NULL) {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// Sleeps until there may be work to steal or the pool stops. Workers only
+// count as having work to spare with more than one state queued, as the one
+// they just pushed is about to be taken again.
+static void yarn_poolSleep(yarn_worker *W) {
+  yarn_pool *P = W->P;
+  int work;
+
+  pthread_mutex_lock(&P->lock);
+  atomic_fetch_add(&P->sleepers, 1);
+  work = atomic_load(&P->stop) || atomic_load(&P->queued) > 0;
+  for (int i = 0; i < P->nthreads && !work; i++) {
+    work = yarn_dequeSize(&P->workers[i]) > 1;
+  }
+  if (!work) {
+    pthread_cond_wait(&P->wake, &P->lock);
+  }
+  atomic_fetch_sub(&P->sleepers, 1);
+  pthread_mutex_unlock(&P->lock);
+}
+
+static void yarn_poolRun(yarn_worker *W, yarn_task *task) {
+  yarn_pool *P = W->P;
+  yarn_state *Y = task->Y;
+  size_t before = yarn_getInstructionCount(Y);
+  int status = yarn_execute(Y, P->slice);
+  size_t count = atomic_load_explicit(&W->instructioncount,
+                                      memory_order_relaxed);
+
+  count += yarn_getInstructionCount(Y) - before;
+  atomic_store_explicit(&W->instructioncount, count, memory_order_relaxed);
+  if (status == YARN_STATUS_OK) {
+    // Wake someone to steal if this worker has states waiting.
+    int surplus = yarn_dequeSize(W) > 0;
+    if (yarn_dequePush(W, task) != 0) {
+      yarn_poolEnqueue(P, task);
+    } else if (surplus) {
+      yarn_poolNotify(P);
+    }
+  } else {
+    yarn_poolCallback callback = task->callback;
+    void *userdata = task->userdata;
+    free(task);
+    if (callback != NULL) {
+      callback(Y, status, userdata);
+    }
+    if (atomic_fetch_sub(&P->pending, 1) == 1) {
+      pthread_mutex_lock(&P->lock);
+      pthread_cond_broadcast(&P->done);
+      pthread_mutex_unlock(&P->lock);
+    }
+  }
+}
+
+static void *yarn_poolWorker(void *arg) {
+  yarn_worker *W = arg;
+  yarn_pool *P = W->P;
+  int idle = 0;
+
+  while (!atomic_load_explicit(&P->stop, memory_order_relaxed)) {
+    yarn_task *task = yarn_poolFind(W);
+    if (task != NULL) {
+      idle = 0;
+      yarn_poolRun(W, task);
+    } else if (idle++ < YARN_POOL_SPIN) {
+      sched_yield();
+    } else {
+      idle = 0;
+      yarn_poolSleep(W);
+    }
+  }
+  return NULL;
+}
+
+static void yarn_poolFree(yarn_pool *P) {
+  while (P->head != NULL) {
+    yarn_task *next = P->head->next;
+    free(P->head);
+    P->head = next;
+  }
+  for (int i = 0; i < P->nthreads; i++) {
+    yarn_worker *W = &P->workers[i];
+    yarn_taskArray *a = atomic_load(&W->array);
+    yarn_task *task;
+    while ((task = yarn_dequeSteal(W)) != NULL) {
+      free(task);
+    }
+    while (a != NULL) {
+      yarn_taskArray *retired = a->retired;
+      free(a);
+      a = retired;
+    }
+  }
+  pthread_mutex_destroy(&P->lock);
+  pthread_cond_destroy(&P->wake);
+  pthread_cond_destroy(&P->done);
+  free(P->workers);
+  free(P);
+}
+
+static void yarn_poolStop(yarn_pool *P, int started) {
+  atomic_store(&P->stop, 1);
+  pthread_mutex_lock(&P->lock);
+  pthread_cond_broadcast(&P->wake);
+  pthread_mutex_unlock(&P->lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(P->workers[i].thread, NULL);
+  }
+}
+
+yarn_pool *yarn_poolInit(int nthreads, int slice) {
+  yarn_pool *P = malloc(sizeof(yarn_pool));
+  int started = 0;
+
+  if (P == NULL) {
+    return NULL;
+  }
+  if (nthreads <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cores > 0 ? (int)cores : 1;
+  }
+  P->slice = slice > 0 ? slice : 1;
+  P->nthreads = nthreads;
+  P->head = P->tail = NULL;
+  atomic_init(&P->queued, 0);
+  atomic_init(&P->pending, 0);
+  atomic_init(&P->sleepers, 0);
+  atomic_init(&P->stop, 0);
+  P->workers = calloc(nthreads, sizeof(yarn_worker));
+  if (P->workers == NULL) {
+    free(P);
+    return NULL;
+  }
+  pthread_mutex_init(&P->lock, NULL);
+  pthread_cond_init(&P->wake, NULL);
+  pthread_cond_init(&P->done, NULL);
+  for (int i = 0; i < nthreads; i++) {
+    yarn_worker *W = &P->workers[i];
+    atomic_init(&W->top, 0);
+    atomic_init(&W->bottom, 0);
+    atomic_init(&W->array, yarn_taskArrayNew(YARN_POOL_DEQUESIZE));
+    atomic_init(&W->instructioncount, 0);
+    W->P = P;
+    W->seed = i + 1;
+    if (atomic_load(&W->array) == NULL) {
+      yarn_poolFree(P);
+      return NULL;
+    }
+  }
+  for (; started < nthreads; started++) {
+    if (pthread_create(&P->workers[started].thread, NULL, yarn_poolWorker,
+                       &P->workers[started]) != 0) {
+      yarn_poolStop(P, started);
+      yarn_poolFree(P);
+      return NULL;
+    }
+  }
+  return P;
+}
+
+void yarn_poolDestroy(yarn_pool *P) {
+  yarn_poolStop(P, P->nthreads);
+  yarn_poolFree(P);
+}
+
+int yarn_poolSubmit(yarn_pool *P, yarn_state *Y, yarn_poolCallback callback,
+                    void *userdata) {
+  yarn_task *task = malloc(sizeof(yarn_task));
+  if (task == NULL) {
+    return -1;
+  }
+  task->Y = Y;
+  task->callback = callback;
+  task->userdata = userdata;
+  atomic_fetch_add(&P->pending, 1);
+  yarn_poolEnqueue(P, task);
+  return 0;
+}
+
+void yarn_poolWait(yarn_pool *P) {
+  pthread_mutex_lock(&P->lock);
+  while (atomic_load(&P->pending) > 0) {
+    pthread_cond_wait(&P->done, &P->lock);
+  }
+  pthread_mutex_unlock(&P->lock);
+}
+
+int yarn_poolThreads(yarn_pool *P) {
+  return P->nthreads;
+}
+size_t yarn_poolInstructionCount(yarn_pool *P) {
+  size_t total = 0;
+  for (int i = 0; i < P->nthreads; i++) {
+    total += atomic_load_explicit(&P->workers[i].instructioncount,
+                                  memory_order_relaxed);
+  }
+  return total;
+}
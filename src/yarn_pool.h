@@ -0,0 +1,50 @@
+// Thread pool:
+//   Runs independent yarn_states on a set of worker threads. States don't
+//   share any mutable data, so each one can run on any core. Like the
+//   scheduler, a state gets `slice` instructions per turn and goes back into
+//   the queue between turns.
+//     P = yarn_poolInit(0, 10000);
+//     for (...) yarn_poolSubmit(P, Y, done, userdata);
+//     yarn_poolWait(P);
+//     yarn_poolDestroy(P);
+//
+//   Every worker owns a deque of states. It runs them round-robin, and when
+//   it has nothing to run it steals from the other workers. Once a state halts,
+//   pauses, suspends or fails it leaves the pool and its callback is called on
+//   the worker that ran it. The callback may submit the state again, e.g.
+//   after resuming it. A state must not be touched by the host while it is in the
+//   pool. The pool never destroys the states it is given.
+//
+//   Needs C11 atomics and pthreads, build with -std=c11 -pthread.
+
+#include "yarn.h"
+
+#ifndef YARN_POOL_H_
+#define YARN_POOL_H_
+
+typedef struct yarn_pool yarn_pool;
+
+// Called once a submitted state halts, pauses, suspends or fails.
+typedef void (*yarn_poolCallback)(yarn_state *Y, int status, void *userdata);
+
+// Creates a pool with nthreads workers (<= 0 for one per online core), giving
+// each state slice instructions per turn. Returns NULL on failure.
+yarn_pool *yarn_poolInit(int nthreads, int slice);
+// Stops the workers once they finish their current turn. States still in the
+// pool are dropped without their callbacks, call yarn_poolWait first to let
+// them finish.
+void yarn_poolDestroy(yarn_pool *P);
+
+// Queues a state to run, callback may be NULL. Returns 0, or -1 on failure.
+// Safe to call from any thread, including from a callback.
+int yarn_poolSubmit(yarn_pool *P, yarn_state *Y, yarn_poolCallback callback,
+                    void *userdata);
+// Blocks until every submitted state has left the pool and its callback has
+// returned.
+void yarn_poolWait(yarn_pool *P);
+
+int yarn_poolThreads(yarn_pool *P);
+// Total guest instructions run by this pool. Exact after yarn_poolWait.
+size_t yarn_poolInstructionCount(yarn_pool *P);
+
+#endif
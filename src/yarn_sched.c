@@ -0,0 +1,136 @@
+#include <stdlib.h>
+
+#include "yarn_sched.h"
+
+struct yarn_scheduler {
+  int slice;                // Instructions per turn
+  struct { yarn_state *Y; int status; } *states;
+  int count, capacity;
+  int *runnable;            // Ids in run order
+  int nrunnable;
+  int nparked;              // Paused or suspended, waiting on the host
+  size_t instructioncount;
+};
+
+// States with this status wait for yarn_schedulerResume or
+// yarn_schedulerComplete.
+static int yarn_schedulerParkedStatus(int status) {
+  return status == YARN_STATUS_PAUSE || status == YARN_STATUS_SUSPENDED;
+}
+
+yarn_scheduler *yarn_schedulerInit(int slice) {
+  yarn_scheduler *S = malloc(sizeof(yarn_scheduler));
+  if (S == NULL) {
+    return NULL;
+  }
+  S->slice = slice > 0 ? slice : 1;
+  S->states = NULL;
+  S->runnable = NULL;
+  S->count = S->capacity = S->nrunnable = S->nparked = 0;
+  S->instructioncount = 0;
+  return S;
+}
+
+void yarn_schedulerDestroy(yarn_scheduler *S) {
+  free(S->states);
+  free(S->runnable);
+  free(S);
+}
+
+int yarn_schedulerAdd(yarn_scheduler *S, yarn_state *Y) {
+  if (S->count == S->capacity) {
+    int capacity = S->capacity ? S->capacity*2 : 16;
+    void *states = realloc(S->states, capacity*sizeof(*S->states));
+    void *runnable;
+    if (states == NULL) {
+      return -1;
+    }
+    S->states = states;
+    runnable = realloc(S->runnable, capacity*sizeof(*S->runnable));
+    if (runnable == NULL) {
+      return -1;
+    }
+    S->runnable = runnable;
+    S->capacity = capacity;
+  }
+  S->states[S->count].Y = Y;
+  S->states[S->count].status = yarn_getStatus(Y);
+  if (S->states[S->count].status == YARN_STATUS_OK) {
+    S->runnable[S->nrunnable++] = S->count;
+  } else if (yarn_schedulerParkedStatus(S->states[S->count].status)) {
+    S->nparked++;
+  }
+  return S->count++;
+}
+
+int yarn_schedulerRun(yarn_scheduler *S, int rounds) {
+  while (S->nrunnable > 0 && (rounds > 0 || rounds == -1)) {
+    int kept = 0;
+    // Give every runnable state one slice, keeping the ones that are still
+    // runnable in order.
+    for (int i = 0; i < S->nrunnable; i++) {
+      int id = S->runnable[i];
+      yarn_state *Y = S->states[id].Y;
+      size_t before = yarn_getInstructionCount(Y);
+      int status = yarn_execute(Y, S->slice);
+      S->instructioncount += yarn_getInstructionCount(Y) - before;
+      S->states[id].status = status;
+      if (status == YARN_STATUS_OK) {
+        S->runnable[kept++] = id;
+      } else if (yarn_schedulerParkedStatus(status)) {
+        S->nparked++;
+      }
+    }
+    S->nrunnable = kept;
+    if (rounds != -1) {
+      rounds--;
+    }
+  }
+  return S->nrunnable + S->nparked;
+}
+
+int yarn_schedulerResume(yarn_scheduler *S, int id) {
+  if (id < 0 || id >= S->count || S->states[id].status != YARN_STATUS_PAUSE) {
+    return -1;
+  }
+  yarn_setStatus(S->states[id].Y, YARN_STATUS_OK);
+  S->states[id].status = YARN_STATUS_OK;
+  S->runnable[S->nrunnable++] = id;
+  S->nparked--;
+  return 0;
+}
+
+int yarn_schedulerComplete(yarn_scheduler *S, int id, yarn_uint token,
+                           yarn_uint result) {
+  if (id < 0 || id >= S->count ||
+      S->states[id].status != YARN_STATUS_SUSPENDED ||
+      yarn_resume(S->states[id].Y, token, result) != 0) {
+    return -1;
+  }
+  S->states[id].status = YARN_STATUS_OK;
+  S->runnable[S->nrunnable++] = id;
+  S->nparked--;
+  return 0;
+}
+
+int yarn_schedulerCount(yarn_scheduler *S) {
+  return S->count;
+}
+int yarn_schedulerParked(yarn_scheduler *S) {
+  return S->nparked;
+}
+yarn_state *yarn_schedulerState(yarn_scheduler *S, int id) {
+  if (id < 0 || id >= S->count) {
+    return NULL;
+  }
+  return S->states[id].Y;
+}
+int yarn_schedulerStatus(yarn_scheduler *S, int id) {
+  if (id < 0 || id >= S->count) {
+    return -1;
+  }
+  return S->states[id].status;
+}
+size_t yarn_schedulerInstructionCount(yarn_scheduler *S) {
+  return S->instructioncount;
+}
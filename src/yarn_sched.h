@@ -0,0 +1,54 @@
+// Scheduler:
+//   Runs many independent yarn_states round-robin on the calling thread. Each
+//   turn gives a state `slice` instructions through yarn_execute's icount, so
+//   no state can starve the others.
+//     S = yarn_schedulerInit(1000);
+//     for (...) yarn_schedulerAdd(S, Y);
+//     while (yarn_schedulerRun(S, -1) > 0) {
+//       ...nothing is runnable, resume or complete the parked states...
+//     }
+//     yarn_schedulerDestroy(S);
+//
+//   States that pause are parked until yarn_schedulerResume is called for
+//   them, states that suspend in an asynchronous syscall until
+//   yarn_schedulerComplete is. States that halt or fail are retired, their
+//   final status stays available through yarn_schedulerStatus. The scheduler
+//   never destroys the states it is given.
+
+#include "yarn.h"
+
+#ifndef YARN_SCHED_H_
+#define YARN_SCHED_H_
+
+typedef struct yarn_scheduler yarn_scheduler;
+
+// Creates a scheduler giving each state slice instructions per turn. Returns
+// NULL on failure.
+yarn_scheduler *yarn_schedulerInit(int slice);
+void yarn_schedulerDestroy(yarn_scheduler *S);
+
+// Adds a state, returns its id or -1 on failure.
+int yarn_schedulerAdd(yarn_scheduler *S, yarn_state *Y);
+// Runs up to rounds rounds (-1 until nothing is runnable). Returns the number
+// of states not retired yet, runnable or parked.
+int yarn_schedulerRun(yarn_scheduler *S, int rounds);
+// Number of parked states, paused or suspended.
+int yarn_schedulerParked(yarn_scheduler *S);
+// Makes a parked (paused) state runnable again. Returns 0, or -1 if the state
+// wasn't parked.
+int yarn_schedulerResume(yarn_scheduler *S, int id);
+// Completes the asynchronous syscall a parked state is suspended on with
+// result, see yarn_resume, and makes it runnable again. Returns 0, or -1 if
+// the state isn't suspended on token.
+int yarn_schedulerComplete(yarn_scheduler *S, int id, yarn_uint token,
+                           yarn_uint result);
+
+int yarn_schedulerCount(yarn_scheduler *S);
+yarn_state *yarn_schedulerState(yarn_scheduler *S, int id);
+// Status of the state as of its last turn, YARN_STATUS_PAUSE or
+// YARN_STATUS_SUSPENDED if parked.
+int yarn_schedulerStatus(yarn_scheduler *S, int id);
+// Total guest instructions run by this scheduler.
+size_t yarn_schedulerInstructionCount(yarn_scheduler *S);
+
+#endif
@@ -13,6 +13,7 @@ Number:
     $1512
     or
     0x1242
+    A w after either counts in words, $2w is 8 or 16 with -w64
 
 Register:
     %ret
@@ -130,7 +131,7 @@ instruction_types["mov"] = "move"
 memcase = re.compile(r"^\*\((.+?)\)") #Matches memory expressions
 
 regre = r"%(?P<reg>\w+)"
-litre = r"(?P<dtype>-?0x|\$-?)(?P<d>[0-9a-fA-F]+)"
+litre = r"(?P<dtype>-?0x|\$-?)(?P<d>[0-9a-fA-F]+)(?P<words>w?)"
 locre = r":(?P<loc>\w+)"
 
 symcase1 = re.compile("^"+regre+"$") # Matches %ret and similar
@@ -152,6 +153,7 @@ def parseSymbol(sym):
     reg = "null"
     dtype = ""
     d = ""
+    words = ""
     loc = ""
     m = memcase.match(sym)
     if m:
@@ -167,11 +169,13 @@ def parseSymbol(sym):
         reg = m.group("reg")
         dtype = m.group("dtype")
         d = m.group("d")
+        words = m.group("words")
 
     m = symcase3.match(sym)
     if m: # If it looks like $123A2 and similar
         dtype = m.group("dtype")
         d = m.group("d")
+        words = m.group("words")
 
     m = symcase4.match(sym)
     if m: # If it looks like :Init and similar
@@ -189,9 +193,49 @@ def parseSymbol(sym):
             info["d"] = int(d)
         else:
             info["d"] = int(d, 16)
+        if words:
+            info["d"] *= BITS//8
 
     return info
 
+# Relocatable objects, see the comment above yarn_objectInit in src/yarn.c.
+OBJECT_MAGIC = b"yarnobj1"
+SYMBOL_DEFINED = 1
+SYMBOL_EXPORTED = 2
+
+# Writes code as a relocatable object. Every label reference in relocations
+# becomes a relocation against its symbol, labels that aren't defined become
+# imports.
+def writeObject(path, objectcode, locations, exports, relocations):
+    symbols = sorted(locations, key=locations.get)
+    for offset, loc in relocations:
+        if loc not in symbols:
+            symbols.append(loc)
+    index = {}
+    names = bytes()
+    table = bytes()
+    for i, sym in enumerate(symbols):
+        index[sym] = i
+        flags = 0
+        if sym in locations:
+            flags |= SYMBOL_DEFINED
+        if sym in exports:
+            flags |= SYMBOL_EXPORTED
+        table += struct.pack("<III", len(names), locations.get(sym, 0), flags)
+        names += sym.encode("ascii") + b"\0"
+    relocs = bytes()
+    for offset, loc in relocations:
+        relocs += struct.pack("<II", offset, index[loc])
+
+    with open(path,'wb') as f:
+        f.write(OBJECT_MAGIC)
+        f.write(struct.pack("<IIII", len(objectcode), len(symbols),
+                            len(relocations), len(names)))
+        f.write(objectcode)
+        f.write(table)
+        f.write(relocs)
+        f.write(names)
+
 def expectRegister(sym):
     r = 0
     if sym[0] == "%":
@@ -206,22 +250,361 @@ def expectRegister(sym):
 
     return r
 
+# Instructions are parsed into dictionaries first, so -O can rewrite them
+# before they are encoded:
+#   name    mnemonic, with mov resolved to irmov/mrmov/rrmov/rmmov
+#   rA, rB  register numbers
+#   d       immediate, as an unsigned number of BITS bits
+#   loc     key of the label a branch goes to, None for d
+#   labels  keys of the labels naming the instruction's address
+# A label key is (name, n) for the n'th definition of name. A reference binds
+# to the definition before it or, when there is none yet, to the last one.
+# The last instruction is always an end marker without a name, holding the
+# labels after the code.
+BITS = 32
+MASK = 0xFFFFFFFF
+WORD = "I" # struct format of an immediate
+sizes = {
+    "control": 1,
+    "arith": 6,
+    "move": 6,
+    "stack": 2,
+    "branch": 5,
+    "conditional": 2
+}
+
+def parseInstruction(linenum, ins, args):
+    ins_type = instruction_types[ins]
+    inst = {
+        "name": ins,
+        "rA": registers["null"],
+        "rB": registers["null"],
+        "d": 0,
+        "loc": None,
+        "labels": [],
+        "line": linenum
+    }
+    if ins_type == "stack":
+        inst["rA"] = parseSymbol(args[0])['reg']
+    elif ins_type == "move":  #TODO: Better arg parsing so we can do rm and mr moves
+        infoA = parseSymbol(args[0])
+        infoB = parseSymbol(args[1])
+        rA = infoA["reg"]
+        rB = infoB["reg"]
+        if infoA["type"] == "mem" and infoB["type"] != "mem":
+            inst["name"] = "mrmov"
+            inst["d"] = infoA["d"]
+        elif infoA["type"] != "mem" and infoB["type"] == "mem":
+            inst["name"] = "rmmov"
+            inst["d"] = infoB["d"]
+        elif rA == registers["null"] and infoB["type"] != "mem":
+            inst["name"] = "irmov"
+            inst["d"] = infoA["d"]
+        elif rA != registers["null"] and rB != registers["null"] and infoB["type"] != "mem":
+            inst["name"] = "rrmov"
+            inst["d"] = infoA["d"]
+        else:
+            raise AssembleError(linenum,"Invalid mov statement.")
+        inst["rA"] = rA
+        inst["rB"] = rB
+    elif ins_type == "arith":
+        infoA = parseSymbol(args[0])
+        infoB = parseSymbol(args[1])
+        inst["d"] = infoA['d']
+        inst["rA"] = infoA['reg']
+        inst["rB"] = infoB['reg']
+    elif ins_type == "branch":
+        if len(args) > 0:
+            info = parseSymbol(args[0])
+            inst["d"] = info["d"]
+            if info["loc"]:
+                inst["loc"] = info["loc"]
+    elif ins_type == "conditional":
+        inst["rA"] = parseSymbol(args[0])['reg']
+        inst["rB"] = parseSymbol(args[1])['reg']
+    inst["d"] &= MASK
+    return inst
+
+def encodeInstruction(inst, d):
+    ins_type = instruction_types[inst["name"]]
+    ins_id = icodes[ins_type] << 4 | ifuns[ins_type].index(inst["name"])
+    if ins_type == "control":
+        return struct.pack("=B", ins_id)
+    elif ins_type == "stack":
+        return struct.pack("=BB", ins_id, inst["rA"]<<4)
+    elif ins_type == "branch":
+        return struct.pack("=B"+WORD, ins_id, d)
+    elif ins_type == "conditional":
+        return struct.pack("=BB", ins_id, inst["rA"]<<4|inst["rB"])
+    return struct.pack("=BB"+WORD, ins_id, inst["rA"]<<4|inst["rB"], d)
+
+"""
+The optimizer, run with -O. It rewrites the instruction list until nothing
+changes any more:
+  * Peephole: drops nops, moves of a register to itself, arithmetic with an
+    identity immediate (add $0, mul $1, ...), push/pop pairs of a register
+    and immediates overwritten before they are read, and turns a push/pop pair
+    of two registers into a move.
+  * Constant folding: an immediate move followed by arithmetic with an
+    immediate on the same register becomes one move, and two immediate
+    operations of the same kind on a register become one.
+  * Jump threading: a branch to a jmp goes to its target directly, a jmp to a
+    halt or ret becomes one, and branches to the next instruction are dropped.
+    A conditional, jif and jmp that only jumps over the next instruction
+    become the opposite conditional and one jif, like the end of a loop.
+  * Dead code: instructions after a halt, jmp or ret are dropped up to the
+    next label.
+Every label stays where its code went, so all of them still work as entry
+points. Rewrites never span a label. Memory below the stack pointer, which
+push/pop pairs leave behind, isn't kept the same, and the conditional flag is
+taken to be dead after a call, ret or syscall. Code that uses %ins as a
+register or branches to a literal address depends on where instructions are,
+and is left alone.
+"""
+NULL = registers["null"]
+STK = registers["stk"]
+IDENTITY = {"add": 0, "sub": 0, "or": 0, "xor": 0, "lsh": 0, "rsh": 0,
+            "rshs": 0, "mul": 1, "div": 1, "divs": 1, "and": MASK}
+# Instructions that write rB, read nothing but rA and can't fault
+PURE = ["irmov", "rrmov", "add", "sub", "mul", "lsh", "rsh", "rshs", "and",
+        "or", "xor", "not"]
+
+def signed(v):
+    return v - (1 << BITS) if v >> (BITS-1) else v
+
+# The value of "op $b, %x" when %x holds a, None when the VM would fault or C
+# leaves it undefined.
+def fold(op, a, b):
+    if op == "add":
+        return (a + b) & MASK
+    elif op == "sub":
+        return (a - b) & MASK
+    elif op == "mul":
+        return (a * b) & MASK
+    elif op == "div":
+        return a // b if b != 0 else None
+    elif op == "divs":
+        if b == 0 or (signed(a) == -2**(BITS-1) and signed(b) == -1):
+            return None
+        q = abs(signed(a)) // abs(signed(b))
+        return (q if (signed(a) < 0) == (signed(b) < 0) else -q) & MASK
+    elif op == "lsh":
+        return (a << b) & MASK if b < BITS else None
+    elif op == "rsh":
+        return a >> b if b < BITS else None
+    elif op == "rshs":
+        return (signed(a) >> b) & MASK if b < BITS else None
+    elif op == "and":
+        return a & b
+    elif op == "or":
+        return a | b
+    elif op == "xor":
+        return a ^ b
+    elif op == "not":
+        return ~b & MASK
+    return None
+
+# The one instruction doing "op $a" then "op $b", None if there is none.
+def combine(op1, a, op2, b):
+    if op1 in ("add", "sub") and op2 in ("add", "sub"):
+        a = a if op1 == "add" else -a
+        b = b if op2 == "add" else -b
+        return ("add", (a + b) & MASK)
+    if op1 != op2:
+        return None
+    if op1 in ("lsh", "rsh", "rshs"):
+        return (op1, a + b) if a + b < BITS else None
+    if op1 in ("mul", "and", "or", "xor"):
+        return (op1, fold(op1, a, b))
+    return None
+
+# Targets a VM built with -DYARN_64BIT for bits = 64: immediates, and so arith,
+# move and branch instructions, get wider and objects get their own magic.
+def setWordSize(bits):
+    global BITS, MASK, WORD, OBJECT_MAGIC
+    BITS = bits
+    MASK = (1 << bits) - 1
+    WORD = "Q" if bits == 64 else "I"
+    OBJECT_MAGIC = b"yarnob64" if bits == 64 else b"yarnobj1"
+    sizes["arith"] = sizes["move"] = 2 + bits//8
+    sizes["branch"] = 1 + bits//8
+    IDENTITY["and"] = MASK
+
+# Conditional giving the opposite flag, with its registers swapped or not.
+NEGATE = {"lt": ("lte", True), "lte": ("lt", True), "lts": ("ltes", True),
+          "ltes": ("lts", True), "eq": ("neq", False), "neq": ("eq", False)}
+
+def unsafe(code):
+    for inst in code[:-1]:
+        ins_type = instruction_types[inst["name"]]
+        if ins_type in ("arith", "move", "stack", "conditional") and \
+           registers["ins"] in (inst["rA"], inst["rB"]):
+            return "line %d uses %%ins"%(inst["line"]+1)
+        if inst["name"] in ("call", "jmp", "jif") and inst["loc"] is None:
+            return "line %d branches to an address"%(inst["line"]+1)
+    return None
+
+# Drops code[i], its labels name the instruction after it now.
+def remove(code, i):
+    code[i+1]["labels"] = code[i]["labels"] + code[i+1]["labels"]
+    del code[i]
+
+def target(code, loc):
+    for i, inst in enumerate(code):
+        if loc in inst["labels"]:
+            return i
+    return None
+
+def writesOnly(inst, reg):
+    if inst["name"] in ("irmov", "rrmov", "mrmov", "not"):
+        return inst["rB"] == reg and inst["rA"] != reg
+    return inst["name"] == "pop" and inst["rA"] == reg and reg != STK
+
+# Whether every path from code[i] sets the conditional flag before reading it.
+# i is None for a label that isn't in code, which could read it.
+def flagDead(code, i, steps=64):
+    while steps > 0:
+        if i is None:
+            return False
+        name = code[i]["name"]
+        if name is None or name in NEGATE or \
+           name in ("call", "ret", "syscall", "halt"):
+            return True
+        if name in ("jif", "pause"):
+            return False
+        if name == "jmp":
+            i = target(code, code[i]["loc"])
+        else:
+            i += 1
+        steps -= 1
+    return False
+
+def peephole(code):
+    changed = False
+    i = 0
+    while i < len(code)-1:
+        cur = code[i]
+        nxt = code[i+1]
+        # Two instruction patterns can't have a label in between
+        pair = nxt["name"] is not None and not nxt["labels"]
+        name = cur["name"]
+        if name == "nop" or \
+           (name == "rrmov" and cur["rA"] == cur["rB"] and cur["rA"] != NULL) or \
+           (name in IDENTITY and cur["rA"] == NULL and cur["d"] == IDENTITY[name]):
+            remove(code, i)
+        elif name in ("jmp", "jif") and target(code, cur["loc"]) == i+1:
+            remove(code, i)
+        elif pair and name == "jif" and nxt["name"] == "jmp" and \
+             target(code, cur["loc"]) == target(code, nxt["loc"]):
+            remove(code, i)
+        elif pair and name in NEGATE and nxt["name"] == "jif" and \
+             code[i+2]["name"] == "jmp" and not code[i+2]["labels"] and \
+             target(code, nxt["loc"]) == i+3 and \
+             flagDead(code, i+3) and flagDead(code, target(code, code[i+2]["loc"])):
+            cur["name"], swap = NEGATE[name]
+            if swap:
+                cur["rA"], cur["rB"] = cur["rB"], cur["rA"]
+            nxt["loc"] = code[i+2]["loc"]
+            remove(code, i+2)
+        elif pair and name == "irmov" and cur["rA"] == NULL and \
+             instruction_types[nxt["name"]] == "arith" and nxt["rA"] == NULL and \
+             nxt["rB"] == cur["rB"] and fold(nxt["name"], cur["d"], nxt["d"]) is not None:
+            cur["d"] = fold(nxt["name"], cur["d"], nxt["d"])
+            remove(code, i+1)
+        elif pair and name in IDENTITY and cur["rA"] == NULL and \
+             nxt["name"] in IDENTITY and nxt["rA"] == NULL and nxt["rB"] == cur["rB"] and \
+             combine(name, cur["d"], nxt["name"], nxt["d"]) is not None:
+            cur["name"], cur["d"] = combine(name, cur["d"], nxt["name"], nxt["d"])
+            remove(code, i+1)
+        elif pair and name == "push" and nxt["name"] == "pop" and \
+             NULL not in (cur["rA"], nxt["rA"]) and STK not in (cur["rA"], nxt["rA"]):
+            if cur["rA"] == nxt["rA"]:
+                remove(code, i)
+                remove(code, i)
+            else:
+                cur["name"], cur["rB"], cur["d"] = "rrmov", nxt["rA"], 0
+                remove(code, i+1)
+        elif pair and name in PURE and writesOnly(nxt, cur["rB"]):
+            remove(code, i)
+        else:
+            i += 1
+            continue
+        changed = True
+    return changed
+
+def thread(code):
+    changed = False
+    for inst in code[:-1]:
+        if inst["name"] not in ("call", "jmp", "jif"):
+            continue
+        loc = inst["loc"]
+        seen = set()
+        t = target(code, loc)
+        while t is not None and code[t]["name"] == "jmp" and t not in seen:
+            seen.add(t)
+            loc = code[t]["loc"]
+            t = target(code, loc)
+        if loc != inst["loc"]:
+            inst["loc"] = loc
+            changed = True
+        if inst["name"] == "jmp" and t is not None and code[t]["name"] in ("halt", "ret"):
+            inst["name"], inst["d"], inst["loc"] = code[t]["name"], code[t]["d"], None
+            changed = True
+    return changed
+
+def deadcode(code):
+    changed = False
+    for i in range(len(code)-1):
+        if i+1 >= len(code)-1:
+            break
+        if code[i]["name"] in ("halt", "jmp", "ret"):
+            while code[i+1]["name"] is not None and not code[i+1]["labels"]:
+                del code[i+1]
+                changed = True
+    return changed
+
+# Returns the reason code was left alone, or None.
+def optimize(code):
+    reason = unsafe(code)
+    if reason:
+        return reason
+    while True:
+        changed = False
+        for rewrite in (peephole, thread, deadcode):
+            changed = rewrite(code) or changed
+        if not changed:
+            return None
+
 if __name__ == "__main__":
     outpath = ""
-    if len(sys.argv) < 2:
+    # -c writes a relocatable object to link, instead of code to run as is
+    relocatable = "-c" in sys.argv[1:]
+    # -O optimizes the code, see optimize
+    optimizing = "-O" in sys.argv[1:]
+    # -w64 assembles for a YARN_64BIT build, see setWordSize
+    if "-w64" in sys.argv[1:]:
+        setWordSize(64)
+    argv = [sys.argv[0]] + [a for a in sys.argv[1:]
+                            if a not in ("-c", "-O", "-w64")]
+    if len(argv) < 2:
         print("Must provide an input path.")
         sys.exit()
 
-    if len(sys.argv) >= 3:
-        outpath = sys.argv[2]
+    if len(argv) >= 3:
+        outpath = argv[2]
     else:
-        outpath = os.path.splitext(sys.argv[1])[0]+".o"
-
-    objectcode = bytes()
-    locations = {}
-    lookbacks = {}
-    with open(sys.argv[1],'r') as f:
-        nextlocation = None
+        outpath = os.path.splitext(argv[1])[0]+".o"
+    # Optionally write out where each label ended up, for tools/trace.py
+    labelpath = None
+    if len(argv) >= 4:
+        labelpath = argv[3]
+
+    code = []
+    labels = []
+    definitions = {}
+    exports = set()
+    linenum = 0
+    with open(argv[1],'r') as f:
         for linenum, line in enumerate(f):
             #Basic commenting
             if line.find(";") != -1:
@@ -236,97 +619,83 @@ if __name__ == "__main__":
             if len(syms) > 1:
                 args = syms[1].split(",")
 
+            if syms[0] == ".export":
+                # Lets other objects import the label, see -c
+                for arg in args:
+                    exports.add(arg.strip())
+                continue
+
             if syms[0][-1] == ":":
-                nextlocation = syms[0][:-1]
+                name = syms[0][:-1]
+                definitions[name] = definitions.get(name, 0) + 1
+                labels.append((name, definitions[name]))
                 continue
+
+            inst = parseInstruction(linenum, syms[0], args)
+            if inst["loc"]:
+                inst["loc"] = (inst["loc"], definitions.get(inst["loc"]))
+            inst["labels"] = labels
+            labels = []
+            code.append(inst)
+    code.append({"name": None, "labels": labels, "line": linenum})
+    # Forward references go to the last definition
+    for inst in code:
+        if inst.get("loc") and inst["loc"][1] is None and inst["loc"][0] in definitions:
+            inst["loc"] = (inst["loc"][0], definitions[inst["loc"][0]])
+
+    if optimizing:
+        before = len(code)-1
+        reason = optimize(code)
+        if reason:
+            print("%s: not optimized, %s"%(argv[1], reason))
+        else:
+            print("%s: %d instructions, %d after optimizing"%(argv[1], before, len(code)-1))
+
+    addresses = {}
+    address = 0
+    for inst in code:
+        for key in inst["labels"]:
+            addresses[key] = address
+        if inst["name"] is not None:
+            address += sizes[instruction_types[inst["name"]]]
+    locations = {}
+    for name in definitions:
+        locations[name] = addresses[(name, definitions[name])]
+
+    # A reference to an earlier definition of a label that is defined again
+    # relocates against a symbol of its own, "name;n" can't be a label.
+    symbolLocations = dict(locations)
+    def symbol(loc):
+        name, n = loc
+        if n is None or n == definitions[name]:
+            return name
+        symbolLocations["%s;%d"%loc] = addresses[loc]
+        return "%s;%d"%loc
+
+    objectcode = bytes()
+    relocations = []
+    for inst in code[:-1]:
+        d = inst["d"]
+        if inst["loc"]:
+            if relocatable:
+                relocations.append((len(objectcode)+1, symbol(inst["loc"])))
+            elif inst["loc"] in addresses:
+                d = addresses[inst["loc"]]
             else:
-                if nextlocation != None:
-                    locations[nextlocation] = len(objectcode)
-                    nextlocation = None
-
-                ins = syms[0]
-                ins_type = instruction_types[ins]
-                ins_id = 0
-                ins_id = icodes[ins_type] << 4
-                if ins_type != "move":
-                    ins_id |= ifuns[ins_type].index(ins)
-
-                if ins_type == "control":
-                    objectcode += struct.pack("=B", ins_id)
-                elif ins_type == "stack":
-                    rA = parseSymbol(args[0])['reg']
-                    objectcode += struct.pack("=BB", ins_id, rA<<4)
-                elif ins_type == "move":  #TODO: Better arg parsing so we can do rm and mr moves
-                    infoA = parseSymbol(args[0])
-                    infoB = parseSymbol(args[1])
-                    d = 0
-                    dstruct = "I"
-                    rA = infoA["reg"]
-                    rB = infoB["reg"]
-                    movtype = "rrmov"
-                    if infoA["type"] == "mem" and infoB["type"] != "mem":
-                        movtype = "mrmov"
-                        d = infoA["d"]
-                        dstruct = infoA["dstruct"]
-                    elif infoA["type"] != "mem" and infoB["type"] == "mem":
-                        movtype = "rmmov"
-                        d = infoB["d"]
-                        dstruct = infoB["dstruct"]
-                    elif rA == registers["null"] and infoB["type"] != "mem":
-                        movtype = "irmov"
-                        d = infoA["d"]
-                        dstruct = infoA["dstruct"]
-                    elif rA != registers["null"] and rB != registers["null"] and infoB["type"] != "mem":
-                        movtype = "rrmov"
-                        d = infoA["d"]
-                        dstruct = infoA["dstruct"]
-                    else:
-                        raise AssembleError(linenum,"Invalid mov statement.")
-
-                    # print("Move: %s %X %X %d"%(movtype,rA,rB,d))
-
-                    ins_id |= ifuns[ins_type].index(movtype)
-                    objectcode += struct.pack("=BB%s"%dstruct, ins_id, rA<<4|rB,d)
-
-                elif ins_type == "arith":
-                    infoA = parseSymbol(args[0])
-                    infoB = parseSymbol(args[1])
-                    d = infoA['d']
-                    dstruct = infoA['dstruct']
-                    rA = infoA['reg']
-                    rB = infoB['reg']
-                    objectcode += struct.pack("=BB%s"%dstruct, ins_id, rA<<4|rB,d)
-
-                elif ins_type == "branch":
-                    d = 0
-                    dstruct = "I"
-                    if len(args) > 0:
-                        info = parseSymbol(args[0])
-                        d = info["d"]
-                        dstruct = info["dstruct"]
-                        if info["loc"]:
-                            if info["loc"] in locations:
-                                d = locations[info["loc"]]
-                            else:
-                                # Add this location to our lookbacks
-                                lookbacks[len(objectcode)] = info["loc"]
-
-                    objectcode += struct.pack("=B%s"%dstruct, ins_id, d)
-
-                elif ins_type == "conditional":
-                    rA = parseSymbol(args[0])['reg']
-                    rB = parseSymbol(args[1])['reg']
-                    objectcode += struct.pack("=BB", ins_id, (rA<<4)|rB)
-
-    for lb in lookbacks:
-        #Extract our object code on either side of our lookback.
-        o1 = objectcode[:lb+1]
-        o2 = objectcode[lb+5:]
-        loc = lookbacks[lb]
-        if not loc in locations:
-            raise(AssembleError(linenum,"Invalid location: %s"%lookbacks[lb]))
-
-        objectcode = o1 + struct.pack("=I", locations[loc]) + o2
-
-    with open(outpath,'wb') as f:
-        f.write(objectcode)
+                raise(AssembleError(inst["line"],"Invalid location: %s"%inst["loc"][0]))
+        objectcode += encodeInstruction(inst, d)
+
+    for loc in sorted(exports):
+        if loc not in locations:
+            raise(AssembleError(linenum,"Exported location not defined: %s"%loc))
+
+    if relocatable:
+        writeObject(outpath, objectcode, symbolLocations, exports, relocations)
+    else:
+        with open(outpath,'wb') as f:
+            f.write(objectcode)
+
+    if labelpath:
+        with open(labelpath,'w') as f:
+            for loc in sorted(locations, key=locations.get):
+                f.write("0x%08X %s\n"%(locations[loc],loc))
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# -*- coding: ascii -*-
+
+import sys
+import struct
+import bisect
+
+from assemble import icodes, ifuns, registers
+
+"""
+Prints a trace written by `./bin/yarn code.o -tcode.trace`, one instruction per
+line. Given the labels written by `./tools/assemble.py code.asm code.o
+code.labels`, addresses are shown relative to the label before them:
+
+    ./tools/trace.py code.trace code.labels
+
+Each line has the instruction count, the ip, the instruction, the register it
+wrote and what it left there, and the memory it read or wrote. Traces of a
+YARN_64BIT build work the same way.
+"""
+
+# ip, value, addr, op, reg, access, flags, by the magic of the trace. A
+# YARN_64BIT build writes 64 bit words, padded to a multiple of 8.
+RECORDS = {
+    b"yarntrc1": struct.Struct("=IIIBBBB"),
+    b"yarntr64": struct.Struct("=QQQBBBB4x"),
+}
+
+ACCESS_READ = 1
+ACCESS_WRITE = 2
+FLAG_CONDITIONAL = 0
+
+names = {}
+for ins_type in ifuns:
+    for ifun, ins in enumerate(ifuns[ins_type]):
+        names[icodes[ins_type] << 4 | ifun] = ins
+
+regnames = {}
+for reg in registers:
+    regnames[registers[reg]] = reg
+
+def loadLabels(path):
+    labels = []
+    with open(path,'r') as f:
+        for line in f:
+            line = line.strip()
+            if line == "":
+                continue
+            addr, name = line.split(" ",1)
+            labels.append((int(addr,16), name))
+    labels.sort()
+    return labels
+
+def location(labels, ip):
+    i = bisect.bisect_right(labels, (ip, "\xff")) - 1
+    if i < 0:
+        return "0x%08X"%ip
+    addr, name = labels[i]
+    return "%s+0x%X"%(name, ip-addr)
+
+def describe(labels, count, record):
+    ip, value, addr, op, reg, access, flags = record
+    line = "%8d  %-16s %-8s"%(count, location(labels, ip), names.get(op, "0x%02X"%op))
+    if reg != registers["null"]:
+        line += " %%%-4s = 0x%08X"%(regnames[reg], value)
+    else:
+        line += " "*18
+    if access == ACCESS_READ:
+        line += "  read  0x%08X"%addr
+    elif access == ACCESS_WRITE:
+        line += "  write 0x%08X"%addr
+    elif (op & 0xF0) == icodes["conditional"] << 4:
+        line += "  %s"%("true" if (flags >> FLAG_CONDITIONAL) & 1 else "false")
+    return line.rstrip()
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        print("Must provide a trace path.")
+        sys.exit()
+
+    labels = []
+    if len(sys.argv) >= 3:
+        labels = loadLabels(sys.argv[2])
+
+    with open(sys.argv[1],'rb') as f:
+        record = RECORDS.get(f.read(8))
+        if record is None:
+            print("Not a yarn trace: %s"%sys.argv[1])
+            sys.exit(1)
+        count = 0
+        while True:
+            data = f.read(record.size)
+            if len(data) < record.size:
+                break
+            print(describe(labels, count, record.unpack(data)))
+            count += 1